@@ -0,0 +1,241 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <CppAwait/Awaitable.h>
+#include <CppAwait/Condition.h>
+#include <CppAwait/BoundedQueue.h>
+#include <CppAwait/AsioWrappers.h>
+#include <CppAwait/misc/Signals.h>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+//
+// Counts heap allocations on hot paths in steady state
+//
+// Global operator new is replaced in this executable, which is why it's not
+// part of the examples. Each operation runs a few warm-up rounds so that pools
+// and containers reach their working size, then allocations are counted over
+// many rounds. An operation allocating more than its budget is reported as a
+// regression and the exit code is non-zero.
+//
+// Budgets are the exact steady state counts over NUM_ROUNDS. Lower them
+// when an allocation gets removed.
+//
+
+static std::atomic<size_t> sNumAllocs(0);
+
+void* operator new(std::size_t size)
+{
+    sNumAllocs++;
+
+    if (void *p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+
+static const int NUM_WARMUP_ROUNDS = 100;
+static const int NUM_ROUNDS = 1000;
+
+static int sNumRegressions = 0;
+
+// runs op in steady state, returns allocations over NUM_ROUNDS
+//
+template <typename F>
+static size_t countAllocs(F op)
+{
+    for (int i = 0; i < NUM_WARMUP_ROUNDS; i++) {
+        op();
+    }
+
+    size_t start = sNumAllocs;
+
+    for (int i = 0; i < NUM_ROUNDS; i++) {
+        op();
+    }
+
+    return sNumAllocs - start;
+}
+
+// budget is the number of allocations over NUM_ROUNDS
+//
+template <typename F>
+static void check(const char *name, size_t budget, F op)
+{
+    size_t numAllocs = countAllocs(op);
+    bool isOk = (numAllocs <= budget);
+
+    if (!isOk) {
+        sNumRegressions++;
+    }
+
+    printf ("%-32s %7.3f allocs/op  (%6ld, budget %6ld)  %s\n", name, (double) numAllocs / NUM_ROUNDS,
+        (long) numAllocs, (long) budget, (isOk ? "ok" : "REGRESSION"));
+}
+
+//
+// operations
+//
+
+static void startAsyncAndComplete()
+{
+    ut::Awaitable awt = ut::startAsync("op", []() {
+    });
+}
+
+static void awaitReady()
+{
+    for (int i = 0; i < 100; i++) {
+        ut::Awaitable awt = ut::Awaitable::makeCompleted();
+        awt.await();
+    }
+}
+
+static void conditionWaitNotify()
+{
+    static ut::Condition cond("cond");
+    ut::Awaitable awtWaiter = ut::startAsync("waiter", []() {
+        for (int i = 0; i < 100; i++) {
+            cond.asyncWait().await();
+        }
+    });
+
+    for (int i = 0; i < 100; i++) {
+        cond.notifyOne();
+    }
+}
+
+static void boundedQueuePushPop()
+{
+    static ut::BoundedQueue<int> queue(16);
+
+    for (int i = 0; i < 8; i++) {
+        queue.asyncPush(i);
+    }
+
+    int value;
+    for (int i = 0; i < 8; i++) {
+        queue.asyncPop(value);
+    }
+}
+
+static void signalEmit()
+{
+    static ut::Signal0 signal;
+    static int numCalls = 0;
+    static bool isConnected = false;
+
+    if (!isConnected) {
+        for (int i = 0; i < 4; i++) {
+            signal.connectLite([]() { numCalls++; });
+        }
+        isConnected = true;
+    }
+
+    signal();
+}
+
+static void asyncReadLoopback()
+{
+    using boost::asio::ip::tcp;
+
+    static boost::asio::io_service io;
+    static tcp::socket reader(io);
+    static tcp::socket writer(io);
+    static auto buffer = std::make_shared<std::array<char, 64> >();
+    static bool isConnected = false;
+
+    if (!isConnected) {
+        tcp::acceptor acceptor(io, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+        writer.connect(acceptor.local_endpoint());
+        acceptor.accept(reader);
+        isConnected = true;
+    }
+
+    ut::Awaitable awtReader = ut::startAsync("reader", []() {
+        for (int i = 0; i < 10; i++) {
+            ut::asio::asyncRead(reader, buffer).await();
+        }
+    });
+
+    for (int i = 0; i < 10; i++) {
+        boost::asio::write(writer, boost::asio::buffer(*buffer));
+
+        io.reset();
+        while (io.poll_one() == 0) {
+        }
+    }
+}
+
+
+int main()
+{
+    // entry function, Coro internals and stack pool bookkeeping
+    check("startAsync + complete", 4000, startAsyncAndComplete);
+
+    // must await from a coroutine, measured inside one
+    ut::Awaitable awtDriver = ut::startAsync("driver", []() {
+        check("await on ready x100", 0, awaitReady);
+    });
+
+    // waiter coroutine plus std::deque blocks as the waiter list slides
+    check("Condition wait / notify x100", 8762, conditionWaitNotify);
+
+    // std::deque recycles blocks lazily
+    check("BoundedQueue push / pop x8", 62, boundedQueuePushPop);
+
+    check("Signal0 emit, 4 slots", 0, signalEmit);
+
+    // reader coroutine, plus the wrapped callback per read. Asio handler memory is recycled.
+    check("asyncRead on loopback x10", 25000, asyncReadLoopback);
+
+    if (sNumRegressions == 0) {
+        printf ("\nall within budget\n");
+        return 0;
+    } else {
+        printf ("\n%d regressions\n", sNumRegressions);
+        return 1;
+    }
+}
@@ -15,9 +15,13 @@
 */
 
 #include "ConfigPrivate.h"
+#include "HttpPrivate.h"
 #include <CppAwait/AsioWrappers.h>
+#include <CppAwait/AsyncPool.h>
+#include <CppAwait/ContentDecoder.h>
 #include <CppAwait/impl/StringUtil.h>
 #include <iostream>
+#include <cstdlib>
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
 
@@ -26,69 +30,233 @@ namespace ut { namespace asio {
 using namespace boost::asio;
 using namespace boost::asio::ip;
 
-template <typename Socket>
-static void doAsyncHttpGet(Socket& socket,
-    const std::string& host, const std::string& path, bool persistentConnection,
-    bool readAll, std::shared_ptr<streambuf> outResponse, size_t& outContentLength)
+//
+// content decoding
+//
+
+static const size_t DECODE_READ_SIZE = 64 * 1024;
+static const size_t DECODE_OUT_SIZE = 64 * 1024;
+
+// smaller bodies are decoded on io, not worth a thread hop
+static const size_t OFFLOAD_MIN_SIZE = 256 * 1024;
+
+// compressed bytes accumulated before each offload
+static const size_t OFFLOAD_BATCH_SIZE = 256 * 1024;
+
+// decodes all of input, appends to output
+static void decodeInto(ContentDecoder& decoder, streambuf& input, streambuf& output)
 {
-    if (!socket.lowest_layer().is_open()) {
-        throw std::runtime_error("socket not connected");
-    }
+    bool isOutputFull;
+
+    do {
+        const char *data = buffer_cast<const char *>(input.data());
+        size_t size = input.size();
+
+        mutable_buffers_1 out = output.prepare(DECODE_OUT_SIZE);
+        size_t numDecoded = decoder.decode(data, size, buffer_cast<char *>(out), buffer_size(out));
 
-    auto request = std::make_shared<streambuf>();
+        output.commit(numDecoded);
+        input.consume(input.size() - size);
 
-    // write HTTP request
-    std::ostream requestStream(request.get());
-    requestStream << "GET " << path << " HTTP/1.1\r\n";
-    requestStream << "Host: " << host << "\r\n";
-    requestStream << "Accept: */*\r\n";
-    if (!persistentConnection) {
-        requestStream << "Connection: close\r\n";
+        isOutputFull = (numDecoded == buffer_size(out));
+    } while ((input.size() > 0 || isOutputFull) && !decoder.isFinished());
+
+    // ignore trailing garbage
+    if (decoder.isFinished()) {
+        input.consume(input.size());
     }
-    requestStream << "\r\n";
+}
 
-    Awaitable awt = asyncWrite(socket, request);
+// reads a line of chunked framing, without CRLF
+template <typename Socket>
+static std::string readChunkLine(Socket& socket, std::shared_ptr<streambuf> framed)
+{
+    Awaitable awt = asyncReadUntil(socket, framed, std::string("\r\n"));
     awt.await();
 
-    // read first response line
-    awt = asyncReadUntil(socket, outResponse, std::string("\r\n"));
-    awt.await();
+    std::istream framedStream(framed.get());
+    std::string line;
+    std::getline(framedStream, line);
+    boost::trim_right(line);
 
-    std::istream responseStream(outResponse.get());
-    std::string httpVersion;
-    responseStream >> httpVersion;
-    int statusCode;
-    responseStream >> statusCode;
-    std::string statusMessage;
-    std::getline(responseStream, statusMessage);
+    return line;
+}
+
+// moves some chunk data from framed to body, reading more as needed. Returns false after last chunk.
+template <typename Socket>
+static bool readChunkData(Socket& socket, std::shared_ptr<streambuf> framed, size_t& ioChunkLeft, streambuf& body)
+{
+    if (ioChunkLeft == 0) {
+        // skips CRLF ending previous chunk
+        std::string line;
+        do {
+            line = readChunkLine(socket, framed);
+        } while (line.empty());
 
-    if (!responseStream || !boost::starts_with(httpVersion, "HTTP/")) {
-        throw std::runtime_error("invalid HTTP response");
+        char *end;
+        unsigned long chunkSize = strtoul(line.c_str(), &end, 16);
+
+        if (end == line.c_str() || (*end != '\0' && *end != ';' && *end != ' ')) {
+            throw std::runtime_error("invalid HTTP chunk size");
+        }
+
+        if (chunkSize == 0) {
+            // skip trailers
+            while (!readChunkLine(socket, framed).empty()) {
+            }
+            return false;
+        }
+
+        ioChunkLeft = chunkSize;
     }
-    if (statusCode != 200) {
-        throw std::runtime_error(string_printf("bad HTTP status: %d", statusCode));
+
+    if (framed->size() == 0) {
+        size_t numBytesRead = 0;
+        Awaitable awt = asyncRead(socket, framed->prepare(std::min(ioChunkLeft, DECODE_READ_SIZE)),
+            framed, transfer_at_least(1), numBytesRead);
+        awt.await();
+
+        framed->commit(numBytesRead);
     }
 
-    // read response headers
-    awt = asyncReadUntil(socket, outResponse, std::string("\r\n\r\n"));
-    awt.await();
+    size_t size = std::min(framed->size(), ioChunkLeft);
+    body.commit(buffer_copy(body.prepare(size), framed->data(), size));
+    framed->consume(size);
+    ioChunkLeft -= size;
+
+    return true;
+}
+
+// reads rest of encoded body, replaces contents of ioResponse with decoded body
+template <typename Socket>
+static void readDecodedBody(Socket& socket, const HttpResponseHeader& header, ContentDecoder::Encoding encoding,
+    io_service *workIo, std::shared_ptr<streambuf> ioResponse)
+{
+    // buffers are shared with offloaded work, which may outlive an interrupted download
+    auto decoder = std::make_shared<ContentDecoder>(encoding);
+    auto encoded = std::make_shared<streambuf>();
+    auto decoded = std::make_shared<streambuf>();
+
+    // chunked framing gets stripped before decoding
+    std::shared_ptr<streambuf> framed;
+    size_t chunkLeft = 0;
+
+    if (header.isChunked) {
+        framed = std::make_shared<streambuf>();
+    }
+
+    // body bytes read along with header
+    streambuf& readAlong = (framed ? *framed : *encoded);
+    readAlong.commit(buffer_copy(readAlong.prepare(ioResponse->size()), ioResponse->data()));
+    ioResponse->consume(ioResponse->size());
 
-    // process headers
-    std::string header;
-    outContentLength = (size_t) -1;
+    bool isLengthKnown = (!header.isChunked && header.contentLength != (size_t) -1);
+    bool shouldOffload = (workIo != nullptr && encoding != ContentDecoder::ENCODING_IDENTITY
+        && (!isLengthKnown || header.contentLength >= OFFLOAD_MIN_SIZE));
+    size_t numBytesLeft = (isLengthKnown ? header.contentLength - std::min(header.contentLength, encoded->size()) : (size_t) -1);
+    bool isEof = false;
 
-    while (std::getline(responseStream, header) && header != "\r") {
-        if (boost::starts_with(header, "Content-Length: ")) {
-            auto l = header.substr(strlen("Content-Length: "));
-            l.resize(l.size() - 1);
-            outContentLength = boost::lexical_cast<size_t>(l);
+    while (true) {
+        bool isLast = (numBytesLeft == 0 || isEof);
+
+        if (encoded->size() > 0 && (isLast || !shouldOffload || encoded->size() >= OFFLOAD_BATCH_SIZE)) {
+            if (shouldOffload) {
+                Awaitable awt = asyncOffload(socket.lowest_layer().get_io_service(), *workIo, [decoder, encoded, decoded]() {
+                    decodeInto(*decoder, *encoded, *decoded);
+                });
+                awt.await();
+
+                ioResponse->commit(buffer_copy(ioResponse->prepare(decoded->size()), decoded->data()));
+                decoded->consume(decoded->size());
+            } else {
+                decodeInto(*decoder, *encoded, *ioResponse);
+            }
+        }
+
+        if (isLast || decoder->isFinished()) {
+            break;
+        }
+
+        if (header.isChunked) {
+            // body ends with last chunk
+            isEof = !readChunkData(socket, framed, chunkLeft, *encoded);
+            continue;
+        }
+
+        // decode whatever has arrived, never read past body
+        size_t numBytesRead = 0;
+
+        try {
+            Awaitable awt = asyncRead(socket, encoded->prepare(std::min(numBytesLeft, DECODE_READ_SIZE)),
+                encoded, transfer_at_least(1), numBytesRead);
+            awt.await();
+        } catch (const boost::system::system_error& e) {
+            // without Content-Length, body ends when server closes connection
+            if (isLengthKnown || e.code() != boost::asio::error::eof) {
+                throw;
+            }
+            isEof = true;
         }
+
+        encoded->commit(numBytesRead);
+
+        if (isLengthKnown) {
+            numBytesLeft -= numBytesRead;
+        }
+    }
+
+    // skip framing after end of encoded content, connection may get reused
+    if (header.isChunked) {
+        streambuf ignored;
+        while (!isEof) {
+            isEof = !readChunkData(socket, framed, chunkLeft, ignored);
+            ignored.consume(ignored.size());
+        }
+    }
+
+    // identity has no end marker, chunked framing ends it
+    if (encoding != ContentDecoder::ENCODING_IDENTITY && !decoder->isFinished()) {
+        throw std::runtime_error("truncated encoded content");
+    }
+}
+
+template <typename Socket>
+static void doAsyncHttpGet(Socket& socket,
+    const std::string& host, const std::string& path, bool persistentConnection,
+    bool readAll, io_service *workIo, std::shared_ptr<streambuf> outResponse, size_t& outContentLength)
+{
+    // only a whole body can be decoded, otherwise caller reads from socket
+    std::string extraHeaders;
+    if (readAll) {
+        extraHeaders = string_printf("Accept-Encoding: %s\r\n", ContentDecoder::acceptEncoding());
+    }
+
+    writeHttpRequest(socket, "GET", host, path, persistentConnection, extraHeaders);
+
+    HttpResponseHeader header = readHttpResponseHeader(socket, outResponse);
+
+    if (header.statusCode != 200) {
+        throw std::runtime_error(string_printf("bad HTTP status: %d", header.statusCode));
     }
 
+    ContentDecoder::Encoding encoding;
+    if (!ContentDecoder::parseEncoding(header.contentEncoding, encoding)) {
+        throw std::runtime_error("unsupported HTTP content encoding: " + header.contentEncoding);
+    }
+
+    // chunked bodies are read through the decoder, which strips framing
+    if (readAll && (encoding != ContentDecoder::ENCODING_IDENTITY || header.isChunked)) {
+        readDecodedBody(socket, header, encoding, workIo, outResponse);
+        outContentLength = outResponse->size();
+        return;
+    }
+
+    outContentLength = header.contentLength;
+
     if (readAll) {
         size_t numBytesRemaining = outContentLength - outResponse->size();
         size_t numBytesTransferred;
-        awt = asyncRead(socket, outResponse, asio::transfer_exactly(numBytesRemaining), numBytesTransferred);
+        Awaitable awt = asyncRead(socket, outResponse, asio::transfer_exactly(numBytesRemaining), numBytesTransferred);
         awt.await();
     }
 }
@@ -97,29 +265,31 @@ namespace detail {
 
     void doAsyncHttpGet(boost::asio::ip::tcp::socket& socket,
         const std::string& host, const std::string& path, bool persistentConnection,
-        bool readAll, std::shared_ptr<boost::asio::streambuf> outResponse, size_t& outContentLength)
+        bool readAll, boost::asio::io_service *workIo,
+        std::shared_ptr<boost::asio::streambuf> outResponse, size_t& outContentLength)
     {
-        ut::asio::doAsyncHttpGet(socket, host, path, persistentConnection, readAll, outResponse, outContentLength);
+        ut::asio::doAsyncHttpGet(socket, host, path, persistentConnection, readAll, workIo, outResponse, outContentLength);
     }
 
 #ifdef HAVE_OPENSSL
     void doAsyncHttpGet(boost::asio::ssl::stream<boost::asio::ip::tcp::socket>& socket,
         const std::string& host, const std::string& path, bool persistentConnection,
-        bool readAll, std::shared_ptr<boost::asio::streambuf> outResponse, size_t& outContentLength)
+        bool readAll, boost::asio::io_service *workIo,
+        std::shared_ptr<boost::asio::streambuf> outResponse, size_t& outContentLength)
     {
-        ut::asio::doAsyncHttpGet(socket, host, path, persistentConnection, readAll, outResponse, outContentLength);
+        ut::asio::doAsyncHttpGet(socket, host, path, persistentConnection, readAll, workIo, outResponse, outContentLength);
     }
 #endif
 }
 
 Awaitable asyncHttpDownload(boost::asio::io_service& io,
     const std::string& host, const std::string& path,
-    std::shared_ptr<streambuf> outResponse)
+    std::shared_ptr<streambuf> outResponse, io_service *workIo)
 {
     static int id = 0;
     auto tag = string_printf("asyncHttpDownload-%d", id++);
 
-    return startAsync(std::move(tag), [&io, host, path, outResponse]() {
+    return startAsync(std::move(tag), [&io, host, path, outResponse, workIo]() {
         tcp::socket socket(io);
 
         tcp::resolver::query query(host, "http");
@@ -128,21 +298,230 @@ Awaitable asyncHttpDownload(boost::asio::io_service& io,
         awt.await();
 
         size_t contentLength;
-        detail::doAsyncHttpGet(socket, host, path, false, true, outResponse, contentLength);
+        detail::doAsyncHttpGet(socket, host, path, false, true, workIo, outResponse, contentLength);
+    });
+}
+
+//
+// ranged download
+//
+
+namespace {
+
+    struct HttpConnection
+    {
+        tcp::socket socket;
+        std::shared_ptr<streambuf> response;
+
+        HttpConnection(io_service& io)
+            : socket(io)
+            , response(std::make_shared<streambuf>()) { }
+    };
+
+    typedef AsyncPool<HttpConnection> HttpConnectionPool;
+}
+
+static const size_t RANGE_READ_SIZE = 64 * 1024;
+static const int MAX_RANGE_ATTEMPTS = 3;
+
+// fetches [begin, end) passing data to sink as it arrives, whole resource if !useRange
+static void fetchRange(HttpConnection& conn, const std::string& host, const std::string& path,
+    bool useRange, size_t begin, size_t end, const RangeSink& sink, bool& outIsKeepAlive)
+{
+    std::string rangeHeader;
+    if (useRange) {
+        rangeHeader = string_printf("Range: bytes=%lu-%lu\r\n", (unsigned long) begin, (unsigned long) (end - 1));
+    }
+
+    writeHttpRequest(conn.socket, "GET", host, path, true, rangeHeader);
+
+    HttpResponseHeader header = readHttpResponseHeader(conn.socket, conn.response);
+
+    if (header.statusCode != (useRange ? 206 : 200)) {
+        throw std::runtime_error(string_printf("bad HTTP status: %d", header.statusCode));
+    }
+    if (header.contentLength != end - begin) {
+        throw std::runtime_error("unexpected HTTP content length");
+    }
+
+    size_t offset = begin;
+
+    while (true) {
+        size_t size = std::min(conn.response->size(), end - offset);
+
+        if (size > 0) {
+            sink(offset, buffer_cast<const char *>(conn.response->data()), size);
+            conn.response->consume(size);
+            offset += size;
+        }
+
+        if (offset == end) {
+            break;
+        }
+
+        size_t numBytesRead;
+        Awaitable awt = asyncRead(conn.socket, conn.response->prepare(std::min(RANGE_READ_SIZE, end - offset)),
+            conn.response, transfer_at_least(1), numBytesRead);
+        awt.await();
+
+        conn.response->commit(numBytesRead);
+    }
+
+    outIsKeepAlive = header.isKeepAlive;
+}
+
+static Awaitable doAsyncHttpDownloadRanged(boost::asio::io_service& io,
+    const std::string& host, const std::string& path,
+    std::function<void (size_t size)> onSize, RangeSink sink,
+    size_t chunkSize, size_t maxConnections)
+{
+    ut_assert_(chunkSize > 0 && maxConnections > 0);
+
+    static int id = 0;
+    auto tag = string_printf("asyncHttpDownloadRanged-%d", id++);
+
+    return startAsync(tag, [&io, tag, host, path, onSize, sink, chunkSize, maxConnections]() {
+        tcp::resolver resolver(io);
+        tcp::resolver::iterator endpoints;
+        Awaitable awt = asyncResolve(resolver, tcp::resolver::query(host, "http"), endpoints);
+        awt.await();
+
+        // connections are created on demand and reused across chunks
+        HttpConnectionPool pool(tag + "-connections", [&io, endpoints](std::unique_ptr<HttpConnection>& outConn) {
+            return startAsync("asyncHttpDownloadRanged-connect", [&io, endpoints, &outConn]() {
+                std::unique_ptr<HttpConnection> conn(new HttpConnection(io));
+
+                tcp::resolver::iterator itConnected;
+                Awaitable awt = asyncConnect(conn->socket, endpoints, itConnected);
+                awt.await();
+
+                conn->socket.set_option(tcp::no_delay(true));
+                outConn = std::move(conn);
+            });
+        }, 0, maxConnections);
+
+        // probe size
+        HttpResponseHeader header;
+        {
+            HttpConnectionPool::Lease conn;
+            awt = pool.asyncCheckout(conn);
+            awt.await();
+
+            writeHttpRequest(conn->socket, "HEAD", host, path, true);
+            header = readHttpResponseHeader(conn->socket, conn->response);
+
+            if (!header.isKeepAlive) {
+                conn.discard();
+            }
+        }
+
+        if (header.statusCode != 200) {
+            throw std::runtime_error(string_printf("bad HTTP status: %d", header.statusCode));
+        }
+        if (header.contentLength == (size_t) -1) {
+            throw std::runtime_error("HTTP resource size unknown");
+        }
+
+        size_t totalSize = header.contentLength;
+        bool useRanges = header.acceptsRanges;
+        size_t rangeSize = (useRanges ? chunkSize : std::max(totalSize, (size_t) 1));
+
+        onSize(totalSize);
+
+        size_t numChunks = (totalSize + rangeSize - 1) / rangeSize;
+        size_t nextChunk = 0;
+
+        if (numChunks == 0) {
+            return;
+        }
+
+        ut_log_debug_("* %s: %lu bytes in %lu chunks", tag.c_str(), (unsigned long) totalSize, (unsigned long) numChunks);
+
+        auto work = [&]() {
+            while (nextChunk < numChunks) {
+                size_t begin = rangeSize * nextChunk++;
+                size_t end = std::min(begin + rangeSize, totalSize);
+
+                for (int attempt = 1; ; attempt++) {
+                    HttpConnectionPool::Lease conn;
+                    Awaitable awt = pool.asyncCheckout(conn);
+                    awt.await();
+
+                    bool isKeepAlive = false;
+
+                    try {
+                        fetchRange(*conn, host, path, useRanges, begin, end, sink, isKeepAlive);
+                    } catch (const ForcedUnwind&) {
+                        throw;
+                    } catch (...) {
+                        // connection state unknown, use a fresh one
+                        conn.discard();
+
+                        if (attempt == MAX_RANGE_ATTEMPTS) {
+                            throw;
+                        }
+
+                        ut_log_warn_("* %s: retrying range %lu-%lu", tag.c_str(), (unsigned long) begin, (unsigned long) end);
+                        continue;
+                    }
+
+                    if (!isKeepAlive) {
+                        conn.discard();
+                    }
+                    break;
+                }
+            }
+        };
+
+        // declared after pool, workers get interrupted first
+        std::vector<Awaitable> workers;
+
+        for (size_t i = 0; i < std::min(maxConnections, numChunks); i++) {
+            workers.push_back(startAsync(string_printf("%s-worker", tag.c_str()), work));
+        }
+
+        awt = asyncAll(workers);
+        awt.await();
     });
 }
 
+Awaitable asyncHttpDownloadRanged(boost::asio::io_service& io,
+    const std::string& host, const std::string& path,
+    RangeSink sink, size_t& outSize,
+    size_t chunkSize, size_t maxConnections)
+{
+    size_t *outSizePtr = &outSize;
+
+    return doAsyncHttpDownloadRanged(io, host, path, [outSizePtr](size_t size) {
+        *outSizePtr = size;
+    }, std::move(sink), chunkSize, maxConnections);
+}
+
+Awaitable asyncHttpDownloadRanged(boost::asio::io_service& io,
+    const std::string& host, const std::string& path,
+    std::shared_ptr<std::vector<char> > outData,
+    size_t chunkSize, size_t maxConnections)
+{
+    std::vector<char> *data = outData.get();
+
+    return doAsyncHttpDownloadRanged(io, host, path, [outData](size_t size) {
+        outData->resize(size);
+    }, [data](size_t offset, const char *bytes, size_t size) {
+        std::copy(bytes, bytes + size, data->begin() + offset);
+    }, chunkSize, maxConnections);
+}
+
 #ifdef HAVE_OPENSSL
 
 Awaitable asyncHttpsDownload(boost::asio::io_service& io,
     ssl::context_base::method sslVersion,
     const std::string& host, const std::string& path,
-    std::shared_ptr<streambuf> outResponse)
+    std::shared_ptr<streambuf> outResponse, io_service *workIo)
 {
     static int id = 0;
     auto tag = string_printf("asyncHttpsDownload-%d", id++);
 
-    return startAsync(std::move(tag), [&io, sslVersion, host, path, outResponse]() {
+    return startAsync(std::move(tag), [&io, sslVersion, host, path, outResponse, workIo]() {
         // prepare SSL client socket
         typedef ssl::stream<tcp::socket> ssl_socket;
         ssl::context ctx(sslVersion);
@@ -160,7 +539,7 @@ Awaitable asyncHttpsDownload(boost::asio::io_service& io,
         awt.await();
 
         size_t contentLength;
-        detail::doAsyncHttpGet(socket, host, path, false, true, outResponse, contentLength);
+        detail::doAsyncHttpGet(socket, host, path, false, true, workIo, outResponse, contentLength);
     });
 }
 
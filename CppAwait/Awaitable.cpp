@@ -18,10 +18,13 @@
 #include <CppAwait/Awaitable.h>
 #include <CppAwait/impl/SharedFlag.h>
 #include <CppAwait/impl/StringUtil.h>
+#include <CppAwait/impl/Foreach.h>
 #include <CppAwait/misc/Signals.h>
+#include <CppAwait/misc/Scheduler.h>
 #include <CppAwait/Log.h>
 #include <cstdio>
 #include <cstdarg>
+#include <cstdlib>
 #include <boost/pool/singleton_pool.hpp>
 
 namespace ut {
@@ -33,6 +36,7 @@ namespace ut {
 struct AwaitableImpl
 {
     Awaitable *shell;
+    Coro *stackOwner;
     std::string tag;
     Coro *boundCoro;
     Coro *awaitingCoro;
@@ -43,6 +47,7 @@ struct AwaitableImpl
 
     AwaitableImpl(std::string&& tag)
         : shell(nullptr)
+        , stackOwner(nullptr)
         , tag(std::move(tag))
         , boundCoro(nullptr)
         , awaitingCoro(nullptr)
@@ -56,6 +61,51 @@ typedef boost::singleton_pool<
     boost::default_user_allocator_new_delete,
     boost::details::pool::null_mutex> AwtImplPool;
 
+// Returns the shared-stack coroutine whose stack holds shell, or nullptr
+// if shell is on heap or on a dedicated stack.
+//
+static Coro* sharedStackOwner(Awaitable *shell)
+{
+    Coro *coro = currentCoro();
+    SharedStack *sharedStack = coro->sharedStack();
+
+    if (sharedStack != nullptr && sharedStack->contains(shell)) {
+        return coro;
+    } else {
+        return nullptr;
+    }
+}
+
+// Bring back the stack holding shell so that it may be accessed. Fails if
+// running on the same shared stack.
+//
+static bool restoreShellStack(AwaitableImpl *m)
+{
+    if (m->stackOwner == nullptr) {
+        return true;
+    }
+    if (currentCoro()->sharedStack() == m->stackOwner->sharedStack()) {
+        return currentCoro() == m->stackOwner;
+    }
+
+    m->stackOwner->restoreStack();
+    return true;
+}
+
+// Like restoreShellStack() but shell access is mandatory. Aborts in release
+// builds too, the alternative would be reading swapped out memory.
+//
+static void restoreShellStackOrDie(AwaitableImpl *m)
+{
+    if (!restoreShellStack(m)) {
+        fprintf(stderr, "CPP_ASYNC FATAL: awaitable '%s' is on a swapped out stack\n", m->tag.c_str());
+        std::abort();
+    }
+}
+
+static void completeImpl(AwaitableImpl *m);
+static void failImpl(AwaitableImpl *m, std::exception_ptr eptr);
+
 Awaitable::Awaitable(std::string tag)
 {
     currentCoro(); // ensure library is initialized
@@ -63,6 +113,7 @@ Awaitable::Awaitable(std::string tag)
     m = (AwaitableImpl *) AwtImplPool::malloc();
     new (m) AwaitableImpl(std::move(tag));
     m->shell = this;
+    m->stackOwner = sharedStackOwner(this);
 }
 
 Awaitable::~Awaitable()
@@ -75,6 +126,7 @@ Awaitable::Awaitable(Awaitable&& other)
     m = other.m;
     other.m = nullptr;
     m->shell = this;
+    m->stackOwner = sharedStackOwner(this);
 }
 
 Awaitable& Awaitable::operator=(Awaitable&& other)
@@ -85,6 +137,7 @@ Awaitable& Awaitable::operator=(Awaitable&& other)
 
     if (m) {
         m->shell = this;
+        m->stackOwner = sharedStackOwner(this);
     }
 
     return *this;
@@ -143,6 +196,11 @@ void Awaitable::then(ut::Action slot)
     return m->onDone.connectLite(std::move(slot));
 }
 
+SignalConnection Awaitable::connectThen(ut::Action slot)
+{
+    return m->onDone.connect(std::move(slot));
+}
+
 Completer Awaitable::takeCompleter()
 {
     ut_log_info_("* new  evt-awt '%s'", m->tag.c_str());
@@ -183,8 +241,21 @@ void Awaitable::setAwaitingCoro(Coro *coro)
 
 void Awaitable::complete()
 {
-    ut_assert_(!didComplete());
-    ut_assert_(!didFail());
+    completeImpl(m);
+}
+
+void Awaitable::fail(std::exception_ptr eptr)
+{
+    failImpl(m, std::move(eptr));
+}
+
+// Completion works on the implementation only. The shell may be on the stack of
+// a suspended shared-stack coroutine, so it's not safe to access.
+//
+static void completeImpl(AwaitableImpl *m)
+{
+    ut_assert_(!m->didComplete);
+    ut_assert_(!is(m->exceptionPtr));
 
     m->didComplete = true;
     m->completerGuard.reset();
@@ -198,14 +269,14 @@ void Awaitable::complete()
             ut_assert_(false && "called from wrong coroutine");
         }
 
-        yieldTo(m->awaitingCoro, this);
+        yieldTo(m->awaitingCoro, m->shell);
     }
 }
 
-void Awaitable::fail(std::exception_ptr eptr)
+static void failImpl(AwaitableImpl *m, std::exception_ptr eptr)
 {
-    ut_assert_(!didComplete());
-    ut_assert_(!didFail());
+    ut_assert_(!m->didComplete);
+    ut_assert_(!is(m->exceptionPtr));
 
     ut_assert_(is(eptr) && "invalid exception_ptr");
 
@@ -221,7 +292,7 @@ void Awaitable::fail(std::exception_ptr eptr)
             ut_assert_(false && "called from wrong coroutine");
         }
 
-        yieldTo(m->awaitingCoro, this);
+        yieldTo(m->awaitingCoro, m->shell);
     }
 }
 
@@ -290,25 +361,20 @@ Awaitable Awaitable::makeFailed(std::exception_ptr eptr)
     return std::move(awt);
 }
 
-Awaitable startAsync(std::string tag, Action func, size_t stackSize)
+// Wraps func for running inside the coroutine bound to an awaitable
+//
+static Coro::Func makeAsyncFunc(Action&& func)
 {
-    ut_log_info_("* new coro-awt '%s'", tag.c_str());
-
-    Awaitable awt(tag);
-
-    // coroutine owns completer
-    awt.m->completerGuard = allocateSharedFlag();
-
-    auto coro = new Coro(std::move(tag), [func](void *awtImpl) {
+    return [func](void *awtImpl) {
         auto m = (AwaitableImpl *) awtImpl;
         std::exception_ptr eptr;
 
         try {
             func();
 
-            ut_log_info_("* complete coro-awt '%s'", m->shell->tag());
+            ut_log_info_("* complete coro-awt '%s'", m->tag.c_str());
         } catch (const ForcedUnwind&) {
-            ut_log_info_("* fail coro-awt '%s' (forced unwind)", m->shell->tag());
+            ut_log_info_("* fail coro-awt '%s' (forced unwind)", m->tag.c_str());
 
             // If an Awaitable is being destroyed during propagation of some exception,
             // and the Awaitable is not yet done, it will interrupt itself via ForcedUnwind.
@@ -318,7 +384,7 @@ Awaitable startAsync(std::string tag, Action func, size_t stackSize)
 
             eptr = ForcedUnwind::ptr();
         } catch (...) {
-            ut_log_info_("* fail coro-awt '%s' (exception)", m->shell->tag());
+            ut_log_info_("* fail coro-awt '%s' (exception)", m->tag.c_str());
 
             ut_assert_(!std::uncaught_exception() && "may not throw from async coroutine while another exception is propagating");
 
@@ -326,8 +392,8 @@ Awaitable startAsync(std::string tag, Action func, size_t stackSize)
             ut_assert_(is(eptr));
         }
 
-        ut_assert_(!m->shell->didFail());
-        ut_assert_(!m->shell->didComplete());
+        ut_assert_(!is(m->exceptionPtr));
+        ut_assert_(!m->didComplete);
 
         if (m->awaitingCoro != nullptr) {
             // wait until coroutine fully unwinded before yielding to awaiter
@@ -339,34 +405,162 @@ Awaitable startAsync(std::string tag, Action func, size_t stackSize)
         }
 
         if (is(eptr)) {
-            m->shell->fail(std::move(eptr)); // mAwaitingCoro is null, won't yield
+            failImpl(m, std::move(eptr)); // mAwaitingCoro is null, won't yield
         } else {
-            m->shell->complete(); // mAwaitingCoro is null, won't yield
+            completeImpl(m); // mAwaitingCoro is null, won't yield
         }
 
         // This function will never throw an exception. Instead, exceptions
         // are stored in the Awaitable and get rethrown by await().
-    }, stackSize);
+    };
+}
 
-    awt.m->boundCoro = coro;
+static void runAsync(AwaitableImpl *m, Coro *coro)
+{
+    m->boundCoro = coro;
 
     { PushMasterCoro _; // take over
         // run coro until it awaits or finishes
-        yieldTo(coro, awt.m);
+        yieldTo(coro, m);
     }
+}
+
+Awaitable startAsync(std::string tag, Action func, size_t stackSize)
+{
+    ut_log_info_("* new coro-awt '%s'", tag.c_str());
+
+    Awaitable awt(tag);
+
+    // coroutine owns completer
+    awt.m->completerGuard = allocateSharedFlag();
+
+    runAsync(awt.m, new Coro(std::move(tag), makeAsyncFunc(std::move(func)), stackSize));
 
     return std::move(awt);
 }
 
+Awaitable startAsync(std::string tag, Action func, SharedStack& sharedStack)
+{
+    ut_log_info_("* new coro-awt '%s' on shared stack", tag.c_str());
+
+    Awaitable awt(tag);
+
+    // coroutine owns completer
+    awt.m->completerGuard = allocateSharedFlag();
+
+    runAsync(awt.m, new Coro(std::move(tag), makeAsyncFunc(std::move(func)), sharedStack));
+
+    return std::move(awt);
+}
+
+//
+// time slicing
+//
+
+typedef std::chrono::steady_clock SliceClock;
+
+static std::chrono::microseconds sTimeSlice(2000);
+static size_t sCallsPerClockCheck = 16;
+
+static uint64_t sSliceSwitchCount = (uint64_t) -1;
+static SliceClock::time_point sSliceStart;
+static size_t sCallsUntilClockCheck = 0;
+
+bool maybeYield()
+{
+    uint64_t numSwitches = switchCount();
+
+    if (numSwitches != sSliceSwitchCount) {
+        // resumed since last call, new slice
+        sSliceSwitchCount = numSwitches;
+        sSliceStart = SliceClock::now();
+        sCallsUntilClockCheck = sCallsPerClockCheck;
+        return false;
+    }
+
+    if (--sCallsUntilClockCheck > 0) {
+        return false;
+    }
+    sCallsUntilClockCheck = sCallsPerClockCheck;
+
+    if (SliceClock::now() - sSliceStart < sTimeSlice || currentCoro() == masterCoro()) {
+        return false;
+    }
+
+    ut_log_debug_("* '%s' used up its time slice", currentCoro()->tag());
+
+    // completer expires if coroutine gets interrupted meanwhile
+    Awaitable awt("maybeYield");
+    Completer completer = awt.takeCompleter();
+
+    schedule([completer]() {
+        completer();
+    });
+
+    awt.await();
+
+    return true;
+}
+
+void setTimeSlice(std::chrono::microseconds slice, size_t callsPerClockCheck)
+{
+    ut_assert_(callsPerClockCheck > 0);
+
+    sTimeSlice = slice;
+    sCallsPerClockCheck = callsPerClockCheck;
+    sCallsUntilClockCheck = std::min(sCallsUntilClockCheck, callsPerClockCheck);
+}
+
+void prewarm(const PrewarmConfig& config)
+{
+    currentCoro(); // ensure library is initialized
+
+    ut_foreach_(auto& stackClass, config.stacks) {
+        Coro::reserveStacks(stackClass.first, stackClass.second, config.prefaultStacks);
+    }
+
+    // grow pool, freed slots are kept for reuse
+    std::vector<void *> slots;
+    slots.reserve(config.numAwaitables);
+
+    for (size_t i = 0; i < config.numAwaitables; i++) {
+        void *slot = AwtImplPool::malloc();
+        if (slot == nullptr) {
+            break;
+        }
+        slots.push_back(slot);
+    }
+    ut_foreach_(void *slot, slots) {
+        AwtImplPool::free(slot);
+    }
+
+    reserveSharedFlags(config.numCompleters);
+
+    ut_log_info_("* prewarmed %ld awaitables, %ld completers",
+        (long) config.numAwaitables, (long) config.numCompleters);
+}
+
 //
 // Pointer
 //
 
 Awaitable* Awaitable::Pointer::get() const
 {
+    restoreShellStackOrDie(m);
+
     return m->shell;
 }
 
+bool Awaitable::Pointer::didFail() const
+{
+    return is(m->exceptionPtr);
+}
+
+std::exception_ptr Awaitable::Pointer::exception() const
+{
+    return m->exceptionPtr;
+}
+
 //
 // Completer
 //
@@ -374,22 +568,78 @@ Awaitable* Awaitable::Pointer::get() const
 Awaitable* Completer::awaitable() const
 {
     if (auto strongRef = mRef.lock()) {
-        return ((AwaitableImpl *) *strongRef)->shell;
+        auto m = (AwaitableImpl *) *strongRef;
+
+        restoreShellStackOrDie(m);
+
+        return m->shell;
     } else {
         return nullptr;
     }
 }
 
+namespace detail
+{
+    // Handlers run while an awaitable is being finished, possibly from the
+    // epilogue of its bound coroutine. Resuming the awaiter right away would let
+    // it delete that coroutine before it has unwound. Instead, the awaiter takes
+    // over as parent and gets resumed once the coroutine is done -- same as
+    // with a directly awaited coroutine.
+    //
+    void completeFromHandler(const Completer& completer, std::exception_ptr eptr)
+    {
+        auto strongRef = completer.mRef.lock();
+        if (!strongRef) {
+            return;
+        }
+
+        auto m = (AwaitableImpl *) *strongRef;
+        Coro *coro = currentCoro();
+
+        if (coro != masterCoro() && coro->parent() == masterCoro()) {
+            if (m->awaitingCoro != nullptr) {
+                coro->setParent(m->awaitingCoro);
+                m->awaitingCoro = nullptr;
+            }
+
+            if (is(eptr)) {
+                failImpl(m, std::move(eptr)); // mAwaitingCoro is null, won't yield
+            } else {
+                completeImpl(m); // mAwaitingCoro is null, won't yield
+            }
+        } else {
+            PushMasterCoro _;
+
+            if (is(eptr)) {
+                completer.fail(std::move(eptr));
+            } else {
+                completer.complete();
+            }
+        }
+    }
+}
+
 void Completer::complete() const
 {
     ut_assert_msg_(currentCoro() == masterCoro(),
         "can't complete from '%s' because '%s' is master coro", currentCoro()->tag(), masterCoro()->tag());
 
     if (auto strongRef = mRef.lock()) {
-        auto shell = ((AwaitableImpl *) *strongRef)->shell;
+        auto m = (AwaitableImpl *) *strongRef;
 
-        ut_log_info_("* complete awt '%s'", shell->tag());
-        shell->complete();
+        if (!restoreShellStack(m)) {
+            // handlers may touch the swapped out stack, wait until main coroutine
+            ut_log_info_("* defer complete awt '%s'", m->tag.c_str());
+
+            Completer completer = *this;
+            postIdleAction([completer]() {
+                completer.complete();
+            });
+            return;
+        }
+
+        ut_log_info_("* complete awt '%s'", m->tag.c_str());
+        completeImpl(m);
     }
 }
 
@@ -399,10 +649,30 @@ void Completer::fail(std::exception_ptr eptr) const
         "can't fail from '%s' because '%s' is master coro", currentCoro()->tag(), masterCoro()->tag());
 
     if (auto strongRef = mRef.lock()) {
-        auto shell = ((AwaitableImpl *) *strongRef)->shell;
+        auto m = (AwaitableImpl *) *strongRef;
+
+        if (!restoreShellStack(m)) {
+            // handlers may touch the swapped out stack, wait until main coroutine
+            ut_log_info_("* defer fail awt '%s'", m->tag.c_str());
+
+            Completer completer = *this;
+            postIdleAction([completer, eptr]() {
+                completer.fail(eptr);
+            });
+            return;
+        }
+
+        ut_log_info_("* fail awt '%s'", m->tag.c_str());
+        failImpl(m, std::move(eptr));
+    }
+}
+
+void Completer::restoreStack() const
+{
+    if (auto strongRef = mRef.lock()) {
+        auto m = (AwaitableImpl *) *strongRef;
 
-        ut_log_info_("* fail awt '%s'", shell->tag());
-        shell->fail(std::move(eptr));
+        restoreShellStackOrDie(m);
     }
 }
 
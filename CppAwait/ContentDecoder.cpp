@@ -0,0 +1,215 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "ConfigPrivate.h"
+#include <CppAwait/ContentDecoder.h>
+#include <CppAwait/impl/Assert.h>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <boost/algorithm/string.hpp>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace ut {
+
+struct ContentDecoder::Impl
+{
+    Encoding encoding;
+    bool isFinished;
+    size_t numBytesIn;
+    size_t numBytesOut;
+
+#ifdef HAVE_ZLIB
+    z_stream stream;
+    bool isRawDeflate;
+#endif
+
+    Impl(Encoding encoding)
+        : encoding(encoding)
+        , isFinished(false)
+        , numBytesIn(0)
+        , numBytesOut(0) { }
+};
+
+#ifdef HAVE_ZLIB
+
+// window bits: 15 with +16 for gzip wrapper, negative for raw deflate
+static int windowBits(ContentDecoder::Encoding encoding, bool isRawDeflate)
+{
+    if (encoding == ContentDecoder::ENCODING_GZIP) {
+        return 15 + 16;
+    } else {
+        return (isRawDeflate ? -15 : 15);
+    }
+}
+
+static void initInflate(z_stream& stream, int windowBits)
+{
+    memset(&stream, 0, sizeof(stream));
+
+    int ret = inflateInit2(&stream, windowBits);
+
+    if (ret != Z_OK) {
+        throw std::runtime_error("failed to initialize zlib");
+    }
+}
+
+#endif // HAVE_ZLIB
+
+bool ContentDecoder::isSupported(Encoding encoding)
+{
+#ifdef HAVE_ZLIB
+    return true;
+#else
+    return (encoding == ENCODING_IDENTITY);
+#endif
+}
+
+bool ContentDecoder::parseEncoding(const std::string& value, Encoding& outEncoding)
+{
+    std::string name = boost::trim_copy(value);
+
+    if (name.empty() || boost::iequals(name, "identity")) {
+        outEncoding = ENCODING_IDENTITY;
+    } else if (boost::iequals(name, "gzip") || boost::iequals(name, "x-gzip")) {
+        outEncoding = ENCODING_GZIP;
+    } else if (boost::iequals(name, "deflate")) {
+        outEncoding = ENCODING_DEFLATE;
+    } else {
+        return false;
+    }
+
+    return isSupported(outEncoding);
+}
+
+const char* ContentDecoder::acceptEncoding()
+{
+#ifdef HAVE_ZLIB
+    return "gzip, deflate";
+#else
+    return "identity";
+#endif
+}
+
+ContentDecoder::ContentDecoder(Encoding encoding)
+    : m(new Impl(encoding))
+{
+    ut_assert_(isSupported(encoding) && "encoding not supported");
+
+#ifdef HAVE_ZLIB
+    m->isRawDeflate = false;
+
+    if (encoding != ENCODING_IDENTITY) {
+        initInflate(m->stream, windowBits(encoding, false));
+    }
+#endif
+}
+
+ContentDecoder::~ContentDecoder()
+{
+#ifdef HAVE_ZLIB
+    if (m->encoding != ENCODING_IDENTITY) {
+        inflateEnd(&m->stream);
+    }
+#endif
+}
+
+ContentDecoder::Encoding ContentDecoder::encoding() const
+{
+    return m->encoding;
+}
+
+size_t ContentDecoder::decode(const char *&ioData, size_t& ioSize, char *out, size_t outSize)
+{
+    if (m->isFinished) {
+        return 0;
+    }
+
+    if (m->encoding == ENCODING_IDENTITY) {
+        size_t size = std::min(ioSize, outSize);
+        memcpy(out, ioData, size);
+
+        ioData += size;
+        ioSize -= size;
+        m->numBytesIn += size;
+        m->numBytesOut += size;
+
+        return size;
+    }
+
+#ifdef HAVE_ZLIB
+    z_stream& stream = m->stream;
+
+    stream.next_in = (Bytef *) ioData;
+    stream.avail_in = (uInt) std::min(ioSize, (size_t) UINT_MAX);
+    stream.next_out = (Bytef *) out;
+    stream.avail_out = (uInt) std::min(outSize, (size_t) UINT_MAX);
+
+    uInt availIn = stream.avail_in;
+    uInt availOut = stream.avail_out;
+
+    int ret = inflate(&stream, Z_NO_FLUSH);
+
+    if (ret == Z_DATA_ERROR && m->encoding == ENCODING_DEFLATE && !m->isRawDeflate && m->numBytesIn == 0) {
+        // some servers send deflate without zlib wrapper, retry as raw
+        inflateEnd(&stream);
+        m->isRawDeflate = true;
+        initInflate(stream, windowBits(m->encoding, true));
+
+        return decode(ioData, ioSize, out, outSize);
+    }
+
+    if (ret == Z_STREAM_END) {
+        m->isFinished = true;
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        throw std::runtime_error(std::string("corrupt encoded content: ") + (stream.msg ? stream.msg : "zlib error"));
+    }
+
+    size_t numConsumed = availIn - stream.avail_in;
+    size_t numProduced = availOut - stream.avail_out;
+
+    ioData += numConsumed;
+    ioSize -= numConsumed;
+    m->numBytesIn += numConsumed;
+    m->numBytesOut += numProduced;
+
+    return numProduced;
+#else
+    ut_assert_(false);
+    return 0;
+#endif
+}
+
+bool ContentDecoder::isFinished() const
+{
+    return m->isFinished;
+}
+
+size_t ContentDecoder::numBytesIn() const
+{
+    return m->numBytesIn;
+}
+
+size_t ContentDecoder::numBytesOut() const
+{
+    return m->numBytesOut;
+}
+
+}
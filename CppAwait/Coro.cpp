@@ -15,6 +15,8 @@
 */
 
 #include "ConfigPrivate.h"
+#include "ProfilerPrivate.h"
+#include "WatchdogPrivate.h"
 #include <CppAwait/Coro.h>
 #include <CppAwait/Log.h>
 #include <CppAwait/impl/Assert.h>
@@ -23,15 +25,33 @@
 #include <vector>
 #include <deque>
 #include <algorithm>
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
 #include <boost/version.hpp>
 #include <boost/context/all.hpp>
 
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define UT_HAVE_RDTSC
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define UT_HAVE_RDTSC
+#endif
+
 namespace ut {
 
 namespace ctx = boost::context;
 
 static std::vector<Coro *> sMasterCoroChain;
 static Coro *sCurrentCoro = nullptr;
+static uint64_t sSwitchCount = 0;
 
 static std::deque<ut::Action> sIdleActions;
 
@@ -91,6 +111,11 @@ Coro* masterCoro()
     return sMasterCoroChain.back();
 }
 
+uint64_t switchCount()
+{
+    return sSwitchCount;
+}
+
 PushMasterCoro::PushMasterCoro()
 {
     if (masterCoro() == sCurrentCoro) {
@@ -134,6 +159,234 @@ PushMasterCoro::~PushMasterCoro()
 }
 
 
+//
+// StackArena
+//
+
+// Carves stacks out of 2MB aligned regions backed by huge pages, so that
+// switching between coroutines touches fewer TLB entries.
+//
+// Stacks are separated by guard gaps. Protecting a gap would split the huge
+// page, so on huge page regions the gap holds a canary that gets checked
+// on recycle. Regions that end up on regular pages get real guard pages.
+//
+class StackArena
+{
+public:
+    static const size_t REGION_SIZE = 2 * 1024 * 1024;
+    static const size_t CANARY_SIZE = 64;
+    static const unsigned char CANARY_BYTE = 0xCD;
+
+    StackArena()
+        : mIsEnabled(false)
+        , mPageSize(0)
+        , mCurrent(nullptr)
+    {
+        memset(&mStats, 0, sizeof(mStats));
+    }
+
+    bool isEnabled() const
+    {
+        return mIsEnabled;
+    }
+
+    void setEnabled(bool enabled)
+    {
+#ifdef __linux__
+        mIsEnabled = enabled;
+        mPageSize = (size_t) sysconf(_SC_PAGESIZE);
+#else
+        mIsEnabled = false;
+#endif
+    }
+
+    // size that a carved stack would be stored under
+    size_t carvedSize(size_t stackSize) const
+    {
+        size_t size = roundToPage(stackSize);
+
+        return (mPageSize + size > REGION_SIZE ? stackSize : size);
+    }
+
+    // carve a stack, returns false if it doesn't fit into a region
+    bool allocate(size_t stackSize, ctx::stack_context& outStack)
+    {
+        size_t size = roundToPage(stackSize);
+        size_t slotSize = mPageSize + size;
+
+        if (slotSize > REGION_SIZE) {
+            return false;
+        }
+
+        if (mCurrent == nullptr || mCurrent->offset + slotSize > REGION_SIZE) {
+            mCurrent = reserveRegion();
+
+            if (mCurrent == nullptr) {
+                return false;
+            }
+        }
+
+        char *guard = mCurrent->base + mCurrent->offset;
+        char *bottom = guard + mPageSize;
+
+        if (mCurrent->kind == RK_REGULAR) {
+#ifdef __linux__
+            mprotect(guard, mPageSize, PROT_NONE);
+#endif
+        } else {
+            memset(bottom - CANARY_SIZE, CANARY_BYTE, CANARY_SIZE);
+        }
+
+        mCurrent->offset += slotSize;
+
+        mStats.numCarvedStacks++;
+        mStats.carvedBytes += slotSize;
+
+        outStack.sp = bottom + size;
+        outStack.size = size;
+
+        return true;
+    }
+
+    bool owns(const ctx::stack_context& stack) const
+    {
+        return findRegion(stack) != nullptr;
+    }
+
+    // returns false if stack has overflown into the guard gap
+    bool checkGuard(const ctx::stack_context& stack) const
+    {
+        const Region *region = findRegion(stack);
+
+        if (region == nullptr || region->kind == RK_REGULAR) {
+            return true;
+        }
+
+        const unsigned char *canary = (const unsigned char *) stack.sp - stack.size - CANARY_SIZE;
+
+        for (size_t i = 0; i < CANARY_SIZE; i++) {
+            if (canary[i] != CANARY_BYTE) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    const Coro::StackPoolStats& stats() const
+    {
+        return mStats;
+    }
+
+private:
+    enum RegionKind
+    {
+        RK_HUGETLB,     // explicit huge pages
+        RK_TRANSPARENT, // transparent huge pages requested
+        RK_REGULAR      // huge pages unavailable
+    };
+
+    struct Region
+    {
+        char *base;
+        size_t offset;
+        RegionKind kind;
+    };
+
+    typedef std::map<const char *, Region> RegionMap;
+
+    size_t roundToPage(size_t size) const
+    {
+        return (size + mPageSize - 1) / mPageSize * mPageSize;
+    }
+
+    const Region* findRegion(const ctx::stack_context& stack) const
+    {
+        const char *bottom = (const char *) stack.sp - stack.size;
+
+        RegionMap::const_iterator pos = mRegions.upper_bound(bottom);
+
+        if (pos == mRegions.begin()) {
+            return nullptr;
+        }
+        --pos;
+
+        if (bottom < pos->first + REGION_SIZE) {
+            return &pos->second;
+        } else {
+            return nullptr;
+        }
+    }
+
+    Region* reserveRegion()
+    {
+#ifdef __linux__
+        Region region;
+        region.offset = 0;
+
+        void *base = MAP_FAILED;
+
+# ifdef MAP_HUGETLB
+        base = mmap(nullptr, REGION_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+# endif
+
+        if (base != MAP_FAILED) {
+            region.kind = RK_HUGETLB;
+            mStats.numHugeTlbRegions++;
+        } else {
+            // over-reserve, then trim to a 2MB aligned region
+            size_t rawSize = 2 * REGION_SIZE;
+            char *raw = (char *) mmap(nullptr, rawSize, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+            if (raw == (char *) MAP_FAILED) {
+                ut_log_warn_("failed to reserve stack region");
+                return nullptr;
+            }
+
+            char *aligned = (char *) (((uintptr_t) raw + REGION_SIZE - 1) & ~((uintptr_t) REGION_SIZE - 1));
+
+            if (aligned > raw) {
+                munmap(raw, aligned - raw);
+            }
+            if (raw + rawSize > aligned + REGION_SIZE) {
+                munmap(aligned + REGION_SIZE, (raw + rawSize) - (aligned + REGION_SIZE));
+            }
+
+            base = aligned;
+            region.kind = RK_REGULAR;
+
+# ifdef MADV_HUGEPAGE
+            if (madvise(base, REGION_SIZE, MADV_HUGEPAGE) == 0) {
+                region.kind = RK_TRANSPARENT;
+                mStats.numTransparentHugeRegions++;
+            }
+# endif
+        }
+
+        region.base = (char *) base;
+
+        mStats.numRegions++;
+        mStats.regionBytes += REGION_SIZE;
+
+        ut_log_debug_("reserved stack region %p (%s)", base,
+            (region.kind == RK_HUGETLB ? "hugetlb" : (region.kind == RK_TRANSPARENT ? "thp" : "regular")));
+
+        return &mRegions.insert(std::make_pair(region.base, region)).first->second;
+#else
+        return nullptr;
+#endif
+    }
+
+    bool mIsEnabled;
+    size_t mPageSize;
+    RegionMap mRegions;
+    Region *mCurrent;
+    Coro::StackPoolStats mStats;
+};
+
+
 //
 // StackPool
 //
@@ -143,8 +396,12 @@ class StackPool
 public:
     StackPool() { }
 
-    ctx::stack_context obtain(size_t minStackSize)
+    ctx::stack_context obtain(size_t minStackSize, bool guarded = false)
     {
+        if (guarded) {
+            return obtainGuarded(minStackSize);
+        }
+
         // take smallest stack that fits requirement. create one if no match.
 
         ctx::stack_context stack;
@@ -157,7 +414,9 @@ public:
                 stackSize = minStackSize;
             }
 
-            stack = Allocator(stackSize).allocate();
+            if (!mArena.isEnabled() || !mArena.allocate(stackSize, stack)) {
+                stack = Allocator(stackSize).allocate();
+            }
         } else {
             stack = pos->second;
             mStacks.erase(pos);
@@ -168,19 +427,91 @@ public:
         return stack;
     }
 
-    void recycle(ctx::stack_context stack)
+    void recycle(ctx::stack_context stack, bool guarded = false)
     {
         ut_log_verbose_("recycled stack %p of size %ld", stack.sp, (long) stack.size);
 
+        if (guarded) {
+            mGuardedStacks.insert(std::make_pair(stack.size - guardSize(), stack));
+            return;
+        }
+
+        if (!mArena.checkGuard(stack)) {
+            ut_log_warn_("stack %p of size %ld has overflown into guard gap", stack.sp, (long) stack.size);
+            ut_assert_(false && "stack overflow");
+        }
+
         mStacks.insert(std::make_pair(stack.size, stack));
     }
 
     void drain()
     {
-        ut_foreach_(auto& pair, mStacks) {
-            Allocator(0).deallocate(pair.second);
+        // stacks carved from regions are kept, regions are never released
+        for (StackMap::iterator it = mStacks.begin(); it != mStacks.end(); ) {
+            if (mArena.owns(it->second)) {
+                ++it;
+            } else {
+                Allocator(0).deallocate(it->second);
+                it = mStacks.erase(it);
+            }
+        }
+
+        ut_foreach_(auto& item, mGuardedStacks) {
+            GuardedAllocator().deallocate(item.second);
         }
-        mStacks.clear();
+        mGuardedStacks.clear();
+    }
+
+    void reserve(size_t minStackSize, size_t numStacks, bool prefault)
+    {
+        size_t stackSize = Coro::minimumStackSize();
+        if (stackSize < minStackSize) {
+            stackSize = minStackSize;
+        }
+
+        // carved stacks are stored under page rounded size
+        size_t numExisting = mStacks.count(stackSize);
+
+        if (mArena.isEnabled()) {
+            size_t carvedSize = mArena.carvedSize(stackSize);
+
+            if (carvedSize != stackSize) {
+                numExisting += mStacks.count(carvedSize);
+            }
+        }
+
+        for (size_t i = numExisting; i < numStacks; i++) {
+            ctx::stack_context stack;
+
+            if (!mArena.isEnabled() || !mArena.allocate(stackSize, stack)) {
+                stack = Allocator(stackSize).allocate();
+            }
+
+            if (prefault) {
+                // touch pages top-down, the way stack grows. Stride is
+                // the smallest page size we care about.
+                for (char *p = (char *) stack.sp - 1; p >= (char *) stack.sp - stack.size; p -= 4096) {
+                    *(volatile char *) p = 0;
+                }
+            }
+
+            mStacks.insert(std::make_pair(stack.size, stack));
+        }
+
+        ut_log_debug_("reserved %ld stacks of size %ld", (long) (numStacks - std::min(numStacks, numExisting)), (long) stackSize);
+    }
+
+    void setHugePageStacks(bool enabled)
+    {
+        mArena.setEnabled(enabled);
+    }
+
+    Coro::StackPoolStats stats() const
+    {
+        Coro::StackPoolStats stats = mArena.stats();
+        stats.numPooledStacks = mStacks.size() + mGuardedStacks.size();
+
+        return stats;
     }
 
     static size_t maximumStackSize()
@@ -201,13 +532,293 @@ public:
 private:
     typedef std::multimap<size_t, ctx::stack_context> StackMap;
     typedef ctx::fixedsize_stack Allocator;
+    typedef ctx::protected_fixedsize_stack GuardedAllocator;
+
+    static size_t guardSize()
+    {
+        return ctx::stack_traits::page_size();
+    }
+
+    // guarded stacks are keyed by usable size, their stack_context
+    // also covers the guard page
+    ctx::stack_context obtainGuarded(size_t minStackSize)
+    {
+        ctx::stack_context stack;
+
+        StackMap::iterator pos = mGuardedStacks.lower_bound(minStackSize);
+
+        if (pos == mGuardedStacks.end()) {
+            size_t stackSize = Coro::minimumStackSize();
+            if (stackSize < minStackSize) {
+                stackSize = minStackSize;
+            }
+
+            // allocator adds the guard page on its own
+            stack = GuardedAllocator(stackSize).allocate();
+        } else {
+            stack = pos->second;
+            mGuardedStacks.erase(pos);
+        }
+
+        ut_log_verbose_("obtained guarded stack %p of size %ld", stack.sp, (long) stack.size);
+
+        return stack;
+    }
 
     StackMap mStacks;
+    StackMap mGuardedStacks;
+    StackArena mArena;
 };
 
 static StackPool sPool;
 
 
+//
+// StackProfiler
+//
+
+// Learns how much stack coroutines with a given tag need. While warming up
+// stacks get painted with a known pattern, the untouched part at the bottom
+// tells how deep the coroutine went.
+//
+class StackProfiler
+{
+public:
+    static const unsigned char PAINT_BYTE = 0xA5;
+
+    struct Profile
+    {
+        size_t numRuns;
+        size_t peakUsage;
+        size_t learnedSize; // 0 while warming up
+    };
+
+    StackProfiler()
+        : mIsEnabled(false)
+        , mNumWarmupRuns(0) { }
+
+    bool isEnabled() const
+    {
+        return mIsEnabled;
+    }
+
+    void setEnabled(bool enabled, size_t numWarmupRuns)
+    {
+        mIsEnabled = enabled;
+        mNumWarmupRuns = std::max(numWarmupRuns, (size_t) 1);
+    }
+
+    Profile* lookup(const std::string& tag)
+    {
+        return &mProfiles[tag];
+    }
+
+    const Profile* find(const std::string& tag) const
+    {
+        auto pos = mProfiles.find(tag);
+
+        return (pos == mProfiles.end() ? nullptr : &pos->second);
+    }
+
+    static void paint(const ctx::stack_context& stack)
+    {
+        memset((char *) stack.sp - stack.size, PAINT_BYTE, stack.size);
+    }
+
+    void measure(Profile *profile, const ctx::stack_context& stack)
+    {
+        const unsigned char *bottom = (const unsigned char *) stack.sp - stack.size;
+        const unsigned char *top = (const unsigned char *) stack.sp;
+
+        const unsigned char *p = bottom;
+        while (p < top && *p == PAINT_BYTE) {
+            p++;
+        }
+
+        size_t usage = top - p;
+
+        profile->numRuns++;
+        profile->peakUsage = std::max(profile->peakUsage, usage);
+
+        if (profile->numRuns < mNumWarmupRuns) {
+            return;
+        }
+
+        // leave half again as much headroom, but never more than the
+        // stack we have seen it run on
+        size_t needed = profile->peakUsage + profile->peakUsage / 2 + ctx::stack_traits::page_size();
+
+        size_t learnedSize = Coro::minimumStackSize();
+        while (learnedSize < needed && learnedSize < stack.size) {
+            learnedSize *= 2;
+        }
+
+        if (learnedSize >= stack.size || usage == stack.size) {
+            learnedSize = stack.size;
+        }
+
+        if (profile->learnedSize != learnedSize) {
+            ut_log_debug_("learned stack size %ld (peak %ld)", (long) learnedSize, (long) profile->peakUsage);
+        }
+
+        profile->learnedSize = std::max(profile->learnedSize, learnedSize);
+    }
+
+private:
+    typedef std::map<std::string, Profile> ProfileMap;
+
+    bool mIsEnabled;
+    size_t mNumWarmupRuns;
+    ProfileMap mProfiles;
+};
+
+static StackProfiler sProfiler;
+
+
+//
+// CpuAccountant
+//
+
+// Charges the time between coroutine switches to the coroutine being
+// suspended. Ticks come from the cycle counter, they get converted to
+// time by comparing against a steady clock over the whole accounting
+// period.
+//
+class CpuAccountant
+{
+public:
+    struct Account
+    {
+        uint64_t ticks;
+        uint64_t maxSliceTicks;
+        size_t numResumes;
+    };
+
+    CpuAccountant()
+        : mIsEnabled(false)
+        , mSliceStart(0)
+        , mEpochTicks(0) { }
+
+    bool isEnabled() const
+    {
+        return mIsEnabled;
+    }
+
+    void setEnabled(bool enabled)
+    {
+        if (enabled && !mIsEnabled) {
+            mSliceStart = readTicks();
+
+            if (mEpochTicks == 0) {
+                mEpochTicks = mSliceStart;
+                mEpochTime = Clock::now();
+            }
+        }
+
+        mIsEnabled = enabled;
+    }
+
+    Account* lookup(const std::string& tag)
+    {
+        return &mAccounts[tag];
+    }
+
+    void onSwitch(Account *from, Account *fromTag, Account *to, Account *toTag)
+    {
+        uint64_t now = readTicks();
+        uint64_t slice = now - mSliceStart;
+        mSliceStart = now;
+
+        charge(from, slice);
+        charge(fromTag, slice);
+
+        to->numResumes++;
+        toTag->numResumes++;
+    }
+
+    Coro::CpuStats toStats(const Account& account) const
+    {
+        Coro::CpuStats stats;
+        stats.cpuTime = toNanoseconds(account.ticks);
+        stats.maxSlice = toNanoseconds(account.maxSliceTicks);
+        stats.numResumes = account.numResumes;
+
+        return stats;
+    }
+
+    std::vector<std::pair<std::string, Coro::CpuStats> > statsByTag() const
+    {
+        std::vector<std::pair<std::string, Coro::CpuStats> > result;
+        result.reserve(mAccounts.size());
+
+        ut_foreach_(auto& entry, mAccounts) {
+            result.push_back(std::make_pair(entry.first, toStats(entry.second)));
+        }
+
+        std::sort(result.begin(), result.end(),
+            [](const std::pair<std::string, Coro::CpuStats>& a, const std::pair<std::string, Coro::CpuStats>& b) {
+                return a.second.cpuTime > b.second.cpuTime;
+            });
+
+        return result;
+    }
+
+    void reset()
+    {
+        // coroutines hold on to accounts, zero them in place
+        ut_foreach_(auto& entry, mAccounts) {
+            memset(&entry.second, 0, sizeof(Account));
+        }
+    }
+
+private:
+    typedef std::map<std::string, Account> AccountMap;
+    typedef std::chrono::steady_clock Clock;
+
+    static uint64_t readTicks()
+    {
+#ifdef UT_HAVE_RDTSC
+        return __rdtsc();
+#else
+        return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    static void charge(Account *account, uint64_t slice)
+    {
+        account->ticks += slice;
+        account->maxSliceTicks = std::max(account->maxSliceTicks, slice);
+    }
+
+    std::chrono::nanoseconds toNanoseconds(uint64_t ticks) const
+    {
+#ifdef UT_HAVE_RDTSC
+        uint64_t elapsedTicks = readTicks() - mEpochTicks;
+        auto elapsedTime = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - mEpochTime);
+
+        if (elapsedTicks == 0) {
+            return std::chrono::nanoseconds(0);
+        }
+
+        double nanosPerTick = (double) elapsedTime.count() / elapsedTicks;
+
+        return std::chrono::nanoseconds((long long) (ticks * nanosPerTick));
+#else
+        return std::chrono::nanoseconds((long long) ticks);
+#endif
+    }
+
+    bool mIsEnabled;
+    uint64_t mSliceStart;
+    uint64_t mEpochTicks;
+    Clock::time_point mEpochTime;
+    AccountMap mAccounts;
+};
+
+static CpuAccountant sAccountant;
+
+
 //
 // Stack
 //
@@ -243,6 +854,48 @@ void Coro::drainStackPool()
     sPool.drain();
 }
 
+void Coro::reserveStacks(size_t stackSize, size_t numStacks, bool prefault)
+{
+    sPool.reserve(stackSize, numStacks, prefault);
+}
+
+void Coro::setHugePageStacks(bool enabled)
+{
+    sPool.setHugePageStacks(enabled);
+}
+
+void Coro::setAdaptiveStacks(bool enabled, size_t numWarmupRuns)
+{
+    sProfiler.setEnabled(enabled, numWarmupRuns);
+}
+
+size_t Coro::adaptiveStackSize(const std::string& tag)
+{
+    const StackProfiler::Profile *profile = sProfiler.find(tag);
+
+    return (profile ? profile->learnedSize : 0);
+}
+
+Coro::StackPoolStats Coro::stackPoolStats()
+{
+    return sPool.stats();
+}
+
+void Coro::setCpuAccounting(bool enabled)
+{
+    sAccountant.setEnabled(enabled);
+}
+
+std::vector<std::pair<std::string, Coro::CpuStats> > Coro::cpuStatsByTag()
+{
+    return sAccountant.statsByTag();
+}
+
+void Coro::resetCpuStats()
+{
+    sAccountant.reset();
+}
+
 struct Coro::Impl
 {
     std::string tag;
@@ -252,16 +905,226 @@ struct Coro::Impl
     Coro::Func func;
     bool isRunning;
 
+    bool isGuarded;
+    StackProfiler::Profile *profile;
+
+    CpuAccountant::Account cpu;
+    CpuAccountant::Account *cpuTag;
+
+    const std::string *spawnChain;
+    unsigned spawnChainEpoch;
+    const std::string *stableTag;
+
+    SharedStack *sharedStack;
+    char *savedStack;
+    size_t savedSize;
+    size_t savedCapacity;
+
     Impl(std::string&& tag, ctx::stack_context stack)
         : tag(std::move(tag))
         , stack(stack)
         , fc(nullptr)
         , parent(nullptr)
-        , isRunning(false) { }
+        , isRunning(false)
+        , isGuarded(false)
+        , profile(nullptr)
+        , cpuTag(nullptr)
+        , spawnChain(nullptr)
+        , spawnChainEpoch(0)
+        , stableTag(nullptr)
+        , sharedStack(nullptr)
+        , savedStack(nullptr)
+        , savedSize(0)
+        , savedCapacity(0)
+    {
+        memset(&cpu, 0, sizeof(cpu));
+    }
+
+    Impl(std::string&& tag, SharedStack *sharedStack)
+        : tag(std::move(tag))
+        , fc(nullptr)
+        , parent(nullptr)
+        , isRunning(false)
+        , isGuarded(false)
+        , profile(nullptr)
+        , cpuTag(nullptr)
+        , spawnChain(nullptr)
+        , spawnChainEpoch(0)
+        , stableTag(nullptr)
+        , sharedStack(sharedStack)
+        , savedStack(nullptr)
+        , savedSize(0)
+        , savedCapacity(0)
+    {
+        memset(&cpu, 0, sizeof(cpu));
+    }
+};
+
+
+//
+// SharedStack
+//
+
+struct SharedStack::Impl
+{
+    ctx::stack_context stack;
+    Coro::Impl *occupant;
+    size_t numCoros;
+
+    Impl(ctx::stack_context stack)
+        : stack(stack)
+        , occupant(nullptr)
+        , numCoros(0) { }
 };
 
+SharedStack::SharedStack(size_t stackSize)
+    : m(new Impl(sPool.obtain(stackSize)))
+{
+}
+
+SharedStack::~SharedStack()
+{
+    ut_assert_(m->numCoros == 0 && "shared stack still in use");
+
+    sPool.recycle(m->stack);
+    delete m;
+}
+
+size_t SharedStack::stackSize()
+{
+    return m->stack.size;
+}
+
+size_t SharedStack::numCoros()
+{
+    return m->numCoros;
+}
+
+bool SharedStack::contains(const void *address)
+{
+    const char *top = (const char *) m->stack.sp;
+
+    return top - m->stack.size <= (const char *) address && (const char *) address < top;
+}
+
+// Switching between coroutines of the same shared stack can't be done in place, since
+// the stack being overwritten is the one we're running on. Such switches go through
+// a helper context with its own small stack.
+//
+struct SwapRequest
+{
+    Coro *from;
+    Coro *to;
+    void *value;
+};
+
+static SwapRequest sSwapRequest;
+static ctx::fcontext_t sSwapperFc = nullptr;
+
+// swapper may allocate and log, give it room for libc
+static const size_t SWAPPER_STACK_SIZE = 64 * 1024;
+
+// frames pushed between reserveSavedStack() and the actual switch
+static const size_t SWAP_STACK_SLACK = 1024;
+
+static ctx::fcontext_t swapperContext(void (*func)(intptr_t))
+{
+    if (sSwapperFc == nullptr) {
+        // leaked on purpose, see initCoroLib()
+        ctx::stack_context stack = ctx::fixedsize_stack(std::max(SWAPPER_STACK_SIZE, Coro::minimumStackSize())).allocate();
+        sSwapperFc = ctx::make_fcontext(stack.sp, stack.size, func);
+    }
+
+    return sSwapperFc;
+}
+
+// Keeps side buffer right-sized. Throws bad_alloc.
+void Coro::reserveSavedStack(Impl *impl, size_t size)
+{
+    if (impl->savedCapacity < size || impl->savedCapacity > 2 * size + SWAP_STACK_SLACK) {
+        free(impl->savedStack);
+        impl->savedStack = (char *) malloc(size);
+        impl->savedCapacity = size;
+
+        if (impl->savedStack == nullptr) {
+            impl->savedCapacity = 0;
+            throw std::bad_alloc();
+        }
+    }
+}
+
+void Coro::saveStack(Impl *impl)
+{
+    SharedStack::Impl *shared = impl->sharedStack->m;
+
+    ut_assert_(shared->occupant == impl);
+
+    if (impl->isRunning && impl->fc != nullptr) {
+        // suspended context is stored at the bottom of used stack
+        const char *top = (const char *) shared->stack.sp;
+        const char *bottom = (const char *) impl->fc;
+        size_t size = top - bottom;
+
+        // normally reserved before switching, see implYieldTo()
+        if (impl->savedCapacity < size) {
+            free(impl->savedStack);
+            impl->savedStack = (char *) malloc(size);
+            impl->savedCapacity = size;
+
+            if (impl->savedStack == nullptr) {
+                impl->savedCapacity = 0;
+                throw std::bad_alloc();
+            }
+        }
+
+        memcpy(impl->savedStack, bottom, size);
+        impl->savedSize = size;
+
+        ut_log_verbose_("saved %ld bytes of '%s' stack", (long) size, impl->tag.c_str());
+    }
+
+    shared->occupant = nullptr;
+}
+
+void Coro::loadStack(Impl *impl)
+{
+    SharedStack::Impl *shared = impl->sharedStack->m;
+
+    ut_assert_(shared->occupant == nullptr);
+
+    if (impl->fc == nullptr) {
+        // first run, context is made on demand since it lives on the stack
+        impl->fc = ctx::make_fcontext(shared->stack.sp, shared->stack.size, &Coro::fcontextFunc);
+    } else {
+        memcpy((char *) shared->stack.sp - impl->savedSize, impl->savedStack, impl->savedSize);
+
+        ut_log_verbose_("loaded %ld bytes of '%s' stack", (long) impl->savedSize, impl->tag.c_str());
+    }
+
+    shared->occupant = impl;
+}
+
+void Coro::swapperFunc(intptr_t data)
+{
+    for (;;) {
+        auto request = (SwapRequest *) data;
+
+        // source coroutine is now suspended, safe to copy it aside
+        try {
+            saveStack(request->from->m);
+        } catch (...) {
+            // nowhere to report failure from this context
+            fprintf(stderr, "CPP_ASYNC FATAL: out of memory saving '%s' stack\n", request->from->tag());
+            std::abort();
+        }
+        loadStack(request->to->m);
+
+        data = ctx::jump_fcontext(&sSwapperFc, request->to->m->fc, (intptr_t) request->value, true);
+    }
+}
+
 Coro::Coro(std::string tag, Func func, size_t stackSize)
-    : m(new Impl(std::move(tag), sPool.obtain(stackSize)))
+    : m(new Impl(std::move(tag), ctx::stack_context()))
 {
     if (sCurrentCoro == nullptr) {
         initCoroLib();
@@ -269,13 +1132,39 @@ Coro::Coro(std::string tag, Func func, size_t stackSize)
 
     ut_log_verbose_("- new coroutine '%s'", m->tag.c_str());
 
+    obtainStack(stackSize);
+
     init(std::move(func));
 }
 
 Coro::Coro(std::string tag, size_t stackSize)
-    : m(new Impl(std::move(tag), sPool.obtain(stackSize)))
+    : m(new Impl(std::move(tag), ctx::stack_context()))
 {
     ut_log_verbose_("- new coroutine '%s'", m->tag.c_str());
+
+    obtainStack(stackSize);
+}
+
+Coro::Coro(std::string tag, Func func, SharedStack& sharedStack)
+    : m(new Impl(std::move(tag), &sharedStack))
+{
+    if (sCurrentCoro == nullptr) {
+        initCoroLib();
+    }
+
+    ut_log_verbose_("- new coroutine '%s' on shared stack", m->tag.c_str());
+
+    sharedStack.m->numCoros++;
+
+    init(std::move(func));
+}
+
+Coro::Coro(std::string tag, SharedStack& sharedStack)
+    : m(new Impl(std::move(tag), &sharedStack))
+{
+    ut_log_verbose_("- new coroutine '%s' on shared stack", m->tag.c_str());
+
+    sharedStack.m->numCoros++;
 }
 
 Coro::Coro()
@@ -316,12 +1205,45 @@ void Coro::clear()
 
     if (this != sMasterCoroChain[0]) {
         ut_assert_(!isRunning() && "can't clear a running coroutine");
-        sPool.recycle(m->stack);
+
+        if (m->sharedStack) {
+            SharedStack::Impl *shared = m->sharedStack->m;
+
+            if (shared->occupant == m) {
+                shared->occupant = nullptr;
+            }
+            shared->numCoros--;
+            free(m->savedStack);
+        } else {
+            if (m->profile) {
+                sProfiler.measure(m->profile, m->stack);
+            }
+            sPool.recycle(m->stack, m->isGuarded);
+        }
     }
 
     delete m;
 }
 
+void Coro::obtainStack(size_t stackSize)
+{
+    if (sProfiler.isEnabled() && stackSize == defaultStackSize()) {
+        StackProfiler::Profile *profile = sProfiler.lookup(m->tag);
+
+        if (profile->learnedSize != 0) {
+            m->stack = sPool.obtain(profile->learnedSize, true);
+            m->isGuarded = true;
+        } else {
+            m->stack = sPool.obtain(stackSize);
+            m->profile = profile;
+
+            StackProfiler::paint(m->stack);
+        }
+    } else {
+        m->stack = sPool.obtain(stackSize);
+    }
+}
+
 const char* Coro::tag()
 {
     return m->tag.c_str();
@@ -339,7 +1261,30 @@ void Coro::init(Func func)
 
     m->parent = currentCoro();
     m->func = std::move(func);
-    m->fc = ctx::make_fcontext(m->stack.sp, m->stack.size, &Coro::fcontextFunc);
+
+    if (detail::sIsTrackingSpawnChains) {
+        Impl *spawner = m->parent->m;
+
+        if (spawner->spawnChainEpoch != detail::sSpawnChainEpoch) {
+            spawner->spawnChain = detail::internSpawnChain(nullptr, spawner->tag);
+            spawner->spawnChainEpoch = detail::sSpawnChainEpoch;
+        }
+        m->spawnChain = detail::internSpawnChain(spawner->spawnChain, m->tag);
+        m->spawnChainEpoch = detail::sSpawnChainEpoch;
+    }
+
+    if (m->sharedStack) {
+        // context gets made when coroutine first takes over the shared stack
+        SharedStack::Impl *shared = m->sharedStack->m;
+
+        if (shared->occupant == m) {
+            shared->occupant = nullptr;
+        }
+        m->fc = nullptr;
+        m->savedSize = 0;
+    } else {
+        m->fc = ctx::make_fcontext(m->stack.sp, m->stack.size, &Coro::fcontextFunc);
+    }
 
     m->isRunning = true;
 }
@@ -390,10 +1335,76 @@ void* Coro::implYieldTo(Coro *resumeCoro, YieldType type, void *value)
 
     // ut_log_debug_("-- jumping to '%s', type = %s", resumeCoro->tag(), (type == YT_RESULT ? "YT_RESULT" : "YT_EXCEPTION"));
 
+    YieldValue ySent(type, value);
+    ctx::fcontext_t resumeFc;
+    intptr_t data;
+
+    SharedStack *sharedStack = resumeCoro->m->sharedStack;
+
+    if (sharedStack == nullptr || sharedStack->m->occupant == resumeCoro->m) {
+        resumeFc = resumeCoro->m->fc;
+        data = (intptr_t) &ySent;
+    } else if (sharedStack != m->sharedStack) {
+        resumeCoro->restoreStack();
+
+        resumeFc = resumeCoro->m->fc;
+        data = (intptr_t) &ySent;
+    } else {
+        // size save buffer while failure can still be thrown here
+        char marker;
+        const char *top = (const char *) m->sharedStack->m->stack.sp;
+        reserveSavedStack(m, (top - &marker) + SWAP_STACK_SLACK);
+
+        // ySent may get copied aside together with our stack, pass a copy
+        static YieldValue sSwapValue(YT_RESULT, nullptr);
+        sSwapValue = ySent;
+
+        sSwapRequest.from = this;
+        sSwapRequest.to = resumeCoro;
+        sSwapRequest.value = &sSwapValue;
+
+        resumeFc = swapperContext(&Coro::swapperFunc);
+        data = (intptr_t) &sSwapRequest;
+    }
+
+    if (sAccountant.isEnabled()) {
+        Impl *from = m;
+        Impl *to = resumeCoro->m;
+
+        if (from->cpuTag == nullptr) {
+            from->cpuTag = sAccountant.lookup(from->tag);
+        }
+        if (to->cpuTag == nullptr) {
+            to->cpuTag = sAccountant.lookup(to->tag);
+        }
+
+        sAccountant.onSwitch(&from->cpu, from->cpuTag, &to->cpu, to->cpuTag);
+    }
+
+    if (detail::sIsTrackingSpawnChains) {
+        Impl *to = resumeCoro->m;
+
+        if (to->spawnChainEpoch != detail::sSpawnChainEpoch) {
+            to->spawnChain = detail::internSpawnChain(nullptr, to->tag);
+            to->spawnChainEpoch = detail::sSpawnChainEpoch;
+        }
+        detail::sCurrentSpawnChain = to->spawnChain;
+    }
+
+    if (detail::sIsWatchdogRunning) {
+        Impl *to = resumeCoro->m;
+
+        if (to->stableTag == nullptr) {
+            to->stableTag = detail::internTag(to->tag);
+        }
+        detail::sHeartbeat.beat(to->stableTag, resumeCoro == sMasterCoroChain[0]);
+    }
+
     sCurrentCoro = resumeCoro;
+    sSwitchCount++;
 
-    YieldValue ySent(type, value);
-    auto yReceived = (YieldValue *) ctx::jump_fcontext(&m->fc, resumeCoro->m->fc, (intptr_t) &ySent, true);
+    // copy, received value may live on a stack that is about to be swapped
+    YieldValue yReceived = *(YieldValue *) ctx::jump_fcontext(&m->fc, resumeFc, data, true);
 
     // ut_log_debug_("-- back to '%s', type = %s", resumeCoro->tag(), (yReceived->type == YT_RESULT ? "YT_RESULT" : "YT_EXCEPTION"));
 
@@ -411,7 +1422,7 @@ void* Coro::implYieldTo(Coro *resumeCoro, YieldType type, void *value)
         sIsRunningIdleActions = false;
     }
 
-    return unpackYieldValue(*yReceived);
+    return unpackYieldValue(yReceived);
 }
 
 void* Coro::unpackYieldValue(const YieldValue& yReceived)
@@ -446,6 +1457,36 @@ void Coro::setParent(Coro *coro)
     m->parent = coro;
 }
 
+SharedStack* Coro::sharedStack()
+{
+    return m->sharedStack;
+}
+
+Coro::CpuStats Coro::cpuStats()
+{
+    return sAccountant.toStats(m->cpu);
+}
+
+void Coro::restoreStack()
+{
+    if (m->sharedStack == nullptr) {
+        return;
+    }
+
+    SharedStack::Impl *shared = m->sharedStack->m;
+
+    if (shared->occupant == m) {
+        return;
+    }
+
+    ut_assert_(sCurrentCoro->m->sharedStack != m->sharedStack && "can't restore from a coroutine on the same stack");
+
+    if (shared->occupant != nullptr) {
+        saveStack(shared->occupant);
+    }
+    loadStack(m);
+}
+
 void Coro::fcontextFunc(intptr_t data)
 {
     Coro *coro = sCurrentCoro;
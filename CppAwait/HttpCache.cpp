@@ -0,0 +1,287 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "ConfigPrivate.h"
+#include "HttpPrivate.h"
+#include <CppAwait/HttpCache.h>
+#include <CppAwait/Log.h>
+#include <CppAwait/impl/StringUtil.h>
+
+namespace ut { namespace asio {
+
+using namespace boost::asio::ip;
+
+HttpCache::HttpCache(boost::asio::io_service& io, size_t maxEntries)
+    : mIo(io)
+    , mMaxEntries(maxEntries)
+{
+    ut_assert_(maxEntries > 0);
+}
+
+HttpCache::~HttpCache()
+{
+    clear();
+}
+
+Awaitable HttpCache::asyncGet(const std::string& host, const std::string& path, Body& outBody)
+{
+    std::string key = host + path;
+
+    auto it = mEntries.find(key);
+
+    if (it == mEntries.end()) {
+        it = mEntries.insert(std::make_pair(key, Entry())).first;
+
+        mLru.push_front(key);
+        it->second.lruPos = mLru.begin();
+    } else {
+        mLru.splice(mLru.begin(), mLru, it->second.lruPos);
+    }
+
+    Entry& entry = it->second;
+
+    if (entry.fetch && !entry.fetch->isDone()) {
+        mStats.numCoalesced++;
+
+        return asyncJoin(entry, outBody);
+    }
+
+    if (entry.body && Clock::now() < entry.expiresAt) {
+        mStats.numHits++;
+
+        outBody = entry.body;
+        return Awaitable::makeCompleted();
+    }
+
+    if (entry.body) {
+        mStats.numRevalidations++;
+    } else {
+        mStats.numMisses++;
+    }
+
+    startFetch(key, entry, host, path);
+
+    // may evict other entries, never the one being fetched
+    evict();
+
+    return asyncJoin(entry, outBody);
+}
+
+void HttpCache::clear()
+{
+    // fetches get interrupted, resumed waiters may call back into the cache
+    std::unordered_map<std::string, Entry> entries;
+    entries.swap(mEntries);
+    mLru.clear();
+
+    entries.clear();
+}
+
+size_t HttpCache::size() const
+{
+    return mEntries.size();
+}
+
+const HttpCache::Stats& HttpCache::stats() const
+{
+    return mStats;
+}
+
+Awaitable HttpCache::asyncJoin(const Entry& entry, Body& outBody)
+{
+    Awaitable awt = entry.fetch->asyncWait();
+
+    if (awt.isDone()) {
+        if (awt.didComplete()) {
+            outBody = *entry.fetchResult;
+        }
+        return std::move(awt);
+    }
+
+    // the fetch may be gone by now, read result from the holder
+    std::shared_ptr<Body> result = entry.fetchResult;
+    Body *outBodyPtr = &outBody;
+    auto awtPtr = awt.pointer();
+
+    // also called if interrupted
+    awt.then([result, outBodyPtr, awtPtr]() {
+        if (!awtPtr.didFail()) {
+            *outBodyPtr = *result;
+        }
+    });
+
+    return std::move(awt);
+}
+
+void HttpCache::startFetch(const std::string& key, Entry& entry, const std::string& host, const std::string& path)
+{
+    // entry owns the fetch, dropping it interrupts the fetch
+    entry.fetch = std::make_shared<Fetch>(string_printf("HttpCache-%s", key.c_str()));
+    entry.fetchResult = std::make_shared<Body>();
+
+    std::shared_ptr<Body> result = entry.fetchResult;
+    Body cachedBody = entry.body;
+    std::string etag = entry.etag;
+    std::string lastModified = entry.lastModified;
+
+    entry.fetch->setSource(startAsync(entry.fetch->tag(), [this, key, host, path, cachedBody, etag, lastModified, result]() {
+        doFetch(key, host, path, cachedBody, etag, lastModified, *result);
+    }));
+}
+
+void HttpCache::doFetch(const std::string& key, const std::string& host, const std::string& path,
+    Body cachedBody, const std::string& etag, const std::string& lastModified, Body& outBody)
+{
+    tcp::socket socket(mIo);
+
+    tcp::resolver::query query(host, "http");
+    tcp::resolver::iterator itConnected;
+    Awaitable awt = asyncResolveAndConnect(socket, query, itConnected);
+    awt.await();
+
+    std::string conditions;
+    if (cachedBody) {
+        if (!etag.empty()) {
+            conditions += "If-None-Match: " + etag + "\r\n";
+        }
+        if (!lastModified.empty()) {
+            conditions += "If-Modified-Since: " + lastModified + "\r\n";
+        }
+    }
+
+    writeHttpRequest(socket, "GET", host, path, false, conditions);
+
+    auto response = std::make_shared<streambuf>();
+    HttpResponseHeader header = readHttpResponseHeader(socket, response);
+
+    Body body;
+
+    if (header.statusCode == 304 && cachedBody) {
+        ut_log_debug_("* http cache: '%s' not modified", key.c_str());
+
+        mStats.numNotModified++;
+        body = cachedBody;
+    } else if (header.statusCode == 200) {
+        if (header.isChunked) {
+            throw std::runtime_error("chunked HTTP response not supported");
+        }
+
+        if (header.contentLength == (size_t) -1) {
+            // read until server closes connection
+            try {
+                awt = asyncRead(socket, response);
+                awt.await();
+            } catch (const boost::system::system_error& e) {
+                if (e.code() != boost::asio::error::eof) {
+                    throw;
+                }
+            }
+        } else if (response->size() < header.contentLength) {
+            size_t numBytesTransferred;
+            awt = asyncRead(socket, response, transfer_exactly(header.contentLength - response->size()), numBytesTransferred);
+            awt.await();
+        }
+
+        const char *data = buffer_cast<const char *>(response->data());
+        body = std::make_shared<const std::string>(data, std::min(response->size(), header.contentLength));
+    } else {
+        throw std::runtime_error(string_printf("bad HTTP status: %d", header.statusCode));
+    }
+
+    outBody = body;
+
+    // entries in flight don't get evicted
+    auto it = mEntries.find(key);
+    ut_assert_(it != mEntries.end());
+
+    Entry& entry = it->second;
+
+    if (header.noStore) {
+        eraseAfterFetch(key, entry);
+        return;
+    }
+
+    entry.body = body;
+
+    // a 304 may leave out validators, keep the old ones
+    if (header.statusCode == 200 || !header.etag.empty()) {
+        entry.etag = header.etag;
+    }
+    if (header.statusCode == 200 || !header.lastModified.empty()) {
+        entry.lastModified = header.lastModified;
+    }
+
+    if (header.noCache || header.maxAge < 0) {
+        entry.expiresAt = Clock::now(); // revalidate on next use
+    } else {
+        entry.expiresAt = Clock::now() + std::chrono::seconds(header.maxAge);
+    }
+
+    if (entry.etag.empty() && entry.lastModified.empty() && Clock::now() >= entry.expiresAt) {
+        // can't be reused
+        eraseAfterFetch(key, entry);
+    }
+}
+
+void HttpCache::evict()
+{
+    auto pos = mLru.end();
+
+    while (mEntries.size() > mMaxEntries && pos != mLru.begin()) {
+        --pos;
+
+        auto it = mEntries.find(*pos);
+        ut_assert_(it != mEntries.end());
+
+        if (it->second.fetch && !it->second.fetch->isDone()) {
+            continue; // in flight
+        }
+
+        ut_log_debug_("* http cache: evict '%s'", pos->c_str());
+
+        pos = mLru.erase(pos);
+        mEntries.erase(it);
+    }
+}
+
+// Called from the fetch coroutine, which the entry owns. Erasing must wait
+// until the coroutine has unwound. Waiters read the result from fetchResult.
+//
+void HttpCache::eraseAfterFetch(const std::string& key, const Entry& entry)
+{
+    std::weak_ptr<Fetch> weakFetch = entry.fetch;
+
+    postIdleAction([this, key, weakFetch]() {
+        // fetch outlives its entry only while this cache exists
+        std::shared_ptr<Fetch> fetch = weakFetch.lock();
+        if (!fetch) {
+            return;
+        }
+
+        auto it = mEntries.find(key);
+
+        if (it != mEntries.end() && it->second.fetch == fetch) {
+            ut_log_debug_("* http cache: drop '%s', not reusable", key.c_str());
+
+            mLru.erase(it->second.lruPos);
+            mEntries.erase(it);
+        }
+
+        // fetch destroyed here, waiters may call back into the cache
+    });
+}
+
+} }
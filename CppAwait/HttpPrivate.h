@@ -0,0 +1,221 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <CppAwait/AsioWrappers.h>
+#include <CppAwait/impl/Foreach.h>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+
+namespace ut { namespace asio {
+
+using namespace boost::asio;
+
+struct HttpResponseHeader
+{
+    int statusCode;
+    size_t contentLength;
+    bool acceptsRanges;
+    bool isKeepAlive;
+    bool isChunked;
+    std::string contentEncoding;
+
+    // caching
+    std::string etag;
+    std::string lastModified;
+    long maxAge; // seconds, -1 if missing
+    bool noStore;
+    bool noCache;
+
+    // protocol upgrade
+    std::string upgrade;
+    std::string webSocketAccept;
+};
+
+struct HttpRequestHeader
+{
+    std::string method;
+    std::string path;
+    std::string host;
+
+    // protocol upgrade
+    std::string upgrade;
+    std::string webSocketKey;
+    std::string webSocketVersion;
+};
+
+template <typename Socket>
+void writeHttpRequest(Socket& socket, const char *method,
+    const std::string& host, const std::string& path, bool persistentConnection,
+    const std::string& extraHeaders = std::string())
+{
+    if (!socket.lowest_layer().is_open()) {
+        throw std::runtime_error("socket not connected");
+    }
+
+    auto request = std::make_shared<streambuf>();
+
+    // write HTTP request
+    std::ostream requestStream(request.get());
+    requestStream << method << " " << path << " HTTP/1.1\r\n";
+    requestStream << "Host: " << host << "\r\n";
+    requestStream << "Accept: */*\r\n";
+    if (!persistentConnection) {
+        requestStream << "Connection: close\r\n";
+    }
+    requestStream << extraHeaders;
+    requestStream << "\r\n";
+
+    Awaitable awt = asyncWrite(socket, request);
+    awt.await();
+}
+
+inline void parseCacheControl(const std::string& value, HttpResponseHeader& ioHeader)
+{
+    std::vector<std::string> directives;
+    boost::split(directives, value, boost::is_any_of(","));
+
+    ut_foreach_(std::string& directive, directives) {
+        boost::trim(directive);
+
+        if (boost::iequals(directive, "no-store")) {
+            ioHeader.noStore = true;
+        } else if (boost::iequals(directive, "no-cache")) {
+            ioHeader.noCache = true;
+        } else if (boost::istarts_with(directive, "max-age=")) {
+            try {
+                ioHeader.maxAge = boost::lexical_cast<long>(directive.substr(strlen("max-age=")));
+            } catch (const boost::bad_lexical_cast&) {
+                ioHeader.maxAge = 0;
+            }
+        }
+    }
+}
+
+// reads status line and headers, body bytes read along stay in response
+template <typename Socket>
+HttpResponseHeader readHttpResponseHeader(Socket& socket, std::shared_ptr<streambuf> response)
+{
+    HttpResponseHeader result;
+
+    // read first response line
+    Awaitable awt = asyncReadUntil(socket, response, std::string("\r\n"));
+    awt.await();
+
+    std::istream responseStream(response.get());
+    std::string httpVersion;
+    responseStream >> httpVersion;
+    responseStream >> result.statusCode;
+    std::string statusMessage;
+    std::getline(responseStream, statusMessage);
+
+    if (!responseStream || !boost::starts_with(httpVersion, "HTTP/")) {
+        throw std::runtime_error("invalid HTTP response");
+    }
+
+    // read response headers
+    awt = asyncReadUntil(socket, response, std::string("\r\n\r\n"));
+    awt.await();
+
+    // process headers
+    std::string header;
+    result.contentLength = (size_t) -1;
+    result.acceptsRanges = false;
+    result.isKeepAlive = (httpVersion == "HTTP/1.1"); // HTTP/1.0 closes unless asked to keep alive
+    result.isChunked = false;
+    result.maxAge = -1;
+    result.noStore = false;
+    result.noCache = false;
+
+    while (std::getline(responseStream, header) && header != "\r") {
+        boost::trim_right(header);
+
+        if (boost::istarts_with(header, "Content-Length: ")) {
+            result.contentLength = boost::lexical_cast<size_t>(header.substr(strlen("Content-Length: ")));
+        } else if (boost::istarts_with(header, "Accept-Ranges: ")) {
+            result.acceptsRanges = boost::icontains(header, "bytes");
+        } else if (boost::istarts_with(header, "Connection: ")) {
+            if (boost::icontains(header, "close")) {
+                result.isKeepAlive = false;
+            } else if (boost::icontains(header, "keep-alive")) {
+                result.isKeepAlive = true;
+            }
+        } else if (boost::istarts_with(header, "Transfer-Encoding: ")) {
+            result.isChunked = boost::icontains(header, "chunked");
+        } else if (boost::istarts_with(header, "Content-Encoding: ")) {
+            result.contentEncoding = header.substr(strlen("Content-Encoding: "));
+        } else if (boost::istarts_with(header, "ETag: ")) {
+            result.etag = header.substr(strlen("ETag: "));
+        } else if (boost::istarts_with(header, "Last-Modified: ")) {
+            result.lastModified = header.substr(strlen("Last-Modified: "));
+        } else if (boost::istarts_with(header, "Cache-Control: ")) {
+            parseCacheControl(header.substr(strlen("Cache-Control: ")), result);
+        } else if (boost::istarts_with(header, "Upgrade: ")) {
+            result.upgrade = header.substr(strlen("Upgrade: "));
+        } else if (boost::istarts_with(header, "Sec-WebSocket-Accept: ")) {
+            result.webSocketAccept = header.substr(strlen("Sec-WebSocket-Accept: "));
+        }
+    }
+
+    return result;
+}
+
+// reads request line and headers, body bytes read along stay in request
+template <typename Socket>
+HttpRequestHeader readHttpRequestHeader(Socket& socket, std::shared_ptr<streambuf> request)
+{
+    HttpRequestHeader result;
+
+    Awaitable awt = asyncReadUntil(socket, request, std::string("\r\n\r\n"));
+    awt.await();
+
+    // process request line
+    std::istream requestStream(request.get());
+    std::string httpVersion;
+    requestStream >> result.method;
+    requestStream >> result.path;
+    requestStream >> httpVersion;
+    requestStream.ignore(2, '\n');
+
+    if (!requestStream || !boost::starts_with(httpVersion, "HTTP/")) {
+        throw std::runtime_error("invalid HTTP request");
+    }
+
+    // process headers
+    std::string header;
+
+    while (std::getline(requestStream, header) && header != "\r") {
+        boost::trim_right(header);
+
+        if (boost::istarts_with(header, "Host: ")) {
+            result.host = header.substr(strlen("Host: "));
+        } else if (boost::istarts_with(header, "Upgrade: ")) {
+            result.upgrade = header.substr(strlen("Upgrade: "));
+        } else if (boost::istarts_with(header, "Sec-WebSocket-Key: ")) {
+            result.webSocketKey = header.substr(strlen("Sec-WebSocket-Key: "));
+        } else if (boost::istarts_with(header, "Sec-WebSocket-Version: ")) {
+            result.webSocketVersion = header.substr(strlen("Sec-WebSocket-Version: "));
+        }
+    }
+
+    return result;
+}
+
+} }
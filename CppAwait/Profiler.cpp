@@ -0,0 +1,422 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "ConfigPrivate.h"
+#include "ProfilerPrivate.h"
+#include <CppAwait/Profiler.h>
+#include <CppAwait/Coro.h>
+#include <CppAwait/Log.h>
+#include <CppAwait/impl/Assert.h>
+#include <CppAwait/impl/Foreach.h>
+#include <CppAwait/impl/StringUtil.h>
+#include <set>
+#include <map>
+#include <vector>
+#include <cstring>
+
+#if (defined(__GLIBC__) || defined(__APPLE__)) && !defined(__ANDROID__)
+#define UT_HAVE_SIGPROF
+#endif
+
+#if defined(UT_HAVE_SIGPROF) && defined(__linux__)
+#define UT_HAVE_THREAD_CPU_TIMER
+#endif
+
+#ifdef UT_HAVE_SIGPROF
+#include <signal.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#endif
+
+#ifdef UT_HAVE_THREAD_CPU_TIMER
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// missing from older glibc headers
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+
+namespace ut {
+
+//
+// spawn chains
+//
+
+namespace detail {
+
+    bool sIsTrackingSpawnChains = false;
+
+    unsigned sSpawnChainEpoch = 1;
+
+    const std::string * volatile sCurrentSpawnChain = nullptr;
+
+    static std::set<std::string> sSpawnChains;
+
+    const std::string* internSpawnChain(const std::string *parentChain, const std::string& tag)
+    {
+        std::string chain;
+
+        if (parentChain) {
+            chain = *parentChain;
+            chain += ';';
+        }
+
+        // keep folded format intact
+        chain += '[';
+        ut_foreach_(char c, tag) {
+            chain += (c == ';' || c == ' ' ? '_' : c);
+        }
+        chain += ']';
+
+        return &*sSpawnChains.insert(std::move(chain)).first;
+    }
+}
+
+#ifdef UT_HAVE_SIGPROF
+
+//
+// sampling
+//
+
+static const int MAX_DEPTH = 48;
+
+// frames of signal handler and trampoline
+static const int NUM_SKIPPED_FRAMES = 2;
+
+struct Sample
+{
+    const std::string *spawnChain;
+    int depth;
+    void *frames[MAX_DEPTH];
+};
+
+static std::vector<Sample> sSamples;
+static volatile size_t sNumSamples = 0;
+static volatile size_t sNumDropped = 0;
+
+// spawn chains of recorded samples, outlive profiling
+static std::set<std::string> sSampledChains;
+
+static bool sIsRunning = false;
+static pthread_t sSampledThread;
+static struct sigaction sOldAction;
+
+#ifdef UT_HAVE_THREAD_CPU_TIMER
+static timer_t sTimer;
+#endif
+
+// async signal context: no allocations, no locks
+//
+static void onSigprof(int)
+{
+    int savedErrno = errno;
+
+    if (pthread_equal(pthread_self(), sSampledThread)) {
+        size_t index = sNumSamples;
+
+        if (index < sSamples.size()) {
+            Sample& sample = sSamples[index];
+            sample.spawnChain = detail::sCurrentSpawnChain;
+            sample.depth = backtrace(sample.frames, MAX_DEPTH);
+
+            sNumSamples = index + 1;
+        } else {
+            sNumDropped = sNumDropped + 1;
+        }
+    } else {
+        // process wide timer hit another thread
+        sNumDropped = sNumDropped + 1;
+    }
+
+    errno = savedErrno;
+}
+
+static bool startTimer(long interval)
+{
+#ifdef UT_HAVE_THREAD_CPU_TIMER
+    // count CPU time of this thread only and signal just this thread
+    clockid_t clock;
+
+    if (pthread_getcpuclockid(pthread_self(), &clock) != 0) {
+        return false;
+    }
+
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = (pid_t) syscall(SYS_gettid);
+
+    if (timer_create(clock, &event, &sTimer) != 0) {
+        return false;
+    }
+
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = interval / 1000000;
+    spec.it_interval.tv_nsec = (interval % 1000000) * 1000;
+    spec.it_value = spec.it_interval;
+
+    if (timer_settime(sTimer, 0, &spec, nullptr) != 0) {
+        timer_delete(sTimer);
+        return false;
+    }
+
+    return true;
+#else
+    struct itimerval timer;
+    timer.it_interval.tv_sec = interval / 1000000;
+    timer.it_interval.tv_usec = interval % 1000000;
+    timer.it_value = timer.it_interval;
+
+    return (setitimer(ITIMER_PROF, &timer, nullptr) == 0);
+#endif
+}
+
+static void stopTimer()
+{
+#ifdef UT_HAVE_THREAD_CPU_TIMER
+    timer_delete(sTimer);
+#else
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, nullptr);
+#endif
+}
+
+// Stops tracking and frees interned chains. Chains that samples refer to
+// move to sSampledChains. Coroutines notice the epoch change and re-intern.
+//
+static void releaseSpawnChains()
+{
+    detail::sIsTrackingSpawnChains = false;
+    detail::sCurrentSpawnChain = nullptr;
+
+    size_t numSamples = sNumSamples;
+
+    for (size_t i = 0; i < numSamples; i++) {
+        Sample& sample = sSamples[i];
+
+        if (sample.spawnChain) {
+            sample.spawnChain = &*sSampledChains.insert(*sample.spawnChain).first;
+        }
+    }
+
+    detail::sSpawnChains.clear();
+    detail::sSpawnChainEpoch++;
+}
+
+bool startProfiler(int samplesPerSecond, size_t maxSamples)
+{
+    ut_assert_(!sIsRunning && "profiler already running");
+    ut_assert_(samplesPerSecond > 0);
+
+    if (sSamples.size() != maxSamples) {
+        ut_assert_(sNumSamples == 0 && "reset profiler before changing maxSamples");
+
+        sSamples.resize(maxSamples);
+    }
+
+    // First call loads libgcc's unwinder, which allocates and takes the
+    // loader lock. Later calls from the signal handler only walk the stack.
+    void *frames[1];
+    backtrace(frames, 1);
+
+    detail::sIsTrackingSpawnChains = true;
+    detail::sCurrentSpawnChain = detail::internSpawnChain(nullptr, currentCoro()->tag());
+
+    sSampledThread = pthread_self();
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &onSigprof;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    if (sigaction(SIGPROF, &action, &sOldAction) != 0) {
+        ut_log_warn_("profiler: failed to install SIGPROF handler");
+        releaseSpawnChains();
+        return false;
+    }
+
+    long interval = std::max(1000000L / samplesPerSecond, 1L);
+
+    if (!startTimer(interval)) {
+        ut_log_warn_("profiler: failed to start CPU timer");
+        sigaction(SIGPROF, &sOldAction, nullptr);
+        releaseSpawnChains();
+        return false;
+    }
+
+    sIsRunning = true;
+
+    ut_log_info_("profiler: started at %d samples/s", samplesPerSecond);
+
+    return true;
+}
+
+void stopProfiler()
+{
+    if (!sIsRunning) {
+        return;
+    }
+
+    stopTimer();
+
+    sigaction(SIGPROF, &sOldAction, nullptr);
+
+    sIsRunning = false;
+
+    releaseSpawnChains();
+
+    ut_log_info_("profiler: stopped, %ld samples, %ld dropped", (long) sNumSamples, (long) sNumDropped);
+}
+
+bool isProfilerRunning()
+{
+    return sIsRunning;
+}
+
+size_t profilerNumSamples()
+{
+    return sNumSamples;
+}
+
+size_t profilerNumDropped()
+{
+    return sNumDropped;
+}
+
+//
+// output
+//
+
+static std::string symbolize(void *address)
+{
+    Dl_info info;
+
+    if (dladdr(address, &info) == 0) {
+        return string_printf("%p", address);
+    }
+
+    if (info.dli_sname) {
+        int status = 0;
+        char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+
+        std::string name = (status == 0 ? demangled : info.dli_sname);
+        free(demangled);
+
+        return name;
+    }
+
+    if (info.dli_fname) {
+        const char *module = strrchr(info.dli_fname, '/');
+        module = (module ? module + 1 : info.dli_fname);
+
+        return string_printf("%s+0x%lx", module, (unsigned long) ((char *) address - (char *) info.dli_fbase));
+    }
+
+    return string_printf("%p", address);
+}
+
+void writeFoldedStacks(std::ostream& os)
+{
+    // samples below this count are complete, handler only appends
+    size_t numSamples = sNumSamples;
+
+    std::map<void *, std::string> symbols;
+    std::map<std::string, size_t> stacks;
+
+    for (size_t i = 0; i < numSamples; i++) {
+        const Sample& sample = sSamples[i];
+
+        std::string stack = (sample.spawnChain ? *sample.spawnChain : std::string("[?]"));
+
+        // backtrace() lists innermost frame first
+        for (int j = sample.depth - 1; j >= NUM_SKIPPED_FRAMES; j--) {
+            void *address = sample.frames[j];
+
+            auto pos = symbols.find(address);
+            if (pos == symbols.end()) {
+                pos = symbols.insert(std::make_pair(address, symbolize(address))).first;
+            }
+
+            stack += ';';
+            stack += pos->second;
+        }
+
+        stacks[stack]++;
+    }
+
+    ut_foreach_(auto& entry, stacks) {
+        os << entry.first << ' ' << entry.second << '\n';
+    }
+}
+
+void resetProfiler()
+{
+    ut_assert_(!sIsRunning && "stop profiler first");
+
+    sNumSamples = 0;
+    sNumDropped = 0;
+
+    sSampledChains.clear();
+}
+
+#else // not UT_HAVE_SIGPROF
+
+bool startProfiler(int samplesPerSecond, size_t maxSamples)
+{
+    ut_log_warn_("profiler: not supported on this platform");
+    return false;
+}
+
+void stopProfiler()
+{
+}
+
+bool isProfilerRunning()
+{
+    return false;
+}
+
+size_t profilerNumSamples()
+{
+    return 0;
+}
+
+size_t profilerNumDropped()
+{
+    return 0;
+}
+
+void writeFoldedStacks(std::ostream& os)
+{
+}
+
+void resetProfiler()
+{
+}
+
+#endif // UT_HAVE_SIGPROF
+
+}
@@ -0,0 +1,38 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <string>
+
+namespace ut {
+
+namespace detail {
+
+    // set while profiling, coroutines then track their spawn chain
+    extern bool sIsTrackingSpawnChains;
+
+    // bumped when chains are freed, coroutines holding an older chain re-intern
+    extern unsigned sSpawnChainEpoch;
+
+    // spawn chain of running coroutine, read from signal handler
+    extern const std::string * volatile sCurrentSpawnChain;
+
+    // returns a pointer that stays valid until the epoch changes
+    const std::string* internSpawnChain(const std::string *parentChain, const std::string& tag);
+}
+
+}
@@ -16,13 +16,12 @@
 
 #include "ConfigPrivate.h"
 #include <CppAwait/impl/SharedFlag.h>
-
-#ifdef UT_ENABLE_SHARED_FLAG_POOL
-
+#include <vector>
 #include <boost/pool/pool_alloc.hpp>
 
 namespace ut {
 
+// chunks are sized for the shared_ptr control block, the allocator gets rebound
 typedef boost::fast_pool_allocator<
     SharedFlag,
     boost::default_user_allocator_new_delete,
@@ -33,17 +32,15 @@ SharedFlag allocateSharedFlag(void *value)
     return std::allocate_shared<void *>(SharedFlagAllocator(), value);
 }
 
-}
-
-#else
-
-namespace ut {
-
-SharedFlag allocateSharedFlag(void *value)
+void reserveSharedFlags(size_t count)
 {
-    return std::make_shared<void *>(value);
-}
+    // grow pool, freed chunks are kept for reuse
+    std::vector<SharedFlag> flags;
+    flags.reserve(count);
 
+    for (size_t i = 0; i < count; i++) {
+        flags.push_back(allocateSharedFlag());
+    }
 }
 
-#endif
+}
@@ -0,0 +1,346 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "ConfigPrivate.h"
+#include "WatchdogPrivate.h"
+#include <CppAwait/Watchdog.h>
+#include <CppAwait/Coro.h>
+#include <CppAwait/Log.h>
+#include <CppAwait/impl/Assert.h>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#include <time.h>
+#define UT_HAVE_THREAD_CPU_CLOCK
+#endif
+
+#if (defined(__GLIBC__) || defined(__APPLE__)) && !defined(__ANDROID__)
+#include <signal.h>
+#include <errno.h>
+#include <execinfo.h>
+#define UT_HAVE_STACK_CAPTURE
+#endif
+
+namespace ut {
+
+namespace detail {
+
+    bool sIsWatchdogRunning = false;
+
+    Heartbeat sHeartbeat;
+
+    static std::set<std::string> sTags;
+
+    const std::string* internTag(const std::string& tag)
+    {
+        return &*sTags.insert(tag).first;
+    }
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static int64_t nowNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now().time_since_epoch()).count();
+}
+
+//
+// loop thread CPU time
+//
+
+#ifdef UT_HAVE_THREAD_CPU_CLOCK
+
+static clockid_t sLoopCpuClock;
+static bool sHasLoopCpuClock = false;
+
+static void initLoopCpuClock()
+{
+    sHasLoopCpuClock = (pthread_getcpuclockid(pthread_self(), &sLoopCpuClock) == 0);
+}
+
+static int64_t loopCpuNanoseconds()
+{
+    struct timespec ts;
+
+    if (!sHasLoopCpuClock || clock_gettime(sLoopCpuClock, &ts) != 0) {
+        return -1;
+    }
+
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#else
+
+static void initLoopCpuClock()
+{
+}
+
+static int64_t loopCpuNanoseconds()
+{
+    return -1;
+}
+
+#endif // UT_HAVE_THREAD_CPU_CLOCK
+
+//
+// stack capture
+//
+
+#ifdef UT_HAVE_STACK_CAPTURE
+
+static const int MAX_DEPTH = 48;
+
+static pthread_t sLoopThread;
+static void *sCapturedFrames[MAX_DEPTH];
+static std::atomic<int> sCapturedDepth(0);
+static struct sigaction sOldAction;
+
+// async signal context: no allocations, no locks. backtrace() isn't formally
+// async-signal-safe, see installStackCapture().
+//
+static void onCaptureSignal(int)
+{
+    int savedErrno = errno;
+
+    sCapturedDepth.store(backtrace(sCapturedFrames, MAX_DEPTH), std::memory_order_release);
+
+    errno = savedErrno;
+}
+
+static void installStackCapture()
+{
+    sLoopThread = pthread_self();
+
+    // first call loads libgcc's unwinder, which allocates and takes the
+    // loader lock. Later calls only walk the stack.
+    void *frames[1];
+    backtrace(frames, 1);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &onCaptureSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    sigaction(SIGUSR2, &action, &sOldAction);
+}
+
+static void uninstallStackCapture()
+{
+    sigaction(SIGUSR2, &sOldAction, nullptr);
+}
+
+static void logStackOfLoopThread()
+{
+    sCapturedDepth.store(0, std::memory_order_relaxed);
+
+    if (pthread_kill(sLoopThread, SIGUSR2) != 0) {
+        return;
+    }
+
+    for (int i = 0; i < 100 && sCapturedDepth.load(std::memory_order_acquire) == 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    int depth = sCapturedDepth.load(std::memory_order_acquire);
+    if (depth == 0) {
+        ut_log_warn_("watchdog: stack capture timed out");
+        return;
+    }
+
+    char **symbols = backtrace_symbols(sCapturedFrames, depth);
+
+    // skip frames of signal handler and trampoline
+    for (int i = 2; i < depth; i++) {
+        ut_log_warn_("    #%d %s", i - 2, (symbols ? symbols[i] : "?"));
+    }
+
+    free(symbols);
+}
+
+#else
+
+static void installStackCapture()
+{
+}
+
+static void uninstallStackCapture()
+{
+}
+
+static void logStackOfLoopThread()
+{
+}
+
+#endif // UT_HAVE_STACK_CAPTURE
+
+//
+// watchdog thread
+//
+
+static std::thread sThread;
+static std::mutex sMutex;
+static std::condition_variable sCondStop;
+static bool sIsStopping = false;
+static bool sCapturesStacks = false;
+static StallStats sStats;
+
+static void recordStall(std::chrono::milliseconds threshold, int64_t duration, const std::string& tag)
+{
+    auto stallTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::nanoseconds(duration));
+
+    std::lock_guard<std::mutex> lock(sMutex);
+
+    size_t bucket = 0;
+    while (bucket < StallStats::NUM_BUCKETS - 1 && stallTime >= threshold * (2 << bucket)) {
+        bucket++;
+    }
+
+    sStats.numStalls++;
+    sStats.histogram[bucket]++;
+    sStats.totalStallTime += stallTime;
+
+    if (stallTime > sStats.longestStall) {
+        sStats.longestStall = stallTime;
+        sStats.longestStallTag = tag;
+    }
+}
+
+static void watch(std::chrono::milliseconds threshold, bool captureStacks)
+{
+    const int64_t thresholdNs = std::chrono::duration_cast<std::chrono::nanoseconds>(threshold).count();
+    const auto pollInterval = std::max(threshold / 4, std::chrono::milliseconds(1));
+
+    uint64_t lastSwitches = detail::sHeartbeat.numSwitches.load(std::memory_order_acquire);
+    int64_t lastPollTime = nowNanoseconds();
+    int64_t lastCpuTime = loopCpuNanoseconds();
+
+    bool isStalled = false;
+    int64_t stallStart = 0;
+    std::string stallTag;
+
+    std::unique_lock<std::mutex> lock(sMutex);
+
+    while (!sCondStop.wait_for(lock, pollInterval, []() { return sIsStopping; })) {
+        lock.unlock();
+
+        uint64_t numSwitches = detail::sHeartbeat.numSwitches.load(std::memory_order_acquire);
+        int64_t switchTime = detail::sHeartbeat.switchTime.load(std::memory_order_relaxed);
+        const std::string *tag = detail::sHeartbeat.tag.load(std::memory_order_relaxed);
+        bool isMain = detail::sHeartbeat.isMain.load(std::memory_order_relaxed);
+
+        int64_t now = nowNanoseconds();
+        int64_t cpuTime = loopCpuNanoseconds();
+
+        // main coroutine may be waiting for events, only busy counts
+        bool isBusy = (cpuTime >= 0 && lastCpuTime >= 0 && (cpuTime - lastCpuTime) * 2 > now - lastPollTime);
+
+        lastPollTime = now;
+        lastCpuTime = cpuTime;
+
+        if (numSwitches != lastSwitches) {
+            if (isStalled) {
+                recordStall(threshold, switchTime - stallStart, stallTag);
+                isStalled = false;
+            }
+            lastSwitches = numSwitches;
+        } else if (isStalled) {
+            if (isMain && !isBusy) {
+                recordStall(threshold, now - stallStart, stallTag);
+                isStalled = false;
+            }
+        } else if (tag != nullptr && now - switchTime > thresholdNs && (!isMain || isBusy)) {
+            isStalled = true;
+            stallStart = (isMain ? now - thresholdNs : switchTime);
+            stallTag = *tag;
+
+            ut_log_warn_("watchdog: '%s' has been running for %ld ms without yielding",
+                stallTag.c_str(), (long) ((now - stallStart) / 1000000));
+
+            if (captureStacks) {
+                logStackOfLoopThread();
+            }
+        }
+
+        lock.lock();
+    }
+}
+
+void startWatchdog(std::chrono::milliseconds threshold, bool captureStacks)
+{
+    ut_assert_(!detail::sIsWatchdogRunning && "watchdog already running");
+    ut_assert_(threshold.count() > 0);
+
+    initLoopCpuClock();
+
+    sCapturesStacks = captureStacks;
+    if (sCapturesStacks) {
+        installStackCapture();
+    }
+
+    const std::string *tag = detail::internTag(currentCoro()->tag());
+    detail::sHeartbeat.beat(tag, currentCoro() == mainCoro());
+    detail::sIsWatchdogRunning = true;
+
+    sIsStopping = false;
+    sThread = std::thread(&watch, threshold, captureStacks);
+
+    ut_log_info_("watchdog: started, threshold %ld ms", (long) threshold.count());
+}
+
+void stopWatchdog()
+{
+    if (!detail::sIsWatchdogRunning) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(sMutex);
+        sIsStopping = true;
+    }
+    sCondStop.notify_one();
+    sThread.join();
+
+    if (sCapturesStacks) {
+        uninstallStackCapture();
+    }
+
+    detail::sIsWatchdogRunning = false;
+
+    ut_log_info_("watchdog: stopped");
+}
+
+StallStats watchdogStats()
+{
+    std::lock_guard<std::mutex> lock(sMutex);
+
+    return sStats;
+}
+
+void resetWatchdogStats()
+{
+    std::lock_guard<std::mutex> lock(sMutex);
+
+    sStats = StallStats();
+}
+
+}
@@ -0,0 +1,55 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace ut {
+
+namespace detail {
+
+    // updated by the loop thread on every coroutine switch while
+    // the watchdog runs, read by the watchdog thread
+    struct Heartbeat
+    {
+        std::atomic<uint64_t> numSwitches;
+        std::atomic<int64_t> switchTime; // steady clock, nanoseconds
+        std::atomic<const std::string *> tag;
+        std::atomic<bool> isMain;
+
+        void beat(const std::string *resumedTag, bool resumedIsMain)
+        {
+            tag.store(resumedTag, std::memory_order_relaxed);
+            isMain.store(resumedIsMain, std::memory_order_relaxed);
+            switchTime.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count(), std::memory_order_relaxed);
+            numSwitches.fetch_add(1, std::memory_order_release);
+        }
+    };
+
+    extern bool sIsWatchdogRunning;
+
+    extern Heartbeat sHeartbeat;
+
+    // returns a stable pointer, tags are never freed
+    const std::string* internTag(const std::string& tag);
+}
+
+}
@@ -0,0 +1,1044 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "ConfigPrivate.h"
+#include "HttpPrivate.h"
+#include <CppAwait/WebSocket.h>
+#include <CppAwait/Condition.h>
+#include <CppAwait/Log.h>
+#include <CppAwait/impl/StringUtil.h>
+#include <deque>
+#include <random>
+#include <cstring>
+#include <cstdint>
+
+namespace ut { namespace asio {
+
+using namespace boost::asio::ip;
+
+static const char WEBSOCKET_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+static const size_t READ_BUFFER_SIZE = 64 * 1024;
+static const size_t MAX_FRAME_HEADER_SIZE = 14;
+static const size_t MAX_CONTROL_PAYLOAD_SIZE = 125;
+
+// limits on frames coalesced into one write
+static const size_t MAX_BATCH_FRAMES = 64;
+static const size_t MAX_BATCH_BYTES = 256 * 1024;
+
+//
+// handshake
+//
+
+static uint32_t rotl(uint32_t x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+// only used for Sec-WebSocket-Accept, saves depending on a crypto library
+static void sha1(const std::string& input, unsigned char outDigest[20])
+{
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+    // pad to 56 mod 64, then append bit length
+    std::string msg = input;
+    uint64_t bitLength = (uint64_t) input.size() * 8;
+
+    msg += (char) 0x80;
+    while (msg.size() % 64 != 56) {
+        msg += (char) 0;
+    }
+    for (int i = 7; i >= 0; i--) {
+        msg += (char) (bitLength >> (i * 8));
+    }
+
+    for (size_t chunk = 0; chunk < msg.size(); chunk += 64) {
+        uint32_t w[80];
+
+        for (int i = 0; i < 16; i++) {
+            const unsigned char *p = (const unsigned char *) &msg[chunk + i * 4];
+            w[i] = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+        }
+        for (int i = 16; i < 80; i++) {
+            w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+
+            uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotl(b, 30);
+            b = a;
+            a = temp;
+        }
+
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    for (int i = 0; i < 20; i++) {
+        outDigest[i] = (unsigned char) (h[i / 4] >> (24 - (i % 4) * 8));
+    }
+}
+
+static std::string base64(const unsigned char *data, size_t size)
+{
+    static const char ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    std::string result;
+    result.reserve((size + 2) / 3 * 4);
+
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t n = (uint32_t) data[i] << 16;
+        if (i + 1 < size) {
+            n |= (uint32_t) data[i + 1] << 8;
+        }
+        if (i + 2 < size) {
+            n |= data[i + 2];
+        }
+
+        result += ALPHABET[(n >> 18) & 0x3F];
+        result += ALPHABET[(n >> 12) & 0x3F];
+        result += (i + 1 < size ? ALPHABET[(n >> 6) & 0x3F] : '=');
+        result += (i + 2 < size ? ALPHABET[n & 0x3F] : '=');
+    }
+
+    return result;
+}
+
+static std::string webSocketAccept(const std::string& key)
+{
+    unsigned char digest[20];
+    sha1(key + WEBSOCKET_GUID, digest);
+
+    return base64(digest, sizeof(digest));
+}
+
+//
+// framing
+//
+
+namespace {
+
+    struct FrameHeader
+    {
+        bool isFinal;
+        int opcode;
+        bool isMasked;
+        unsigned char maskKey[4];
+        uint64_t size;
+    };
+
+    struct OutFrame
+    {
+        WebSocket::Opcode opcode;
+        unsigned char header[MAX_FRAME_HEADER_SIZE];
+        size_t headerSize;
+        std::vector<char> payload;
+
+        OutFrame()
+            : opcode(WebSocket::OPCODE_BINARY)
+            , headerSize(0) { }
+    };
+
+    struct BlockedSend
+    {
+        Completer completer;
+        WebSocket::Opcode opcode;
+        std::vector<char> data;
+    };
+}
+
+// size of frame header, given its second byte
+static size_t frameHeaderSize(unsigned char b1)
+{
+    size_t size = 2;
+
+    if ((b1 & 0x7F) == 126) {
+        size += 2;
+    } else if ((b1 & 0x7F) == 127) {
+        size += 8;
+    }
+    if (b1 & 0x80) {
+        size += 4;
+    }
+
+    return size;
+}
+
+// p must hold frameHeaderSize() bytes
+static void parseFrameHeader(const unsigned char *p, FrameHeader& outHeader)
+{
+    outHeader.isFinal = (p[0] & 0x80) != 0;
+    outHeader.opcode = p[0] & 0x0F;
+    outHeader.isMasked = (p[1] & 0x80) != 0;
+
+    size_t pos = 2;
+    uint64_t size = p[1] & 0x7F;
+
+    if (size == 126) {
+        size = ((uint64_t) p[2] << 8) | p[3];
+        pos += 2;
+    } else if (size == 127) {
+        size = 0;
+        for (int i = 0; i < 8; i++) {
+            size = (size << 8) | p[2 + i];
+        }
+        pos += 8;
+    }
+
+    outHeader.size = size;
+
+    if (outHeader.isMasked) {
+        memcpy(outHeader.maskKey, p + pos, 4);
+    }
+}
+
+static size_t writeFrameHeader(unsigned char *header, WebSocket::Opcode opcode, size_t size, const unsigned char *maskKey)
+{
+    size_t pos = 0;
+    unsigned char maskBit = (maskKey ? 0x80 : 0);
+
+    // messages are always sent in a single frame
+    header[pos++] = (unsigned char) (0x80 | opcode);
+
+    if (size < 126) {
+        header[pos++] = (unsigned char) (maskBit | size);
+    } else if (size <= 0xFFFF) {
+        header[pos++] = maskBit | 126;
+        header[pos++] = (unsigned char) (size >> 8);
+        header[pos++] = (unsigned char) size;
+    } else {
+        header[pos++] = maskBit | 127;
+        for (int i = 7; i >= 0; i--) {
+            header[pos++] = (unsigned char) ((uint64_t) size >> (i * 8));
+        }
+    }
+
+    if (maskKey) {
+        memcpy(header + pos, maskKey, 4);
+        pos += 4;
+    }
+
+    return pos;
+}
+
+// XORs data with the repeating mask key, starting ioKeyOffset bytes into the key.
+// Works a word at a time, which compilers can turn into SIMD loops. src and dst
+// may be the same.
+static void unmask(char *dst, const char *src, size_t size, const unsigned char maskKey[4], size_t& ioKeyOffset)
+{
+    unsigned char key[8];
+    for (size_t i = 0; i < 8; i++) {
+        key[i] = maskKey[(ioKeyOffset + i) & 3];
+    }
+
+    uint64_t wideKey;
+    memcpy(&wideKey, key, 8);
+
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, src + i, 8);
+        word ^= wideKey;
+        memcpy(dst + i, &word, 8);
+    }
+
+    for (; i < size; i++) {
+        dst[i] = (char) (src[i] ^ key[i & 7]);
+    }
+
+    ioKeyOffset = (ioKeyOffset + size) & 3;
+}
+
+//
+// WebSocket
+//
+
+struct WebSocket::Impl
+{
+    enum State
+    {
+        STATE_CONNECTING,
+        STATE_OPEN,
+        STATE_CLOSING,
+        STATE_CLOSED
+    };
+
+    std::shared_ptr<tcp::socket> socket;
+    size_t maxQueuedBytes;
+    size_t maxMessageSize;
+    bool isClient;
+    std::string path;
+    std::mt19937 random;
+
+    State state;
+    bool isCloseReceived;
+    bool isCloseWritten;
+    bool isReadBroken;
+    std::exception_ptr writeError;
+
+    // receive
+    std::shared_ptr<std::vector<char> > readBuffer;
+    size_t readBegin;
+    size_t readEnd;
+    bool isReceiving;
+
+    // send
+    std::deque<OutFrame> controlQueue;
+    std::deque<OutFrame> dataQueue;
+    std::deque<BlockedSend> blockedSends;
+    size_t queuedBytes;
+    bool isWriting;
+    Condition condQueued;
+    Condition condFlushed;
+
+    Stats stats;
+
+    // declared last, writer gets interrupted first
+    Awaitable writer;
+
+    Impl(io_service& io, size_t maxQueuedBytes, size_t maxMessageSize)
+        : socket(std::make_shared<tcp::socket>(io))
+        , maxQueuedBytes(maxQueuedBytes)
+        , maxMessageSize(maxMessageSize)
+        , isClient(false)
+        , random(std::random_device()())
+        , state(STATE_CONNECTING)
+        , isCloseReceived(false)
+        , isCloseWritten(false)
+        , isReadBroken(false)
+        , readBuffer(std::make_shared<std::vector<char> >(READ_BUFFER_SIZE))
+        , readBegin(0)
+        , readEnd(0)
+        , isReceiving(false)
+        , queuedBytes(0)
+        , isWriting(false)
+        , condQueued("websocket-queued")
+        , condFlushed("websocket-flushed") { }
+
+    void closeSocket()
+    {
+        boost::system::error_code ec;
+        socket->close(ec);
+    }
+
+    std::exception_ptr closedError()
+    {
+        if (writeError) {
+            return writeError;
+        }
+
+        return ut::make_exception_ptr(std::runtime_error("WebSocket closed"));
+    }
+
+    // handshake done, bytes read past it are the first frames
+    void open(streambuf& leftover)
+    {
+        if (leftover.size() > readBuffer->size()) {
+            readBuffer->resize(leftover.size());
+        }
+
+        readEnd = buffer_copy(boost::asio::buffer(*readBuffer), leftover.data());
+        readBegin = 0;
+
+        state = STATE_OPEN;
+
+        writer = startAsync("websocket-writer", [this]() {
+            std::exception_ptr eptr;
+
+            try {
+                write();
+            } catch (const ForcedUnwind&) {
+                throw;
+            } catch (...) {
+                // [MSVC] may not yield from catch block, senders get failed after leaving it
+                eptr = std::current_exception();
+            }
+
+            if (is(eptr)) {
+                ut_log_warn_("* WebSocket write failed");
+
+                writeError = eptr;
+                state = STATE_CLOSED;
+                isWriting = false;
+
+                // reader fails as well
+                closeSocket();
+
+                failBlockedSends();
+                condFlushed.notifyAll();
+            }
+        });
+    }
+
+    //
+    // receive
+    //
+
+    // ensures at least n bytes are buffered
+    void fill(size_t n)
+    {
+        std::vector<char>& buf = *readBuffer;
+        size_t numBuffered = readEnd - readBegin;
+
+        if (numBuffered >= n) {
+            return;
+        }
+
+        if (numBuffered == 0) {
+            readBegin = readEnd = 0;
+        } else if (readBegin + n > buf.size()) {
+            memmove(&buf[0], &buf[readBegin], numBuffered);
+            readBegin = 0;
+            readEnd = numBuffered;
+        }
+
+        size_t numRead = 0;
+        Awaitable awt = asyncRead(*socket, boost::asio::buffer(&buf[readEnd], buf.size() - readEnd),
+            readBuffer, transfer_at_least(n - numBuffered), numRead);
+        awt.await();
+
+        readEnd += numRead;
+    }
+
+    void readFrameHeader(FrameHeader& outHeader)
+    {
+        fill(2);
+        size_t headerSize = frameHeaderSize((unsigned char) (*readBuffer)[readBegin + 1]);
+
+        fill(headerSize);
+        parseFrameHeader((const unsigned char *) &(*readBuffer)[readBegin], outHeader);
+        readBegin += headerSize;
+
+        if ((*readBuffer)[readBegin - headerSize] & 0x70) {
+            protocolError("reserved bits set");
+        }
+        if (outHeader.isMasked == isClient) {
+            protocolError(isClient ? "masked frame from server" : "unmasked frame from client");
+        }
+    }
+
+    // copies payload out of read buffer, only awaits if not fully buffered
+    void readPayload(const FrameHeader& header, char *dst)
+    {
+        size_t numLeft = (size_t) header.size;
+        size_t keyOffset = 0;
+
+        while (numLeft > 0) {
+            fill(1);
+
+            size_t size = std::min(readEnd - readBegin, numLeft);
+            const char *src = &(*readBuffer)[readBegin];
+
+            if (header.isMasked) {
+                unmask(dst, src, size, header.maskKey, keyOffset);
+            } else {
+                memcpy(dst, src, size);
+            }
+
+            dst += size;
+            numLeft -= size;
+            readBegin += size;
+        }
+    }
+
+    void protocolError(const char *reason)
+    {
+        if (state == STATE_OPEN) {
+            queueClose(CLOSE_PROTOCOL_ERROR, std::string());
+        }
+
+        throw std::runtime_error(string_printf("WebSocket protocol error: %s", reason));
+    }
+
+    // common case, a whole unfragmented message is buffered
+    bool tryReceiveBuffered(Message& outMessage)
+    {
+        if (state == STATE_CONNECTING || isReceiving || isReadBroken || isCloseReceived) {
+            return false;
+        }
+
+        size_t numBuffered = readEnd - readBegin;
+        const unsigned char *p = (const unsigned char *) &(*readBuffer)[readBegin];
+
+        if (numBuffered < 2 || numBuffered < frameHeaderSize(p[1])) {
+            return false;
+        }
+
+        FrameHeader header;
+        parseFrameHeader(p, header);
+
+        size_t headerSize = frameHeaderSize(p[1]);
+
+        // anything unusual takes the slow path
+        bool isPlain = header.isFinal && (p[0] & 0x70) == 0 && header.isMasked != isClient
+            && (header.opcode == OPCODE_TEXT || header.opcode == OPCODE_BINARY)
+            && header.size <= maxMessageSize && header.size <= numBuffered - headerSize;
+
+        if (!isPlain) {
+            return false;
+        }
+
+        readBegin += headerSize;
+        stats.numFramesIn++;
+
+        outMessage.opcode = (Opcode) header.opcode;
+        outMessage.data.resize((size_t) header.size);
+        if (header.size > 0) {
+            readPayload(header, &outMessage.data[0]);
+        }
+
+        stats.numMessagesIn++;
+        stats.numBytesIn += outMessage.data.size();
+
+        return true;
+    }
+
+    void receive(Message& outMessage)
+    {
+        ut_assert_(!isReceiving && "receive already pending");
+        ut_assert_(state != STATE_CONNECTING && "handshake not done");
+
+        if (isReadBroken || isCloseReceived) {
+            std::rethrow_exception(closedError());
+        }
+
+        isReceiving = true;
+
+        try {
+            doReceive(outMessage);
+        } catch (...) {
+            // stream position is lost
+            isReceiving = false;
+            isReadBroken = true;
+
+            // a queued close frame still gets written, writer closes socket afterwards
+            if (state != STATE_CLOSING || isCloseWritten) {
+                closeSocket();
+            }
+            throw;
+        }
+
+        isReceiving = false;
+    }
+
+    void doReceive(Message& outMessage)
+    {
+        outMessage.data.clear();
+
+        bool isInMessage = false;
+
+        while (true) {
+            FrameHeader header;
+            readFrameHeader(header);
+
+            stats.numFramesIn++;
+
+            if (header.opcode >= OPCODE_CLOSE) {
+                // control frame, may come between fragments
+                if (!header.isFinal || header.size > MAX_CONTROL_PAYLOAD_SIZE) {
+                    protocolError("bad control frame");
+                }
+
+                char payload[MAX_CONTROL_PAYLOAD_SIZE];
+                readPayload(header, payload);
+
+                if (header.opcode == OPCODE_PING) {
+                    stats.numPings++;
+
+                    if (state == STATE_OPEN) {
+                        queueControl(OPCODE_PONG, payload, (size_t) header.size);
+                    }
+                } else if (header.opcode == OPCODE_PONG) {
+                    stats.numPongs++;
+                } else if (header.opcode == OPCODE_CLOSE) {
+                    handleClose(payload, (size_t) header.size);
+
+                    outMessage.opcode = OPCODE_CLOSE;
+                    outMessage.data.assign(payload, payload + header.size);
+                    return;
+                } else {
+                    protocolError("unknown opcode");
+                }
+            } else {
+                if (header.opcode == OPCODE_CONTINUATION) {
+                    if (!isInMessage) {
+                        protocolError("unexpected continuation frame");
+                    }
+                } else if (header.opcode == OPCODE_TEXT || header.opcode == OPCODE_BINARY) {
+                    if (isInMessage) {
+                        protocolError("expected continuation frame");
+                    }
+
+                    outMessage.opcode = (Opcode) header.opcode;
+                    isInMessage = true;
+                } else {
+                    protocolError("unknown opcode");
+                }
+
+                if (header.size > maxMessageSize - outMessage.data.size()) {
+                    if (state == STATE_OPEN) {
+                        queueClose(CLOSE_TOO_BIG, std::string());
+                    }
+                    throw std::runtime_error("WebSocket message too big");
+                }
+
+                // reassemble in place, buffer keeps its capacity across messages
+                size_t offset = outMessage.data.size();
+                outMessage.data.resize(offset + (size_t) header.size);
+
+                if (header.size > 0) {
+                    readPayload(header, &outMessage.data[offset]);
+                }
+
+                if (header.isFinal) {
+                    stats.numMessagesIn++;
+                    stats.numBytesIn += outMessage.data.size();
+                    return;
+                }
+            }
+        }
+    }
+
+    void handleClose(const char *payload, size_t size)
+    {
+        isCloseReceived = true;
+
+        if (state == STATE_OPEN) {
+            // reply with same status code
+            queueCloseFrame(std::vector<char>(payload, payload + std::min(size, (size_t) 2)));
+        } else if (isCloseWritten) {
+            // our close has been answered
+            closeSocket();
+        }
+    }
+
+    //
+    // send
+    //
+
+    void makeFrame(Opcode opcode, std::vector<char>&& payload, OutFrame& outFrame)
+    {
+        unsigned char maskKey[4];
+
+        // client frames must be masked
+        if (isClient) {
+            uint32_t r = (uint32_t) random();
+            memcpy(maskKey, &r, 4);
+
+            size_t keyOffset = 0;
+            if (!payload.empty()) {
+                unmask(&payload[0], &payload[0], payload.size(), maskKey, keyOffset);
+            }
+        }
+
+        outFrame.opcode = opcode;
+        outFrame.headerSize = writeFrameHeader(outFrame.header, opcode, payload.size(), (isClient ? maskKey : nullptr));
+        outFrame.payload = std::move(payload);
+    }
+
+    void queueMessage(Opcode opcode, std::vector<char>&& data)
+    {
+        dataQueue.push_back(OutFrame());
+
+        OutFrame& frame = dataQueue.back();
+        makeFrame(opcode, std::move(data), frame);
+
+        queuedBytes += frame.headerSize + frame.payload.size();
+        stats.maxQueuedBytes = std::max(stats.maxQueuedBytes, queuedBytes);
+
+        condQueued.notifyOne();
+    }
+
+    // control frames skip ahead of queued messages
+    void queueControl(Opcode opcode, const char *payload, size_t size)
+    {
+        controlQueue.push_back(OutFrame());
+        makeFrame(opcode, std::vector<char>(payload, payload + size), controlQueue.back());
+
+        condQueued.notifyOne();
+    }
+
+    // close goes after queued messages, nothing may be sent after it
+    void queueCloseFrame(std::vector<char>&& payload)
+    {
+        ut_assert_(state == STATE_OPEN);
+
+        state = STATE_CLOSING;
+        failBlockedSends();
+
+        queueMessage(OPCODE_CLOSE, std::move(payload));
+    }
+
+    void queueClose(CloseCode code, const std::string& reason)
+    {
+        std::vector<char> payload;
+        payload.push_back((char) (code >> 8));
+        payload.push_back((char) code);
+        payload.insert(payload.end(), reason.begin(), reason.begin() + std::min(reason.size(), MAX_CONTROL_PAYLOAD_SIZE - 2));
+
+        queueCloseFrame(std::move(payload));
+    }
+
+    void pruneBlockedSends()
+    {
+        while (!blockedSends.empty() && blockedSends.front().completer.isExpired()) {
+            blockedSends.pop_front();
+        }
+    }
+
+    // hand freed room to waiting senders, in order
+    void admitBlockedSends()
+    {
+        while (!blockedSends.empty() && queuedBytes < maxQueuedBytes && state == STATE_OPEN) {
+            BlockedSend send = std::move(blockedSends.front());
+            blockedSends.pop_front();
+
+            if (send.completer.isExpired()) {
+                continue; // interrupted, message dropped
+            }
+
+            queueMessage(send.opcode, std::move(send.data));
+
+            { ut::PushMasterCoro _;
+                send.completer();
+            }
+        }
+    }
+
+    void failBlockedSends()
+    {
+        std::deque<BlockedSend> sends;
+        sends.swap(blockedSends);
+
+        std::exception_ptr eptr = closedError();
+
+        { ut::PushMasterCoro _;
+            ut_foreach_(BlockedSend& send, sends) {
+                if (!send.completer.isExpired()) {
+                    send.completer.fail(eptr);
+                }
+            }
+        }
+    }
+
+    bool isFlushed()
+    {
+        pruneBlockedSends();
+
+        return writeError || isCloseWritten
+            || (controlQueue.empty() && dataQueue.empty() && blockedSends.empty() && !isWriting);
+    }
+
+    void write()
+    {
+        // shared with Asio, may outlive an interrupted write
+        auto batch = std::make_shared<std::vector<OutFrame> >();
+        std::vector<boost::asio::const_buffer> buffers;
+
+        while (!isCloseWritten) {
+            if (controlQueue.empty() && dataQueue.empty()) {
+                isWriting = false;
+                condFlushed.notifyAll();
+
+                condQueued.asyncWait().await();
+                continue;
+            }
+
+            isWriting = true;
+
+            batch->clear();
+            buffers.clear();
+
+            while (!controlQueue.empty() && batch->size() < MAX_BATCH_FRAMES) {
+                batch->push_back(std::move(controlQueue.front()));
+                controlQueue.pop_front();
+            }
+
+            size_t numDataBytes = 0;
+
+            while (!dataQueue.empty() && batch->size() < MAX_BATCH_FRAMES && numDataBytes < MAX_BATCH_BYTES) {
+                OutFrame& frame = dataQueue.front();
+                numDataBytes += frame.headerSize + frame.payload.size();
+
+                batch->push_back(std::move(frame));
+                dataQueue.pop_front();
+            }
+
+            bool hasClose = false;
+
+            ut_foreach_(OutFrame& frame, *batch) {
+                buffers.push_back(boost::asio::buffer(frame.header, frame.headerSize));
+
+                if (!frame.payload.empty()) {
+                    buffers.push_back(boost::asio::buffer(frame.payload));
+                }
+
+                hasClose = hasClose || (frame.opcode == OPCODE_CLOSE);
+            }
+
+            Awaitable awt = asyncWrite(*socket, buffers, batch);
+            awt.await();
+
+            stats.numWrites++;
+            queuedBytes -= numDataBytes;
+
+            ut_foreach_(OutFrame& frame, *batch) {
+                if (frame.opcode == OPCODE_TEXT || frame.opcode == OPCODE_BINARY) {
+                    stats.numMessagesOut++;
+                    stats.numBytesOut += frame.payload.size();
+                }
+            }
+
+            if (hasClose) {
+                isCloseWritten = true;
+
+                if (isCloseReceived || isReadBroken) {
+                    closeSocket();
+                }
+            }
+
+            admitBlockedSends();
+        }
+
+        isWriting = false;
+        condFlushed.notifyAll();
+    }
+};
+
+WebSocket::WebSocket(boost::asio::io_service& io, size_t maxQueuedBytes, size_t maxMessageSize)
+    : m(new Impl(io, maxQueuedBytes, maxMessageSize))
+{
+    ut_assert_(maxQueuedBytes > 0);
+}
+
+WebSocket::~WebSocket()
+{
+    m->closeSocket();
+}
+
+std::shared_ptr<tcp::socket> WebSocket::socket()
+{
+    return m->socket;
+}
+
+Awaitable WebSocket::asyncHandshake(const std::string& host, const std::string& path)
+{
+    ut_assert_(m->state == Impl::STATE_CONNECTING);
+
+    Impl *impl = m.get();
+
+    return startAsync("websocket-handshake", [impl, host, path]() {
+        impl->isClient = true;
+        impl->path = path;
+
+        unsigned char nonce[16];
+        for (size_t i = 0; i < sizeof(nonce); i++) {
+            nonce[i] = (unsigned char) impl->random();
+        }
+
+        std::string key = base64(nonce, sizeof(nonce));
+
+        writeHttpRequest(*impl->socket, "GET", host, path, true, string_printf(
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n"
+            "Sec-WebSocket-Key: %s\r\n"
+            "Sec-WebSocket-Version: 13\r\n", key.c_str()));
+
+        auto response = std::make_shared<streambuf>();
+        HttpResponseHeader header = readHttpResponseHeader(*impl->socket, response);
+
+        if (header.statusCode != 101) {
+            throw std::runtime_error(string_printf("bad HTTP status: %d", header.statusCode));
+        }
+        if (!boost::iequals(header.upgrade, "websocket") || header.webSocketAccept != webSocketAccept(key)) {
+            throw std::runtime_error("WebSocket handshake rejected");
+        }
+
+        impl->open(*response);
+    });
+}
+
+Awaitable WebSocket::asyncAccept()
+{
+    ut_assert_(m->state == Impl::STATE_CONNECTING);
+
+    Impl *impl = m.get();
+
+    return startAsync("websocket-accept", [impl]() {
+        auto request = std::make_shared<streambuf>();
+        HttpRequestHeader header = readHttpRequestHeader(*impl->socket, request);
+
+        bool isValid = (header.method == "GET" && boost::iequals(header.upgrade, "websocket")
+            && !header.webSocketKey.empty() && header.webSocketVersion == "13");
+
+        auto reply = std::make_shared<streambuf>();
+        std::ostream replyStream(reply.get());
+
+        if (!isValid) {
+            replyStream << "HTTP/1.1 400 Bad Request\r\n";
+            replyStream << "Sec-WebSocket-Version: 13\r\n";
+            replyStream << "Content-Length: 0\r\n";
+            replyStream << "Connection: close\r\n\r\n";
+
+            Awaitable awt = asyncWrite(*impl->socket, reply);
+            awt.await();
+
+            throw std::runtime_error("invalid WebSocket upgrade request");
+        }
+
+        replyStream << "HTTP/1.1 101 Switching Protocols\r\n";
+        replyStream << "Upgrade: websocket\r\n";
+        replyStream << "Connection: Upgrade\r\n";
+        replyStream << "Sec-WebSocket-Accept: " << webSocketAccept(header.webSocketKey) << "\r\n\r\n";
+
+        Awaitable awt = asyncWrite(*impl->socket, reply);
+        awt.await();
+
+        impl->path = header.path;
+        impl->open(*request);
+    });
+}
+
+const std::string& WebSocket::path() const
+{
+    return m->path;
+}
+
+Awaitable WebSocket::asyncReceive(Message& outMessage)
+{
+    if (m->tryReceiveBuffered(outMessage)) {
+        return Awaitable::makeCompleted();
+    }
+
+    Impl *impl = m.get();
+
+    return startAsync("websocket-receive", [impl, &outMessage]() {
+        impl->receive(outMessage);
+    });
+}
+
+Awaitable WebSocket::asyncSend(Opcode opcode, std::vector<char> data)
+{
+    ut_assert_(opcode == OPCODE_TEXT || opcode == OPCODE_BINARY);
+
+    if (m->state != Impl::STATE_OPEN) {
+        return Awaitable::makeFailed(m->closedError());
+    }
+
+    m->pruneBlockedSends();
+
+    // waiting senders go first, keeps messages in order
+    if (m->blockedSends.empty() && m->queuedBytes < m->maxQueuedBytes) {
+        m->queueMessage(opcode, std::move(data));
+        return Awaitable::makeCompleted();
+    }
+
+    Awaitable awt("websocket-send");
+
+    m->blockedSends.push_back(BlockedSend());
+    BlockedSend& send = m->blockedSends.back();
+    send.completer = awt.takeCompleter();
+    send.opcode = opcode;
+    send.data = std::move(data);
+
+    return std::move(awt);
+}
+
+Awaitable WebSocket::asyncSend(const std::string& text)
+{
+    return asyncSend(OPCODE_TEXT, std::vector<char>(text.begin(), text.end()));
+}
+
+void WebSocket::ping(const std::string& payload)
+{
+    ut_assert_(payload.size() <= MAX_CONTROL_PAYLOAD_SIZE);
+
+    if (m->state == Impl::STATE_OPEN) {
+        m->queueControl(OPCODE_PING, payload.data(), payload.size());
+    }
+}
+
+Awaitable WebSocket::asyncFlush()
+{
+    if (m->isFlushed()) {
+        if (m->writeError) {
+            return Awaitable::makeFailed(m->writeError);
+        }
+        return Awaitable::makeCompleted();
+    }
+
+    Impl *impl = m.get();
+
+    return startAsync("websocket-flush", [impl]() {
+        while (!impl->isFlushed()) {
+            impl->condFlushed.asyncWait().await();
+        }
+
+        if (impl->writeError) {
+            std::rethrow_exception(impl->writeError);
+        }
+    });
+}
+
+Awaitable WebSocket::asyncClose(CloseCode code, const std::string& reason)
+{
+    if (m->state == Impl::STATE_OPEN) {
+        m->queueClose(code, reason);
+    }
+
+    return asyncFlush();
+}
+
+bool WebSocket::isOpen() const
+{
+    return m->state == Impl::STATE_OPEN;
+}
+
+size_t WebSocket::queuedBytes() const
+{
+    return m->queuedBytes;
+}
+
+const WebSocket::Stats& WebSocket::stats() const
+{
+    return m->stats;
+}
+
+} }
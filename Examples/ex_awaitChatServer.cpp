@@ -115,8 +115,9 @@ private:
 class ClientSession : public Guest
 {
 public:
-    ClientSession(ChatRoom& room)
+    ClientSession(ChatRoom& room, ut::SharedStack& sharedStack)
         : mRoom(room)
+        , mSharedStack(sharedStack)
         , mSocket(std::make_shared<tcp::socket>(sIo)) { }
 
     // deleting the session will interrupt the coroutine
@@ -189,6 +190,9 @@ public:
             } while (!quit);
         };
 
+        // Session coroutines spend most time idle, waiting for messages. Running
+        // them on a shared stack keeps memory per client down to the live frames.
+
         // main coroutine handles handshake, reads & writes
         mAwt = ut::startAsync("clientSession-start", [this, writer, reader, recv]() {
             // first message is nickname
@@ -199,8 +203,8 @@ public:
 
             mRoom.join(this);
 
-            ut::Awaitable awtReader = ut::startAsync("clientSession-reader", reader);
-            ut::Awaitable awtWriter = ut::startAsync("clientSession-writer", writer);
+            ut::Awaitable awtReader = ut::startAsync("clientSession-reader", reader, mSharedStack);
+            ut::Awaitable awtWriter = ut::startAsync("clientSession-writer", writer, mSharedStack);
 
             // yield until /leave or Asio exception
             ut::Awaitable *done = ut::awaitAny(awtReader, awtWriter);
@@ -208,11 +212,12 @@ public:
             mRoom.leave(this);
 
             done->await(); // check for exception, won't yield again since already done
-        });
+        }, mSharedStack);
     }
 
 private:
     ChatRoom& mRoom;
+    ut::SharedStack& mSharedStack;
 
     std::shared_ptr<tcp::socket> mSocket;
     ut::Awaitable mAwt;
@@ -235,6 +240,7 @@ static ut::Awaitable asyncChatServer(unsigned short port)
         typedef std::list<std::unique_ptr<ClientSession> > SessionList;
 
         ChatRoom room;
+        ut::SharedStack sessionStack;
         SessionList mSessions;
 
         tcp::endpoint endpoint(tcp::v4(), port);
@@ -256,7 +262,7 @@ static ut::Awaitable asyncChatServer(unsigned short port)
 
             if (!session) {
                 // prepare for new connection
-                session.reset(new ClientSession(room));
+                session.reset(new ClientSession(room, sessionStack));
                 awtAccept = ut::asio::asyncAccept(acceptor, session->socket());
             }
 
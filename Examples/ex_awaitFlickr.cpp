@@ -19,12 +19,11 @@
 #include "ExUtil.h"
 #include <CppAwait/Awaitable.h>
 #include <CppAwait/AsioWrappers.h>
+#include <CppAwait/misc/StreamTokenizer.h>
 #include <fstream>
-#include <sstream>
 #include <algorithm>
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string.hpp>
-#include <boost/property_tree/xml_parser.hpp>
 
 //
 // ABOUT: fetch pictures from Flickr
@@ -62,45 +61,54 @@ struct FlickrPhotos
     std::vector<FlickrPhoto> photos;
 };
 
-static FlickrPhotos parseFlickrResponse(boost::asio::streambuf& response)
+static const std::string& requireAttribute(const ut::XmlTokenizer& xml, const char *name)
 {
-    namespace pt = boost::property_tree;
+    const std::string *value = xml.attribute(name);
 
-    FlickrPhotos result;
+    if (value == nullptr) {
+        throw std::runtime_error(std::string("flickr response lacks attribute ") + name);
+    }
 
-    std::stringstream ss;
-    ss << &response;
-    pt::ptree ptree;
-    pt::read_xml(ss, ptree);
+    return *value;
+}
+
+// parses the response while it downloads, only the current tag is kept in memory
+template <typename Socket>
+static FlickrPhotos readFlickrResponse(Socket& socket, std::shared_ptr<boost::asio::streambuf> response, size_t contentLength)
+{
+    FlickrPhotos result;
+    result.page = result.pages = result.perPage = result.total = 0;
 
-    const pt::ptree& resp = ptree.get_child("rsp");
-    const std::string& stat = resp.get("<xmlattr>.stat", "error");
+    ut::XmlTokenizer xml;
 
-    if (stat != "ok") {
-        printf ("\nbad response:\n%s\n", ss.str().c_str());
-        throw std::runtime_error("flickr response not ok");
-    }
+    do {
+        ut::asio::asyncNextEvent(socket, response, contentLength, xml).await();
 
-    foreach_(const auto& node, resp.get_child("photos")) {
-        const pt::ptree& value = node.second;
+        if (xml.event() != ut::XmlTokenizer::ELEMENT_START) {
+            continue;
+        }
 
-        if (node.first == "<xmlattr>") {
-            result.page = value.get<int>("page");
-            result.pages = value.get<int>("pages");
-            result.perPage = value.get<int>("perpage");
-            result.total = value.get<int>("total");
-        } else {
+        if (xml.name() == "rsp") {
+            if (requireAttribute(xml, "stat") != "ok") {
+                throw std::runtime_error("flickr response not ok");
+            }
+        } else if (xml.name() == "photos") {
+            result.page = boost::lexical_cast<int>(requireAttribute(xml, "page"));
+            result.pages = boost::lexical_cast<int>(requireAttribute(xml, "pages"));
+            result.perPage = boost::lexical_cast<int>(requireAttribute(xml, "perpage"));
+            result.total = boost::lexical_cast<int>(requireAttribute(xml, "total"));
+        } else if (xml.name() == "photo") {
             FlickrPhoto fp;
-            fp.id = value.get<std::string>("<xmlattr>.id");
-            fp.owner = value.get<std::string>("<xmlattr>.owner");
-            fp.secret = value.get<std::string>("<xmlattr>.secret");
-            fp.server = value.get<std::string>("<xmlattr>.server");
-            fp.farm = value.get<std::string>("<xmlattr>.farm");
-            fp.title = value.get<std::string>("<xmlattr>.title");
+            fp.id = requireAttribute(xml, "id");
+            fp.owner = requireAttribute(xml, "owner");
+            fp.secret = requireAttribute(xml, "secret");
+            fp.server = requireAttribute(xml, "server");
+            fp.farm = requireAttribute(xml, "farm");
+            fp.title = requireAttribute(xml, "title");
 
             result.photos.push_back(fp);
         }
-    }
+    } while (xml.event() != ut::XmlTokenizer::END_DOCUMENT);
 
     return result;
 }
@@ -192,11 +200,11 @@ static ut::Awaitable asyncFlickrDownload(const std::vector<std::string>& tags, i
                 auto response = std::make_shared<boost::asio::streambuf>();
                 // read HTTP header
                 size_t contentLength;
-                awt = ut::asio::asyncHttpGet(apiSocket, queryUrl.first, queryUrl.second, true, response, contentLength);
+                awt = ut::asio::asyncHttpGetHeader(apiSocket, queryUrl.first, queryUrl.second, true, response, contentLength);
                 awt.await();
 
-                // parse xml
-                FlickrPhotos resp = parseFlickrResponse(*response);
+                // parse xml as body arrives
+                FlickrPhotos resp = readFlickrResponse(apiSocket, response, contentLength);
 
                 printf ("query result: %ld photos, page %d/%d, %d per page, %d total\n",
                     (long) resp.photos.size(), resp.page, resp.pages, resp.perPage, resp.total);
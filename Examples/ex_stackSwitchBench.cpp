@@ -0,0 +1,117 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "ExUtil.h"
+#include <CppAwait/Coro.h>
+#include <CppAwait/impl/Foreach.h>
+#include <memory>
+#include <vector>
+#include <chrono>
+
+//
+// ABOUT: context switch latency with regular vs huge page stacks
+//
+//        Many coroutines are resumed round-robin. Each one touches a few
+//        stack pages before yielding, so with enough coroutines the switch
+//        cost is dominated by TLB misses. Runs once with regular stacks and
+//        once with stacks carved from huge page regions.
+//
+
+static const size_t NUM_COROS = 10000;
+static const size_t NUM_ROUNDS = 20;
+static const size_t STACK_SIZE = 32 * 1024;
+static const size_t TOUCH_SIZE = 12 * 1024;
+
+// keeps the touched stack from being optimized away
+static volatile char sSink;
+
+static void coTouchAndYield(void *startValue)
+{
+    (void) startValue; // unused
+
+    do {
+        volatile char scratch[TOUCH_SIZE];
+
+        for (size_t i = 0; i < TOUCH_SIZE; i += 4096) {
+            scratch[i] = (char) i;
+        }
+        sSink = scratch[TOUCH_SIZE - 4096];
+
+        ut::yield();
+    } while (true);
+}
+
+static double measureSwitchNanos(const char *label)
+{
+    typedef std::unique_ptr<ut::Coro> CoroPtr;
+
+    std::vector<CoroPtr> coros;
+    coros.reserve(NUM_COROS);
+
+    for (size_t i = 0; i < NUM_COROS; i++) {
+        coros.push_back(CoroPtr(new ut::Coro("stackSwitchBench", &coTouchAndYield, STACK_SIZE)));
+    }
+
+    // warm up, faults in all stack pages
+    ut_foreach_(CoroPtr& coro, coros) {
+        ut::yieldTo(coro.get());
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    for (size_t round = 0; round < NUM_ROUNDS; round++) {
+        ut_foreach_(CoroPtr& coro, coros) {
+            ut::yieldTo(coro.get());
+        }
+    }
+
+    auto elapsed = std::chrono::high_resolution_clock::now() - start;
+
+    ut_foreach_(CoroPtr& coro, coros) {
+        ut::forceUnwind(coro.get());
+    }
+
+    // two switches per resume
+    double nanos = (double) std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()
+        / (2.0 * NUM_ROUNDS * NUM_COROS);
+
+    printf ("%-12s %8.1f ns/switch\n", label, nanos);
+
+    return nanos;
+}
+
+void ex_stackSwitchBench()
+{
+    printf ("%d coroutines, %dKB stacks, %dKB touched per resume\n\n",
+        (int) NUM_COROS, (int) (STACK_SIZE / 1024), (int) (TOUCH_SIZE / 1024));
+
+    ut::Coro::setHugePageStacks(false);
+    ut::Coro::drainStackPool();
+    double regularNanos = measureSwitchNanos("regular");
+
+    ut::Coro::drainStackPool();
+    ut::Coro::setHugePageStacks(true);
+    double hugeNanos = measureSwitchNanos("huge pages");
+
+    ut::Coro::StackPoolStats stats = ut::Coro::stackPoolStats();
+
+    printf ("\n%.1f%% faster, regions: %d (MAP_HUGETLB %d, THP %d), carved stacks: %d\n",
+        100.0 * (regularNanos - hugeNanos) / regularNanos,
+        (int) stats.numRegions, (int) stats.numHugeTlbRegions,
+        (int) stats.numTransparentHugeRegions, (int) stats.numCarvedStacks);
+
+    ut::Coro::setHugePageStacks(false);
+}
@@ -0,0 +1,159 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "ExUtil.h"
+#include <CppAwait/Awaitable.h>
+#include <CppAwait/WebSocket.h>
+#include <chrono>
+
+//
+// ABOUT: WebSocket throughput over loopback
+//
+//        A client streams messages to an echo server and reads the echoes back.
+//        Sending and receiving run in separate coroutines, so the send queue
+//        stays full and back-pressure paces the sender. Reports messages/s and
+//        MB/s for a few message sizes.
+//
+
+using namespace boost::asio::ip;
+using ut::asio::WebSocket;
+
+static ut::Awaitable asyncEchoServer(boost::asio::io_service& io, tcp::acceptor& acceptor)
+{
+    return ut::startAsync("webSocketBench-server", [&io, &acceptor]() {
+        WebSocket ws(io);
+
+        ut::Awaitable awt = ut::asio::asyncAccept(acceptor, ws.socket());
+        awt.await();
+        ws.socket()->set_option(tcp::no_delay(true));
+
+        awt = ws.asyncAccept();
+        awt.await();
+
+        WebSocket::Message msg;
+
+        while (true) {
+            awt = ws.asyncReceive(msg);
+            awt.await();
+
+            if (msg.opcode == WebSocket::OPCODE_CLOSE) {
+                break;
+            }
+
+            awt = ws.asyncSend(msg.opcode, msg.data);
+            awt.await();
+        }
+
+        awt = ws.asyncFlush();
+        awt.await();
+    });
+}
+
+static ut::Awaitable asyncBenchClient(boost::asio::io_service& io, tcp::endpoint endpoint,
+    size_t msgSize, size_t numMsgs, WebSocket::Stats& outStats)
+{
+    return ut::startAsync("webSocketBench-client", [&io, endpoint, msgSize, numMsgs, &outStats]() {
+        WebSocket ws(io);
+
+        ut::Awaitable awt = ut::asio::asyncConnect(*ws.socket(), endpoint);
+        awt.await();
+        ws.socket()->set_option(tcp::no_delay(true));
+
+        awt = ws.asyncHandshake("localhost", "/echo");
+        awt.await();
+
+        ut::Awaitable awtSender = ut::startAsync("webSocketBench-sender", [&ws, msgSize, numMsgs]() {
+            std::vector<char> payload(msgSize, 'x');
+
+            for (size_t i = 0; i < numMsgs; i++) {
+                ut::Awaitable awt = ws.asyncSend(WebSocket::OPCODE_BINARY, payload);
+                awt.await(); // yields while send queue is full
+            }
+        });
+
+        WebSocket::Message msg;
+
+        for (size_t i = 0; i < numMsgs; i++) {
+            awt = ws.asyncReceive(msg);
+            awt.await();
+
+            if (msg.data.size() != msgSize) {
+                throw std::runtime_error("bad echo");
+            }
+        }
+
+        awtSender.await();
+
+        awt = ws.asyncClose();
+        awt.await();
+
+        // wait for server to confirm
+        do {
+            awt = ws.asyncReceive(msg);
+            awt.await();
+        } while (msg.opcode != WebSocket::OPCODE_CLOSE);
+
+        outStats = ws.stats();
+    });
+}
+
+void ex_webSocketBench()
+{
+    struct Run
+    {
+        size_t msgSize;
+        size_t numMsgs;
+    };
+
+    static const Run RUNS[] = {
+        { 64, 200000 },
+        { 1024, 100000 },
+        { 16 * 1024, 20000 },
+        { 256 * 1024, 2000 },
+        { 1024 * 1024, 500 }
+    };
+
+    boost::asio::io_service io;
+
+    tcp::acceptor acceptor(io, tcp::endpoint(address_v4::loopback(), 0));
+
+    printf ("%10s %8s %12s %10s %10s\n", "msg size", "count", "msg/s", "MB/s", "writes");
+
+    ut_foreach_(const Run& run, RUNS) {
+        WebSocket::Stats stats;
+
+        ut::Awaitable awtServer = asyncEchoServer(io, acceptor);
+        ut::Awaitable awtClient = asyncBenchClient(io, acceptor.local_endpoint(), run.msgSize, run.numMsgs, stats);
+
+        auto start = std::chrono::steady_clock::now();
+
+        io.reset();
+        io.run();
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (!awtClient.didComplete() || !awtServer.didComplete()) {
+            printf ("%10ld  failed\n", (long) run.msgSize);
+            continue;
+        }
+
+        // both directions
+        double numBytes = 2.0 * run.msgSize * run.numMsgs;
+
+        printf ("%10ld %8ld %12.0f %10.1f %10ld\n", (long) run.msgSize, (long) run.numMsgs,
+            run.numMsgs / seconds, numBytes / seconds / (1024 * 1024), (long) stats.numWrites);
+    }
+}
@@ -31,6 +31,8 @@ void ex_awaitChatServer();
 void ex_awaitChatClient();
 void ex_stockServer();
 void ex_stockClient();
+void ex_webSocketBench();
+void ex_stackSwitchBench();
 
 
 struct Example
@@ -54,6 +56,8 @@ static const Example EXAMPLES[] =
     { &ex_awaitChatClient, "await - chat client" },
     { &ex_stockServer, "stock price server" },
     { &ex_stockClient, "stock price client" },
+    { &ex_webSocketBench, "WebSocket loopback throughput" },
+    { &ex_stackSwitchBench, "context switch latency - regular vs huge page stacks" },
 };
 
 int main(int argc, char** argv)
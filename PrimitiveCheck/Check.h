@@ -0,0 +1,31 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#pragma once
+
+//
+// Helpers shared by primitive checks
+//
+
+/** Records a failed expectation, the check goes on */
+#define expect_(_condition) \
+    ((_condition) ? (void) 0 : checkFailed(#_condition, __FILE__, __LINE__))
+
+void checkFailed(const char *expression, const char *file, int line);
+
+/** Runs actions queued with ut::schedule() until there are none left */
+void runScheduled();
@@ -0,0 +1,210 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include "Check.h"
+#include <CppAwait/Actor.h>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <deque>
+#include <vector>
+
+// messages are handled in send order, in batches of at most maxBatch
+static void checkOrdering()
+{
+    std::vector<int> received;
+
+    ut::Actor<int> actor("actor", [&](int& msg) {
+        received.push_back(msg);
+    }, 4, 2);
+
+    for (int i = 1; i <= 3; i++) {
+        expect_(actor.trySend(i));
+    }
+    expect_(received.empty());
+
+    runScheduled();
+
+    expect_(received.size() == 3 && received[0] == 1 && received[1] == 2 && received[2] == 3);
+    expect_(actor.stats().numBatches == 2 && actor.stats().numProcessed == 3);
+}
+
+// blocked senders get room in FIFO order, trySend() doesn't barge ahead of them
+static void checkBlockedSenders()
+{
+    std::vector<int> received;
+
+    ut::Actor<int> actor("actor", [&](int& msg) {
+        received.push_back(msg);
+    }, 1);
+
+    expect_(actor.trySend(1));
+
+    ut::Awaitable awtSender2 = ut::startAsync("sender2", [&]() {
+        actor.asyncSend(2).await();
+    });
+    ut::Awaitable awtSender3 = ut::startAsync("sender3", [&]() {
+        actor.asyncSend(3).await();
+    });
+
+    expect_(!actor.trySend(4));
+
+    runScheduled();
+
+    expect_(awtSender2.didComplete() && awtSender3.didComplete());
+    expect_(received.size() == 3 && received[0] == 1 && received[1] == 2 && received[2] == 3);
+}
+
+// interrupted sender gives up its place, its message is dropped
+static void checkInterruptedSender()
+{
+    std::vector<int> received;
+
+    ut::Actor<int> actor("actor", [&](int& msg) {
+        received.push_back(msg);
+    }, 1);
+
+    expect_(actor.trySend(1));
+
+    ut::Awaitable awtSender = ut::startAsync("sender", [&]() {
+        actor.asyncSend(2).await();
+    });
+
+    awtSender = ut::Awaitable();
+    runScheduled();
+
+    expect_(actor.trySend(3));
+    runScheduled();
+
+    expect_(received.size() == 2 && received[0] == 1 && received[1] == 3);
+}
+
+// actor destroyed while a sender is blocked and a wake is pending
+static void checkDestroyedWhileWaiting()
+{
+    int numReceived = 0;
+
+    std::unique_ptr<ut::Actor<int> > actor(new ut::Actor<int>("actor", [&](int& msg) {
+        numReceived++;
+    }, 1));
+
+    expect_(actor->trySend(1));
+
+    ut::Awaitable awtSender = ut::startAsync("sender", [&]() {
+        actor->asyncSend(2).await();
+    });
+
+    actor.reset();
+    runScheduled();
+
+    expect_(numReceived == 0 && !awtSender.isDone());
+
+    // send handler runs after actor is gone
+    awtSender = ut::Awaitable();
+}
+
+// messages from several threads arrive in per-thread order through the inbox
+static void checkRemoteSend()
+{
+    static const int NUM_THREADS = 4;
+    static const int NUM_MESSAGES = 1000;
+
+    std::mutex postMutex;
+    std::deque<ut::Action> posted;
+
+    std::vector<int> lastSeen(NUM_THREADS, -1);
+    int numReceived = 0;
+    bool isOrdered = true;
+
+    ut::Actor<int> actor("actor", [&](int& msg) {
+        int thread = msg / NUM_MESSAGES;
+        int seq = msg % NUM_MESSAGES;
+
+        isOrdered = isOrdered && (seq == lastSeen[thread] + 1);
+        lastSeen[thread] = seq;
+        numReceived++;
+    });
+
+    actor.enableRemoteSend(16, [&](ut::Action action) {
+        std::lock_guard<std::mutex> _(postMutex);
+        posted.push_back(std::move(action));
+    });
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < NUM_THREADS; i++) {
+        threads.push_back(std::thread([&actor, i]() {
+            for (int seq = 0; seq < NUM_MESSAGES; seq++) {
+                int msg = i * NUM_MESSAGES + seq;
+
+                while (!actor.trySendFromThread(msg)) {
+                    std::this_thread::yield();
+                }
+            }
+        }));
+    }
+
+    while (numReceived < NUM_THREADS * NUM_MESSAGES) {
+        std::deque<ut::Action> actions;
+
+        {
+            std::lock_guard<std::mutex> _(postMutex);
+            actions.swap(posted);
+        }
+
+        for (size_t i = 0; i < actions.size(); i++) {
+            actions[i]();
+        }
+
+        runScheduled();
+    }
+
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    expect_(isOrdered);
+    expect_(actor.stats().numRemote == (size_t) (NUM_THREADS * NUM_MESSAGES));
+}
+
+// full queue rejects values, values come out in push order
+static void checkMpscQueue()
+{
+    ut::BoundedMpscQueue<int> queue(4);
+
+    for (int i = 0; i < 4; i++) {
+        expect_(queue.tryPush(i));
+    }
+
+    int value = 4;
+    expect_(!queue.tryPush(value) && value == 4);
+
+    for (int i = 0; i < 4; i++) {
+        expect_(queue.tryPop(value) && value == i);
+    }
+
+    expect_(queue.isEmpty() && !queue.tryPop(value));
+}
+
+void chk_actor()
+{
+    checkOrdering();
+    checkBlockedSenders();
+    checkInterruptedSender();
+    checkDestroyedWhileWaiting();
+    checkRemoteSend();
+    checkMpscQueue();
+}
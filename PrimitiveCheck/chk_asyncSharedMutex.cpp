@@ -0,0 +1,121 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include "Check.h"
+#include <CppAwait/AsyncSharedMutex.h>
+#include <CppAwait/Condition.h>
+#include <algorithm>
+#include <string>
+
+// readers share the lock, a waiting writer holds back new readers, which are then admitted as one batch
+static void checkWriterPreference()
+{
+    ut::AsyncSharedMutex mutex("mutex");
+    ut::Condition condGate("gate");
+    std::string log;
+    size_t numReadersInBatch = 0;
+
+    auto read = [&](const char *name) {
+        ut::AsyncSharedMutex::SharedGuard _(mutex);
+        log += name;
+        numReadersInBatch = std::max(numReadersInBatch, mutex.numReaders());
+        condGate.asyncWait().await();
+    };
+
+    ut::Awaitable awtR1 = ut::startAsync("r1", [&]() { read("r1 "); });
+    ut::Awaitable awtR2 = ut::startAsync("r2", [&]() { read("r2 "); });
+
+    ut::Awaitable awtWriter = ut::startAsync("writer", [&]() {
+        ut::AsyncSharedMutex::Guard _(mutex);
+        log += "w ";
+        condGate.asyncWait().await();
+    });
+
+    expect_(mutex.numReaders() == 2 && mutex.numWaitingWriters() == 1);
+
+    ut::Awaitable awtR3 = ut::startAsync("r3", [&]() { read("r3 "); });
+    ut::Awaitable awtR4 = ut::startAsync("r4", [&]() { read("r4 "); });
+
+    expect_(mutex.numReaders() == 2 && mutex.numWaitingReaders() == 2);
+
+    // readers leave, writer gets the lock
+    condGate.notifyAll();
+    expect_(mutex.isLocked() && mutex.numReaders() == 0);
+
+    // writer leaves, queued readers get in together
+    numReadersInBatch = 0;
+    condGate.notifyAll();
+    expect_(!mutex.isLocked() && mutex.numReaders() == 2 && numReadersInBatch == 2);
+
+    condGate.notifyAll();
+    expect_(log == "r1 r2 w r3 r4 ");
+    expect_(mutex.numReaders() == 0 && !mutex.isLocked());
+}
+
+// interrupted writer doesn't hold readers back, interrupted reader doesn't keep the lock
+static void checkInterrupted()
+{
+    ut::AsyncSharedMutex mutex("mutex");
+    ut::Condition condGate("gate");
+    bool isReaderIn = false;
+
+    ut::Awaitable awtHolder = ut::startAsync("holder", [&]() {
+        ut::AsyncSharedMutex::SharedGuard _(mutex);
+        condGate.asyncWait().await();
+    });
+
+    ut::Awaitable awtWriter = ut::startAsync("writer", [&]() {
+        ut::AsyncSharedMutex::Guard _(mutex);
+    });
+
+    ut::Awaitable awtReader = ut::startAsync("reader", [&]() {
+        ut::AsyncSharedMutex::SharedGuard _(mutex);
+        isReaderIn = true;
+    });
+
+    expect_(!isReaderIn && mutex.numWaitingReaders() == 1);
+
+    awtWriter = ut::Awaitable();
+    expect_(mutex.tryLockShared());
+    mutex.unlockShared();
+
+    // holder leaves, queued reader is admitted although the writer is gone
+    condGate.notifyAll();
+    expect_(awtHolder.didComplete());
+    expect_(isReaderIn && awtReader.didComplete());
+
+    ut::Awaitable awtLate = ut::startAsync("late", [&]() {
+        ut::AsyncSharedMutex::SharedGuard _(mutex);
+    });
+    expect_(awtLate.didComplete());
+
+    // lock held by an interrupted coroutine is released while it unwinds
+    ut::Awaitable awtInterrupted = ut::startAsync("interrupted", [&]() {
+        ut::AsyncSharedMutex::Guard _(mutex);
+        condGate.asyncWait().await();
+    });
+    expect_(mutex.isLocked());
+
+    awtInterrupted = ut::Awaitable();
+    expect_(!mutex.isLocked() && mutex.numReaders() == 0);
+}
+
+void chk_asyncSharedMutex()
+{
+    checkWriterPreference();
+    checkInterrupted();
+}
@@ -0,0 +1,132 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include "Check.h"
+#include <CppAwait/BroadcastRing.h>
+#include <memory>
+#include <vector>
+
+// each consumer reads the whole burst in publish order
+static void checkOrdering()
+{
+    ut::BroadcastRing<int> ring(8, "ring");
+    std::vector<int> received[2];
+
+    ut::Awaitable awtConsumers[2];
+    for (int i = 0; i < 2; i++) {
+        std::vector<int> *out = &received[i];
+
+        awtConsumers[i] = ut::startAsync("consumer", [&ring, out]() {
+            ut::BroadcastRing<int>::Cursor cursor(ring);
+
+            while (out->size() < 3) {
+                cursor.asyncWait().await();
+                while (const int *value = cursor.tryRead()) {
+                    out->push_back(*value);
+                }
+            }
+        });
+    }
+
+    ring.publish(1);
+    ring.publish(2);
+    ring.publish(3);
+
+    // publish alone doesn't wake
+    expect_(received[0].empty() && received[1].empty());
+
+    ring.flush();
+
+    for (int i = 0; i < 2; i++) {
+        expect_(awtConsumers[i].didComplete());
+        expect_(received[i].size() == 3 && received[i][0] == 1 && received[i][1] == 2 && received[i][2] == 3);
+    }
+}
+
+// lapped cursor skips to oldest message and counts the loss
+static void checkOverrun()
+{
+    ut::BroadcastRing<int> ring(4, "ring");
+    ut::BroadcastRing<int>::Cursor cursor(ring);
+
+    for (int i = 0; i < 10; i++) {
+        ring.publish(i);
+    }
+
+    const int *value = cursor.tryRead();
+    expect_(value != nullptr && *value == 6);
+    expect_(cursor.numLost() == 6);
+
+    int numRead = 1;
+    while (cursor.tryRead()) {
+        numRead++;
+    }
+    expect_(numRead == 4);
+    expect_(!cursor.hasNext());
+}
+
+// interrupted consumer is skipped by flush
+static void checkInterrupted()
+{
+    ut::BroadcastRing<int> ring(4, "ring");
+    int numWoken = 0;
+
+    auto consume = [&]() {
+        ut::BroadcastRing<int>::Cursor cursor(ring);
+        cursor.asyncWait().await();
+        numWoken++;
+    };
+
+    ut::Awaitable awtInterrupted = ut::startAsync("interrupted", consume);
+    ut::Awaitable awtConsumer = ut::startAsync("consumer", consume);
+
+    awtInterrupted = ut::Awaitable();
+
+    ring.publish(1);
+    ring.flush();
+
+    expect_(numWoken == 1);
+    expect_(awtConsumer.didComplete());
+}
+
+// ring destroyed while a consumer waits, consumer is never woken
+static void checkDestroyedWhileWaiting()
+{
+    std::unique_ptr<ut::BroadcastRing<int> > ring(new ut::BroadcastRing<int>(4, "ring"));
+    bool isWoken = false;
+
+    ut::Awaitable awtConsumer = ut::startAsync("consumer", [&]() {
+        ut::BroadcastRing<int>::Cursor cursor(*ring);
+        cursor.asyncWait().await();
+        isWoken = true;
+    });
+
+    ring.reset();
+
+    expect_(!isWoken && !awtConsumer.isDone());
+
+    awtConsumer = ut::Awaitable();
+    expect_(!isWoken);
+}
+
+void chk_broadcastRing()
+{
+    checkOrdering();
+    checkOverrun();
+    checkInterrupted();
+    checkDestroyedWhileWaiting();
+}
@@ -0,0 +1,115 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include "Check.h"
+#include <CppAwait/Pipeline.h>
+#include <CppAwait/Condition.h>
+#include <boost/lexical_cast.hpp>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// items pass through both stages in order, a full queue downstream stalls the stage above
+static void checkOrderingAndBackPressure()
+{
+    ut::Condition condGate("gate");
+    std::vector<std::string> received;
+
+    ut::PipelineStage<std::string> print("print", [&](std::string& line) {
+        condGate.asyncWait().await();
+        received.push_back(line);
+    }, 1, 1);
+
+    ut::PipelineStage<int, std::string> format("format", [](int& value) {
+        return boost::lexical_cast<std::string>(value);
+    }, 1, 1);
+
+    format.connectTo(print);
+
+    // print handles 1, holds 2 in queue, format waits to hand over 3
+    for (int i = 1; i <= 3; i++) {
+        format.asyncPush(i);
+    }
+
+    expect_(print.queueDepth() == 1);
+    expect_(!format.isDrained() && !print.isDrained());
+
+    for (int i = 0; i < 3; i++) {
+        condGate.notifyAll();
+    }
+
+    expect_(received.size() == 3 && received[0] == "1" && received[1] == "2" && received[2] == "3");
+    expect_(format.isDrained() && print.isDrained());
+}
+
+// stage drains after a failed item, drain waiter is woken
+static void checkDrainedAfterFailure()
+{
+    ut::Condition condGate("gate");
+
+    ut::PipelineStage<int> stage("stage", [&](int& item) {
+        condGate.asyncWait().await();
+
+        if (item < 0) {
+            throw std::runtime_error("bad item");
+        }
+    }, 1, 1);
+
+    stage.asyncPush(-1);
+
+    ut::Awaitable awtDrained = ut::startAsync("drained", [&]() {
+        stage.asyncDrained().await();
+    });
+
+    expect_(!awtDrained.isDone());
+
+    condGate.notifyAll();
+
+    expect_(awtDrained.didComplete());
+    expect_(stage.stats().numProcessed == 1 && stage.stats().numFailed == 1);
+}
+
+// destroying a stage interrupts its busy worker, drain waiters are never woken
+static void checkDestroyedWhileWaiting()
+{
+    ut::Condition condGate("gate");
+    bool isHandled = false;
+
+    std::unique_ptr<ut::PipelineStage<int> > stage(new ut::PipelineStage<int>("stage", [&](int& item) {
+        condGate.asyncWait().await();
+        isHandled = true;
+    }, 1, 1));
+
+    stage->asyncPush(1);
+
+    ut::Awaitable awtDrained = ut::startAsync("drained", [&]() {
+        stage->asyncDrained().await();
+    });
+
+    stage.reset();
+    condGate.notifyAll();
+
+    expect_(!isHandled && !awtDrained.isDone());
+}
+
+void chk_pipeline()
+{
+    checkOrderingAndBackPressure();
+    checkDrainedAfterFailure();
+    checkDestroyedWhileWaiting();
+}
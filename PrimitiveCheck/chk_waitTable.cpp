@@ -0,0 +1,143 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include "Check.h"
+#include <CppAwait/WaitTable.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+// waiters of a key are woken in FIFO order, other keys are left alone
+static void checkOrdering()
+{
+    ut::WaitTable<int> table(4, "table");
+    std::string woken;
+
+    ut::Awaitable awtA = ut::startAsync("a", [&]() {
+        table.wait(1);
+        woken += "a";
+    });
+    ut::Awaitable awtB = ut::startAsync("b", [&]() {
+        table.asyncWait(1).await();
+        woken += "b";
+    });
+    ut::Awaitable awtC = ut::startAsync("c", [&]() {
+        table.wait(2);
+        woken += "c";
+    });
+
+    expect_(table.numWaiters() == 3 && table.numWaiters(1) == 2);
+
+    expect_(table.notifyAll(1) == 2);
+    expect_(woken == "ab");
+
+    expect_(table.notifyOne(2));
+    expect_(woken == "abc");
+    expect_(table.numWaiters() == 0);
+}
+
+// woken coroutine may wait again right away without being woken twice
+static void checkWaitAgain()
+{
+    ut::WaitTable<int> table(4, "table");
+    int numWoken = 0;
+
+    ut::Awaitable awtWaiter = ut::startAsync("waiter", [&]() {
+        while (true) {
+            table.wait(1);
+            numWoken++;
+        }
+    });
+
+    expect_(table.notifyAll(1) == 1);
+    expect_(numWoken == 1 && table.numWaiters(1) == 1);
+}
+
+// interrupted waiters are unlinked, or skipped once their awaitable is gone
+static void checkInterrupted()
+{
+    ut::WaitTable<int> table(4, "table");
+    int numWoken = 0;
+
+    ut::Awaitable awtSync = ut::startAsync("sync", [&]() {
+        table.wait(1);
+        numWoken++;
+    });
+    ut::Awaitable awtAsync = ut::startAsync("async", [&]() {
+        table.asyncWait(1).await();
+        numWoken++;
+    });
+
+    awtSync = ut::Awaitable();
+    expect_(table.numWaiters() == 1);
+
+    awtAsync = ut::Awaitable();
+    expect_(table.numWaiters(1) == 0);
+
+    expect_(table.notifyAll(1) == 0);
+    expect_(numWoken == 0 && table.numWaiters() == 0);
+}
+
+// buckets grow with the number of waiters, keys stay apart
+static void checkGrow()
+{
+    static const int NUM_KEYS = 100;
+
+    ut::WaitTable<int> table(4, "table");
+    std::vector<int> woken;
+    std::vector<ut::Awaitable> waiters;
+
+    for (int i = 0; i < NUM_KEYS; i++) {
+        waiters.push_back(ut::startAsync("waiter", [&table, &woken, i]() {
+            table.wait(i);
+            woken.push_back(i);
+        }));
+    }
+
+    expect_(table.numWaiters() == (size_t) NUM_KEYS);
+
+    for (int i = NUM_KEYS - 1; i >= 0; i--) {
+        table.notifyOne(i);
+    }
+
+    expect_(woken.size() == (size_t) NUM_KEYS && woken.front() == NUM_KEYS - 1 && woken.back() == 0);
+}
+
+// table destroyed while an async waiter is pending, waiter is never woken
+static void checkDestroyedWhileWaiting()
+{
+    std::unique_ptr<ut::WaitTable<int> > table(new ut::WaitTable<int>(4, "table"));
+    bool isWoken = false;
+
+    ut::Awaitable awtWaiter = ut::startAsync("waiter", [&]() {
+        table->asyncWait(1).await();
+        isWoken = true;
+    });
+
+    table.reset();
+
+    expect_(!isWoken && !awtWaiter.isDone());
+}
+
+void chk_waitTable()
+{
+    checkOrdering();
+    checkWaitAgain();
+    checkInterrupted();
+    checkGrow();
+    checkDestroyedWhileWaiting();
+}
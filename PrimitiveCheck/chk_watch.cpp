@@ -0,0 +1,124 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include "Check.h"
+#include <CppAwait/Watch.h>
+#include <memory>
+
+// any number of updates before the notification wake a watcher once
+static void checkCoalesced()
+{
+    ut::Watch<int> watch(0, "watch");
+    int numWoken = 0;
+    int lastValue = -1;
+
+    ut::Awaitable awtWatcher = ut::startAsync("watcher", [&]() {
+        ut::Watch<int>::Version seen = watch.version();
+
+        while (true) {
+            watch.asyncChanged(seen).await();
+            seen = watch.version();
+            lastValue = watch.get();
+            numWoken++;
+        }
+    });
+
+    watch.set(1);
+    watch.set(2);
+    watch.set(3);
+    expect_(numWoken == 0);
+
+    runScheduled();
+    expect_(numWoken == 1 && lastValue == 3);
+
+    runScheduled();
+    expect_(numWoken == 1);
+}
+
+// watcher that has seen the latest version isn't woken by the pending notification
+static void checkWaitAfterSet()
+{
+    ut::Watch<int> watch(0, "watch");
+    ut::Watch<int>::Version seen = 0;
+    int numWoken = 0;
+
+    watch.set(1);
+
+    ut::Awaitable awtWatcher = ut::startAsync("watcher", [&]() {
+        while (true) {
+            seen = watch.version();
+            watch.asyncChanged(seen).await();
+            numWoken++;
+        }
+    });
+
+    expect_(seen == 1);
+
+    runScheduled();
+    expect_(numWoken == 0);
+
+    watch.set(2);
+    runScheduled();
+    expect_(numWoken == 1 && seen == 2);
+}
+
+// interrupted watcher is dropped, others still get woken
+static void checkInterrupted()
+{
+    ut::Watch<int> watch(0, "watch");
+    int numWoken = 0;
+
+    auto waitOnce = [&]() {
+        watch.asyncChanged(watch.version()).await();
+        numWoken++;
+    };
+
+    ut::Awaitable awtInterrupted = ut::startAsync("interrupted", waitOnce);
+    ut::Awaitable awtWatcher = ut::startAsync("watcher", waitOnce);
+
+    watch.set(1);
+    awtInterrupted = ut::Awaitable();
+
+    runScheduled();
+    expect_(numWoken == 1 && awtWatcher.didComplete());
+}
+
+// watch destroyed with a notification pending, watcher is never woken
+static void checkDestroyedWhileWaiting()
+{
+    std::unique_ptr<ut::Watch<int> > watch(new ut::Watch<int>(0, "watch"));
+    bool isWoken = false;
+
+    ut::Awaitable awtWatcher = ut::startAsync("watcher", [&]() {
+        watch->asyncChanged(0).await();
+        isWoken = true;
+    });
+
+    watch->set(1);
+    watch.reset();
+
+    runScheduled();
+    expect_(!isWoken && !awtWatcher.isDone());
+}
+
+void chk_watch()
+{
+    checkCoalesced();
+    checkWaitAfterSet();
+    checkInterrupted();
+    checkDestroyedWhileWaiting();
+}
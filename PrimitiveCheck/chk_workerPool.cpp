@@ -0,0 +1,114 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include "Check.h"
+#include <CppAwait/WorkerPool.h>
+#include <CppAwait/Condition.h>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+// counts handlers unwound by interruption
+struct UnwindCounter
+{
+    int& numUnwound;
+
+    UnwindCounter(int& numUnwound)
+        : numUnwound(numUnwound) { }
+
+    ~UnwindCounter()
+    {
+        if (std::uncaught_exception()) {
+            numUnwound++;
+        }
+    }
+};
+
+// spawns workers for backlog up to max, retires them down to min, handles items in FIFO order
+static void checkScaling()
+{
+    ut::Condition condGate("gate");
+    std::vector<int> started;
+
+    ut::WorkerPool<int> pool("pool", [&](int& item) {
+        started.push_back(item);
+        condGate.asyncWait().await();
+    }, 1, 2);
+
+    expect_(pool.numWorkers() == 1 && pool.numIdleWorkers() == 1);
+
+    for (int i = 0; i < 3; i++) {
+        pool.asyncPush(i);
+    }
+
+    expect_(pool.numWorkers() == 2 && pool.queueDepth() == 1);
+    expect_(started.size() == 2);
+
+    condGate.notifyAll();
+    expect_(started.size() == 3 && started[2] == 2);
+
+    condGate.notifyAll();
+    expect_(pool.stats().numProcessed == 3);
+    expect_(pool.numWorkers() == 1 && pool.stats().numRetired == 1);
+}
+
+// failed items are counted, workers carry on
+static void checkFailures()
+{
+    int numHandled = 0;
+
+    ut::WorkerPool<int> pool("pool", [&](int& item) {
+        if (item < 0) {
+            throw std::runtime_error("bad item");
+        }
+        numHandled++;
+    }, 1, 1);
+
+    pool.asyncPush(-1);
+    pool.asyncPush(1);
+
+    expect_(numHandled == 1);
+    expect_(pool.stats().numProcessed == 2 && pool.stats().numFailed == 1);
+}
+
+// destroying the pool interrupts busy and idle workers
+static void checkDestroyedWhileWaiting()
+{
+    ut::Condition condGate("gate");
+    int numUnwound = 0;
+
+    std::unique_ptr<ut::WorkerPool<int> > pool(new ut::WorkerPool<int>("pool", [&](int& item) {
+        UnwindCounter _(numUnwound);
+        condGate.asyncWait().await();
+    }, 2, 2));
+
+    pool->asyncPush(1);
+    pool.reset();
+
+    expect_(numUnwound == 1);
+
+    condGate.notifyAll();
+    expect_(numUnwound == 1);
+}
+
+void chk_workerPool()
+{
+    checkScaling();
+    checkFailures();
+    checkDestroyedWhileWaiting();
+}
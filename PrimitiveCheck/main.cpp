@@ -0,0 +1,104 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include "Check.h"
+#include <CppAwait/misc/Scheduler.h>
+#include <deque>
+#include <cstdio>
+
+//
+// Drives coroutine primitives through ordering, interruption and destruction
+// while waiting. Each check runs from the main stack, waking its coroutines by
+// hand and through a queue based scheduler. A failed expectation is reported
+// and the exit code is non-zero.
+//
+
+void chk_broadcastRing();
+void chk_watch();
+void chk_workerPool();
+void chk_pipeline();
+void chk_waitTable();
+void chk_asyncSharedMutex();
+void chk_actor();
+
+
+struct Check
+{
+    void (*function)();
+    const char *name;
+};
+
+static const Check CHECKS[] =
+{
+    { &chk_broadcastRing, "BroadcastRing" },
+    { &chk_watch, "Watch" },
+    { &chk_workerPool, "WorkerPool" },
+    { &chk_pipeline, "PipelineStage" },
+    { &chk_waitTable, "WaitTable" },
+    { &chk_asyncSharedMutex, "AsyncSharedMutex" },
+    { &chk_actor, "Actor" },
+};
+
+static int sNumFailures = 0;
+
+void checkFailed(const char *expression, const char *file, int line)
+{
+    sNumFailures++;
+
+    printf ("  FAILED: %s (%s:%d)\n", expression, file, line);
+}
+
+static std::deque<ut::Action> sScheduled;
+
+static void scheduleAction(ut::Action action)
+{
+    sScheduled.push_back(std::move(action));
+}
+
+void runScheduled()
+{
+    while (!sScheduled.empty()) {
+        ut::Action action = std::move(sScheduled.front());
+        sScheduled.pop_front();
+
+        action();
+    }
+}
+
+int main()
+{
+    ut::initScheduler(&scheduleAction);
+
+    const int numChecks = sizeof(CHECKS) / sizeof(Check);
+
+    for (int i = 0; i < numChecks; i++) {
+        int numFailuresBefore = sNumFailures;
+
+        CHECKS[i].function();
+        runScheduled();
+
+        printf ("%-24s %s\n", CHECKS[i].name, (sNumFailures == numFailuresBefore ? "ok" : "FAILED"));
+    }
+
+    if (sNumFailures == 0) {
+        printf ("\nall checks passed\n");
+        return 0;
+    } else {
+        printf ("\n%d failed expectations\n", sNumFailures);
+        return 1;
+    }
+}
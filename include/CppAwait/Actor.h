@@ -0,0 +1,520 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * @file  Actor.h
+ *
+ * Declares the Actor class.
+ *
+ */
+
+#pragma once
+
+#include "Config.h"
+#include "Awaitable.h"
+#include "Condition.h"
+#include "Log.h"
+#include "impl/Assert.h"
+#include "misc/BoundedMpscQueue.h"
+#include "misc/Scheduler.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <functional>
+
+namespace ut {
+
+/**
+ * Reply handle for request/reply messages
+ *
+ * The requester creates an awaitable and sends the handle along with its
+ * message. The actor answers by calling the handle, which stores the value
+ * and completes the awaitable:
+ *
+ *     // requester coroutine
+ *     int balance;
+ *     Awaitable awtReply("get-balance");
+ *     account.asyncSend(GetBalance(ReplyTo<int>(awtReply, balance))).await();
+ *     awtReply.await();
+ *
+ *     // account handler
+ *     request.reply(mBalance);
+ *
+ * Replying after the requester has given up is harmless. Must be called from
+ * the loop thread.
+ */
+template <typename T>
+class ReplyTo
+{
+public:
+    /** Construct a dummy handle */
+    ReplyTo()
+        : mOutValue(nullptr) { }
+
+    /**
+     * Construct a handle for an awaitable
+     * @param awt       awaitable to complete, its completer is taken
+     * @param outValue  receives the reply, must be valid until awt is done
+     */
+    ReplyTo(Awaitable& awt, T& outValue)
+        : mCompleter(awt.takeCompleter())
+        , mOutValue(&outValue) { }
+
+    /** True if requester no longer waits for the reply */
+    bool isExpired() const
+    {
+        return mCompleter.isExpired();
+    }
+
+    /** Store reply and complete awaitable */
+    void operator()(T value) const
+    {
+        if (mCompleter.isExpired()) {
+            return;
+        }
+
+        mCompleter.restoreStack();
+        *mOutValue = std::move(value);
+
+        { ut::PushMasterCoro _;
+            mCompleter();
+        }
+    }
+
+    /** Fail awaitable */
+    void fail(std::exception_ptr eptr) const
+    {
+        { ut::PushMasterCoro _;
+            mCompleter.fail(eptr);
+        }
+    }
+
+private:
+    Completer mCompleter;
+    T *mOutValue;
+};
+
+/** Reply handle for requests that return nothing */
+template <>
+class ReplyTo<void>
+{
+public:
+    /** Construct a dummy handle */
+    ReplyTo() { }
+
+    /** Construct a handle for an awaitable, its completer is taken */
+    explicit ReplyTo(Awaitable& awt)
+        : mCompleter(awt.takeCompleter()) { }
+
+    /** True if requester no longer waits for the reply */
+    bool isExpired() const
+    {
+        return mCompleter.isExpired();
+    }
+
+    /** Complete awaitable */
+    void operator()() const
+    {
+        { ut::PushMasterCoro _;
+            mCompleter();
+        }
+    }
+
+    /** Fail awaitable */
+    void fail(std::exception_ptr eptr) const
+    {
+        { ut::PushMasterCoro _;
+            mCompleter.fail(eptr);
+        }
+    }
+
+private:
+    Completer mCompleter;
+};
+
+/**
+ * Coroutine with a typed mailbox
+ *
+ * An actor owns a coroutine that handles its messages one at a time, in the order
+ * they were sent. The handler may await, further messages queue up meanwhile.
+ * Use a variant to accept several kinds of messages:
+ *
+ *     typedef boost::variant<Deposit, Withdraw, GetBalance> AccountMessage;
+ *
+ *     Actor<AccountMessage> account("account", [&](AccountMessage& msg) {
+ *         boost::apply_visitor(accountVisitor, msg);
+ *     });
+ *
+ *     account.trySend(Deposit(100));
+ *
+ * The mailbox is a fixed size ring allocated up front, so sending doesn't allocate
+ * once messages themselves don't. An idle actor is woken through the scheduler
+ * (see initScheduler()). It then handles up to maxBatch messages per resume,
+ * including whatever got sent meanwhile. If more are left, it reschedules itself
+ * to let others run. Sending a burst of messages costs a single context switch.
+ *
+ * Other threads may send through trySendFromThread(), after enableRemoteSend().
+ * These messages go through a separate lock-free inbox.
+ *
+ * Exceptions thrown by the handler are counted in Stats and otherwise ignored.
+ * Destroying the actor interrupts its coroutine, queued messages are dropped.
+ *
+ * @warning Not thread safe, except for trySendFromThread()
+ */
+template <typename Message>
+class Actor
+{
+public:
+    /** Message handler, runs inside the actor coroutine */
+    typedef std::function<void (Message& msg)> Handler;
+
+    /** Thread safe function that runs an action on the loop thread, e.g. io_service::post() */
+    typedef std::function<void (Action action)> PostFunc;
+
+    /** Actor metrics */
+    struct Stats
+    {
+        /** Messages handled */
+        size_t numProcessed;
+
+        /** Messages whose handler has thrown */
+        size_t numFailed;
+
+        /** Times the actor has been resumed to handle messages */
+        size_t numBatches;
+
+        /** Messages received from other threads */
+        size_t numRemote;
+
+        /** Largest mailbox depth seen */
+        size_t maxMailboxDepth;
+
+        Stats()
+            : numProcessed(0)
+            , numFailed(0)
+            , numBatches(0)
+            , numRemote(0)
+            , maxMailboxDepth(0) { }
+    };
+
+    /**
+     * Construct an actor and start its coroutine
+     * @param tag           identifier for debugging
+     * @param handler       called for each message
+     * @param capacity      mailbox size
+     * @param maxBatch      max messages handled per resume
+     * @param stackSize     stack size of actor coroutine
+     */
+    Actor(std::string tag, Handler handler, size_t capacity = 64, size_t maxBatch = 32,
+            size_t stackSize = Coro::defaultStackSize())
+        : mTag(std::move(tag))
+        , mHandler(std::move(handler))
+        , mMaxBatch(maxBatch)
+        , mMailbox(capacity)
+        , mHead(0)
+        , mSize(0)
+        , mNumBlockedSenders(0)
+        , mCondSendable(mTag)
+        , mState(STATE_RUNNING)
+        , mCoro(nullptr)
+        , mIsRemoteWakePending(false)
+        , mSelf(std::make_shared<Actor<Message> *>(this))
+    {
+        ut_assert_(capacity > 0 && maxBatch > 0);
+
+        mAwt = startAsync(mTag, [this]() {
+            run();
+        }, stackSize);
+    }
+
+    /** Interrupts actor coroutine */
+    ~Actor()
+    {
+        // pending wakes become no-ops
+        mSelf.reset();
+    }
+
+    /** Identifier for debugging */
+    const char* tag()
+    {
+        return mTag.c_str();
+    }
+
+    /**
+     * Allow sending from other threads
+     * @param capacity  inbox size, must be a power of 2
+     * @param post      wakes actor from other threads, must stay valid while they send
+     */
+    void enableRemoteSend(size_t capacity, PostFunc post)
+    {
+        ut_assert_(!mInbox && "remote send already enabled");
+
+        mInbox.reset(new BoundedMpscQueue<Message>(capacity));
+        mPost = std::move(post);
+    }
+
+    /**
+     * Queue a message unless mailbox is full
+     * @return  false if message could not be queued
+     */
+    bool trySend(Message msg)
+    {
+        return tryQueue(msg);
+    }
+
+    /**
+     * Queue a message, waits for room if mailbox is full
+     * @param   msg     message to send
+     * @return  an awaitable that completes after message has been queued
+     *
+     * Blocked senders get room in FIFO order.
+     */
+    Awaitable asyncSend(Message msg)
+    {
+        if (tryQueue(msg)) {
+            return Awaitable::makeCompleted();
+        }
+
+        mNumBlockedSenders++;
+
+        Awaitable awt = mCondSendable.asyncWait();
+        auto awtPtr = awt.pointer();
+        std::weak_ptr<Actor<Message> *> self = mSelf;
+
+        // also called if interrupted, possibly after actor is gone
+        awt.then([self, awtPtr, msg]() {
+            auto strongSelf = self.lock();
+            if (!strongSelf) {
+                return;
+            }
+
+            Actor<Message> *thiz = *strongSelf;
+            thiz->mNumBlockedSenders--;
+
+            if (!awtPtr.didFail()) {
+                ut_assert_(thiz->mSize < thiz->mMailbox.size());
+
+                Message copy = msg;
+                thiz->queue(copy);
+            }
+        });
+
+        return std::move(awt);
+    }
+
+    /**
+     * Queue a message from any thread
+     * @return  false if inbox is full, msg is moved only on success
+     *
+     * The actor gets woken via the post function given to enableRemoteSend().
+     * Must outlive calls to this function.
+     */
+    bool trySendFromThread(Message& msg)
+    {
+        ut_assert_(mInbox && "remote send not enabled");
+
+        if (!mInbox->tryPush(msg)) {
+            return false;
+        }
+
+        if (!mIsRemoteWakePending.exchange(true)) {
+            std::weak_ptr<Actor<Message> *> self = mSelf;
+
+            mPost([self]() {
+                if (auto strongSelf = self.lock()) {
+                    (*strongSelf)->onRemoteWake();
+                }
+            });
+        }
+
+        return true;
+    }
+
+    /** Number of messages in mailbox, not counting the inbox */
+    size_t mailboxDepth() const
+    {
+        return mSize;
+    }
+
+    /** Mailbox size */
+    size_t capacity() const
+    {
+        return mMailbox.size();
+    }
+
+    /** Returns actor metrics */
+    const Stats& stats() const
+    {
+        return mStats;
+    }
+
+private:
+    enum State
+    {
+        STATE_IDLE,
+        STATE_WAKE_PENDING,
+        STATE_RUNNING
+    };
+
+    Actor(const Actor<Message>&); // noncopyable
+    Actor<Message>& operator=(const Actor<Message>&); // noncopyable
+
+    bool tryQueue(Message& msg)
+    {
+        // don't barge ahead of blocked senders
+        if (mSize == mMailbox.size() || mNumBlockedSenders > 0) {
+            return false;
+        }
+
+        queue(msg);
+        return true;
+    }
+
+    void queue(Message& msg)
+    {
+        mMailbox[(mHead + mSize) % mMailbox.size()] = std::move(msg);
+        mSize++;
+
+        mStats.maxMailboxDepth = std::max(mStats.maxMailboxDepth, mSize);
+
+        if (mState == STATE_IDLE) {
+            scheduleWake();
+        }
+    }
+
+    bool tryTake(Message& outMsg)
+    {
+        if (mSize > 0) {
+            outMsg = std::move(mMailbox[mHead]);
+            mHead = (mHead + 1) % mMailbox.size();
+            mSize--;
+
+            if (mNumBlockedSenders > 0) {
+                mCondSendable.notifyOne();
+            }
+            return true;
+        }
+
+        if (mInbox && mInbox->tryPop(outMsg)) {
+            mStats.numRemote++;
+            return true;
+        }
+
+        return false;
+    }
+
+    bool hasMessages() const
+    {
+        return mSize > 0 || (mInbox && !mInbox->isEmpty());
+    }
+
+    void scheduleWake()
+    {
+        mState = STATE_WAKE_PENDING;
+
+        std::weak_ptr<Actor<Message> *> self = mSelf;
+
+        schedule([self]() {
+            if (auto strongSelf = self.lock()) {
+                (*strongSelf)->resume();
+            }
+        });
+    }
+
+    void onRemoteWake()
+    {
+        // acquire pairs with the sender's exchange, so its message is visible below
+        mIsRemoteWakePending.exchange(false, std::memory_order_acq_rel);
+
+        if (mState == STATE_IDLE) {
+            resume();
+        }
+    }
+
+    void resume()
+    {
+        if (mState == STATE_RUNNING) {
+            return;
+        }
+
+        mState = STATE_RUNNING;
+
+        { ut::PushMasterCoro _;
+            yieldTo(mCoro);
+        }
+    }
+
+    void run()
+    {
+        mCoro = currentCoro();
+
+        Message msg;
+
+        while (true) {
+            if (hasMessages()) {
+                mStats.numBatches++;
+
+                for (size_t i = 0; i < mMaxBatch && tryTake(msg); i++) {
+                    try {
+                        mHandler(msg);
+                    } catch (const ForcedUnwind&) {
+                        throw;
+                    } catch (...) {
+                        mStats.numFailed++;
+                    }
+
+                    mStats.numProcessed++;
+                    msg = Message();
+                }
+            }
+
+            if (hasMessages()) {
+                // batch used up, let others run
+                scheduleWake();
+            } else {
+                mState = STATE_IDLE;
+            }
+
+            yieldTo(masterCoro());
+        }
+    }
+
+    std::string mTag;
+    Handler mHandler;
+    size_t mMaxBatch;
+
+    std::vector<Message> mMailbox;
+    size_t mHead;
+    size_t mSize;
+
+    size_t mNumBlockedSenders;
+    Condition mCondSendable;
+
+    State mState;
+    Coro *mCoro;
+    Stats mStats;
+
+    std::unique_ptr<BoundedMpscQueue<Message> > mInbox;
+    PostFunc mPost;
+    std::atomic<bool> mIsRemoteWakePending;
+
+    std::shared_ptr<Actor<Message> *> mSelf;
+
+    // declared last, coroutine gets interrupted first
+    Awaitable mAwt;
+};
+
+}
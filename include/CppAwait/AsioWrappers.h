@@ -18,7 +18,12 @@
 
 #include "Config.h"
 #include "Awaitable.h"
+#include "SyncWait.h"
 #include "misc/OpaqueSharedPtr.h"
+#include "impl/Assert.h"
+#include <algorithm>
+#include <functional>
+#include <vector>
 #include <boost/asio.hpp>
 
 #ifdef HAVE_OPENSSL
@@ -45,12 +50,14 @@ namespace detail {
 
     void doAsyncHttpGet(boost::asio::ip::tcp::socket& socket,
         const std::string& host, const std::string& path, bool persistentConnection,
-        bool readAll, std::shared_ptr<boost::asio::streambuf> outResponse, size_t& outContentLength);
+        bool readAll, boost::asio::io_service *workIo,
+        std::shared_ptr<boost::asio::streambuf> outResponse, size_t& outContentLength);
 
 #ifdef HAVE_OPENSSL
     void doAsyncHttpGet(boost::asio::ssl::stream<boost::asio::ip::tcp::socket>& socket,
         const std::string& host, const std::string& path, bool persistentConnection,
-        bool readAll, std::shared_ptr<boost::asio::streambuf> outResponse, size_t& outContentLength);
+        bool readAll, boost::asio::io_service *workIo,
+        std::shared_ptr<boost::asio::streambuf> outResponse, size_t& outContentLength);
 #endif
 
     inline std::exception_ptr eptr(const boost::system::error_code& ec)
@@ -338,23 +345,321 @@ inline Awaitable asyncHttpGetHeader(Socket& socket,
     std::shared_ptr<boost::asio::streambuf> outResponse, size_t& outContentLength)
 {
     return ut::startAsync("asyncHttpGetHeader", [&socket, host, path, persistentConnection, outResponse, &outContentLength]() {
-        detail::doAsyncHttpGet(socket, host, path, persistentConnection, false, outResponse, outContentLength);
+        detail::doAsyncHttpGet(socket, host, path, persistentConnection, false, nullptr, outResponse, outContentLength);
     });
 }
 
+/** GET whole body, a compressed body gets decoded and outContentLength is its decoded size */
 template <typename Socket>
 inline Awaitable asyncHttpGet(Socket& socket,
     const std::string& host, const std::string& path, bool persistentConnection,
     std::shared_ptr<boost::asio::streambuf> outResponse, size_t& outContentLength)
 {
     return ut::startAsync("asyncHttpGet", [&socket, host, path, persistentConnection, outResponse, &outContentLength]() {
-        detail::doAsyncHttpGet(socket, host, path, persistentConnection, true, outResponse, outContentLength);
+        detail::doAsyncHttpGet(socket, host, path, persistentConnection, true, nullptr, outResponse, outContentLength);
     });
 }
 
+/**
+ * Download a resource
+ * @param io           io_service that runs the download
+ * @param host         HTTP host
+ * @param path         resource path
+ * @param outResponse  receives the decoded body
+ * @param workIo       io_service for decoding large compressed bodies, typically served by a thread pool
+ * @return  an awaitable that completes once whole body has been received
+ *
+ * Advertises gzip / deflate (if built with zlib) and decodes the body as it arrives.
+ * Chunked transfer encoding is stripped first. Without workIo, decoding runs on io.
+ */
 Awaitable asyncHttpDownload(boost::asio::io_service& io,
     const std::string& host, const std::string& path,
-    std::shared_ptr<boost::asio::streambuf> outResponse);
+    std::shared_ptr<boost::asio::streambuf> outResponse,
+    boost::asio::io_service *workIo = nullptr);
+
+/** Receives downloaded data at its offset within resource, called as data arrives */
+typedef std::function<void (size_t offset, const char *data, size_t size)> RangeSink;
+
+/**
+ * Download a large resource over parallel connections
+ * @param io              io_service that runs the download
+ * @param host            HTTP host
+ * @param path            resource path
+ * @param sink            receives data, e.g. writes it into a file with pwrite()
+ * @param outSize         receives resource size before sink gets called, must be valid until awaitable done
+ * @param chunkSize       bytes per range request
+ * @param maxConnections  max parallel connections
+ * @return  an awaitable that completes once all data has been passed to sink
+ *
+ * Probes resource size with HEAD, then fetches chunks with Range requests over a pool
+ * of persistent connections, so that several TCP streams share the work. A chunk that
+ * fails gets retried on a new connection. If the server doesn't accept ranges,
+ * the resource is fetched with a single GET.
+ */
+Awaitable asyncHttpDownloadRanged(boost::asio::io_service& io,
+    const std::string& host, const std::string& path,
+    RangeSink sink, size_t& outSize,
+    size_t chunkSize = 1024 * 1024, size_t maxConnections = 4);
+
+/** Download into a buffer, which gets allocated once resource size is known. See above. */
+Awaitable asyncHttpDownloadRanged(boost::asio::io_service& io,
+    const std::string& host, const std::string& path,
+    std::shared_ptr<std::vector<char> > outData,
+    size_t chunkSize = 1024 * 1024, size_t maxConnections = 4);
+
+
+//
+// streaming parsers
+//
+
+namespace detail {
+
+    // feeds buffered input, up to numBytesLeft
+    template <typename Tokenizer>
+    void feedTokenizer(Tokenizer& tokenizer, boost::asio::streambuf& buffer, size_t& ioNumBytesLeft)
+    {
+        size_t size = std::min(buffer.size(), ioNumBytesLeft);
+
+        if (size > 0) {
+            tokenizer.feed(boost::asio::buffer_cast<const char *>(buffer.data()), size);
+            buffer.consume(size);
+
+            if (ioNumBytesLeft != (size_t) -1) {
+                ioNumBytesLeft -= size;
+            }
+        }
+    }
+}
+
+/**
+ * Parse the next event of a streaming tokenizer, reading more input as needed
+ * @param stream          stream to read from
+ * @param buffer          input already read, e.g. body bytes that came with the header
+ * @param ioNumBytesLeft  input left including buffer, decreased as it gets parsed. Pass (size_t) -1 to read until EOF.
+ * @param tokenizer       XmlTokenizer, JsonTokenizer or alike
+ * @return  an awaitable that completes once tokenizer has an event, immediately if input is buffered
+ *
+ * Parsing overlaps with download and only the token being parsed is kept in memory.
+ * Never reads past ioNumBytesLeft, so a persistent connection is left at the next
+ * response. Arguments must be valid until awaitable done.
+ *
+ *     size_t contentLength;
+ *     asio::asyncHttpGetHeader(socket, host, path, true, response, contentLength).await();
+ *
+ *     XmlTokenizer xml;
+ *     do {
+ *         asio::asyncNextEvent(socket, response, contentLength, xml).await();
+ *         ...
+ *     } while (xml.event() != XmlTokenizer::END_DOCUMENT);
+ */
+template <typename AsyncReadStream, typename Tokenizer>
+Awaitable asyncNextEvent(AsyncReadStream& stream, std::shared_ptr<boost::asio::streambuf> buffer, size_t& ioNumBytesLeft, Tokenizer& tokenizer)
+{
+    ut_assert_(tokenizer.event() != Tokenizer::END_DOCUMENT && "document already parsed");
+
+    detail::feedTokenizer(tokenizer, *buffer, ioNumBytesLeft);
+
+    if (tokenizer.next()) {
+        return Awaitable::makeCompleted();
+    }
+
+    return startAsync("asyncNextEvent", [&stream, buffer, &ioNumBytesLeft, &tokenizer]() {
+        static const size_t CHUNK_SIZE = 4096;
+
+        do {
+            if (ioNumBytesLeft == 0) {
+                tokenizer.finish();
+                continue;
+            }
+
+            size_t numBytesRead;
+
+            try {
+                Awaitable awt = asyncRead(stream, buffer->prepare(std::min(CHUNK_SIZE, ioNumBytesLeft)), buffer,
+                    boost::asio::transfer_at_least(1), numBytesRead);
+                awt.await();
+            } catch (const boost::system::system_error& e) {
+                if (e.code() != boost::asio::error::eof || ioNumBytesLeft != (size_t) -1) {
+                    throw;
+                }
+
+                tokenizer.finish();
+                continue;
+            }
+
+            buffer->commit(numBytesRead);
+            detail::feedTokenizer(tokenizer, *buffer, ioNumBytesLeft);
+        } while (!tokenizer.next());
+    });
+}
+
+
+//
+// bridges for thread based code
+//
+
+/**
+ * Run io_service until awaitable is done
+ * @return  true if awaitable is done, false if io_service was stopped or ran out of work
+ *
+ * See ut::syncWait(). Resets io_service if it was stopped before.
+ */
+inline bool syncWait(Awaitable& awt, boost::asio::io_service& io)
+{
+    if (io.stopped()) {
+        io.reset();
+    }
+
+    return ut::syncWait(awt, [&io]() -> bool {
+        return io.run_one() != 0;
+    });
+}
+
+/**
+ * Fulfills an Awaitable from any thread
+ *
+ * Hand it to thread based code in place of a std::promise -- it has the same
+ * set_value() / set_exception() interface. These may be called from any thread.
+ * The value gets stored and the awaitable completed on the io_service thread,
+ * unless the awaitable is gone by then.
+ *
+ * Copyable. The first call to set_value() / set_exception() wins.
+ */
+template <typename T>
+class ThreadPromise
+{
+public:
+    /**
+     * Create a promise for an awaitable
+     * @param io        io_service that runs the awaitable
+     * @param awt       awaitable to fulfill, its completer is taken
+     * @param outValue  receives the value, must be valid until awt is done
+     */
+    ThreadPromise(boost::asio::io_service& io, Awaitable& awt, T& outValue)
+        : mIo(&io)
+        , mCompleter(awt.takeCompleter())
+        , mOutValue(&outValue) { }
+
+    /** Store value and complete awaitable */
+    void set_value(T value) const
+    {
+        Completer completer = mCompleter;
+        T *outValue = mOutValue;
+        auto sharedValue = std::make_shared<T>(std::move(value));
+
+        mIo->post([completer, outValue, sharedValue]() {
+            if (!completer.isExpired()) {
+                completer.restoreStack();
+                *outValue = std::move(*sharedValue);
+                completer.complete();
+            }
+        });
+    }
+
+    /** Fail awaitable */
+    void set_exception(std::exception_ptr eptr) const
+    {
+        Completer completer = mCompleter;
+
+        mIo->post([completer, eptr]() {
+            completer.fail(eptr);
+        });
+    }
+
+private:
+    boost::asio::io_service *mIo;
+    Completer mCompleter;
+    T *mOutValue;
+};
+
+/** Fulfills an Awaitable without result from any thread */
+template <>
+class ThreadPromise<void>
+{
+public:
+    /**
+     * Create a promise for an awaitable
+     * @param io        io_service that runs the awaitable
+     * @param awt       awaitable to fulfill, its completer is taken
+     */
+    ThreadPromise(boost::asio::io_service& io, Awaitable& awt)
+        : mIo(&io)
+        , mCompleter(awt.takeCompleter()) { }
+
+    /** Complete awaitable */
+    void set_value() const
+    {
+        mIo->post(mCompleter);
+    }
+
+    /** Fail awaitable */
+    void set_exception(std::exception_ptr eptr) const
+    {
+        Completer completer = mCompleter;
+
+        mIo->post([completer, eptr]() {
+            completer.fail(eptr);
+        });
+    }
+
+private:
+    boost::asio::io_service *mIo;
+    Completer mCompleter;
+};
+
+/**
+ * Run a function on another io_service, typically one served by a thread pool
+ * @param io        io_service that runs the awaitable
+ * @param workIo    io_service to run func on
+ * @param func      functor returning T, called on a workIo thread
+ * @param outValue  receives the result of func, must be valid until awaitable done
+ * @return  an awaitable that completes on io once func has returned, or fails with its exception
+ *
+ * Keeps CPU bound work off the io_service thread. Interrupting the awaitable
+ * doesn't stop func, its result just gets dropped.
+ *
+ * io.run() doesn't return while func is running, io holds work until the
+ * result has been posted back.
+ */
+template <typename T, typename Callable>
+Awaitable asyncOffload(boost::asio::io_service& io, boost::asio::io_service& workIo, Callable func, T& outValue)
+{
+    ut::Awaitable awt("asyncOffload");
+    ThreadPromise<T> promise(io, awt, outValue);
+    boost::asio::io_service::work work(io);
+
+    // work released after result has been posted
+    workIo.post([promise, func, work]() mutable {
+        try {
+            promise.set_value(func());
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+        }
+    });
+
+    return std::move(awt);
+}
+
+/** Run a function without result on another io_service, see asyncOffload() above */
+template <typename Callable>
+Awaitable asyncOffload(boost::asio::io_service& io, boost::asio::io_service& workIo, Callable func)
+{
+    ut::Awaitable awt("asyncOffload");
+    ThreadPromise<void> promise(io, awt);
+    boost::asio::io_service::work work(io);
+
+    // work released after result has been posted
+    workIo.post([promise, func, work]() mutable {
+        try {
+            func();
+            promise.set_value();
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+        }
+    });
+
+    return std::move(awt);
+}
 
 
 #ifdef HAVE_OPENSSL
@@ -386,7 +691,8 @@ inline Awaitable asyncShutdown(boost::asio::ssl::stream<boost::asio::ip::tcp::so
 Awaitable asyncHttpsDownload(boost::asio::io_service& io,
     boost::asio::ssl::context_base::method sslVersion,
     const std::string& host, const std::string& path,
-    std::shared_ptr<boost::asio::streambuf> outResponse);
+    std::shared_ptr<boost::asio::streambuf> outResponse,
+    boost::asio::io_service *workIo = nullptr);
 
 #endif // HAVE_OPENSSL
 
@@ -0,0 +1,562 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * @file  AsyncPool.h
+ *
+ * Declares the AsyncPool class.
+ *
+ */
+
+#pragma once
+
+#include "Config.h"
+#include "Awaitable.h"
+#include "Log.h"
+#include "impl/Assert.h"
+#include <deque>
+#include <list>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <stdexcept>
+
+namespace ut {
+
+/**
+ * Pool of expensive resources with awaitable checkout
+ *
+ * Keeps items like database connections or large buffers around for reuse and
+ * limits how many exist at the same time. asyncCheckout() hands out an idle item
+ * right away. Otherwise, if below maxSize, a new item is created through the
+ * factory; if not, the caller waits in FIFO order for an item to be returned.
+ *
+ *     AsyncPool<DbConnection>::Lease conn;
+ *     pool.asyncCheckout(conn).await();
+ *     conn->query(...);
+ *     // returned to pool when conn goes out of scope
+ *
+ * Hooks:
+ * - health check: items that fail it are dropped at checkout, or at checkin when
+ *   they would go straight to a waiter
+ * - idle timeout: items idle longer are evicted, down to minSize
+ *
+ * Idle items are reused most recently returned first, so that the rest may expire.
+ * Eviction is lazy, call evictIdle() from a timer to also trim a pool nobody uses.
+ *
+ * Leases must be returned before the pool is destroyed. Destroying the pool
+ * interrupts pending creations, waiting checkouts never complete.
+ *
+ * @warning Not thread safe. AsyncPools are designed for single-threaded use.
+ */
+template <typename T>
+class AsyncPool
+{
+public:
+    /** Creates an item, the returned awaitable completes once outItem is set */
+    typedef std::function<Awaitable (std::unique_ptr<T>& outItem)> Factory;
+
+    /** Returns false if an idle item is no longer usable */
+    typedef std::function<bool (T& item)> HealthCheck;
+
+    /** Exclusive use of a pooled item, returns it on destruction */
+    class Lease
+    {
+    public:
+        /** Construct an empty lease */
+        Lease()
+            : mPool(nullptr) { }
+
+        /** Move constructor */
+        Lease(Lease&& other)
+            : mPool(other.mPool)
+            , mItem(std::move(other.mItem))
+        {
+            other.mPool = nullptr;
+        }
+
+        /** Move assignment */
+        Lease& operator=(Lease&& other)
+        {
+            if (this != &other) {
+                release();
+
+                mPool = other.mPool;
+                mItem = std::move(other.mItem);
+                other.mPool = nullptr;
+            }
+
+            return *this;
+        }
+
+        /** Returns item to pool */
+        ~Lease()
+        {
+            release();
+        }
+
+        /** True if holding an item */
+        operator bool() const
+        {
+            return mItem.get() != nullptr;
+        }
+
+        /** Leased item */
+        T* get() const
+        {
+            return mItem.get();
+        }
+
+        T* operator->() const
+        {
+            return mItem.get();
+        }
+
+        T& operator*() const
+        {
+            return *mItem;
+        }
+
+        /** Return item to pool ahead of destruction */
+        void release()
+        {
+            if (mPool) {
+                AsyncPool<T> *pool = mPool;
+                mPool = nullptr;
+
+                pool->checkin(std::move(mItem));
+            }
+        }
+
+        /** Destroy item instead of returning it, e.g. after a connection error */
+        void discard()
+        {
+            if (mPool) {
+                AsyncPool<T> *pool = mPool;
+                mPool = nullptr;
+
+                mItem.reset();
+                pool->drop();
+            }
+        }
+
+    private:
+        Lease(const Lease&); // noncopyable
+        Lease& operator=(const Lease&); // noncopyable
+
+        Lease(AsyncPool<T> *pool, std::unique_ptr<T> item)
+            : mPool(pool)
+            , mItem(std::move(item)) { }
+
+        AsyncPool<T> *mPool;
+        std::unique_ptr<T> mItem;
+
+        friend class AsyncPool<T>;
+    };
+
+    /** Pool metrics */
+    struct Stats
+    {
+        /** Items created */
+        size_t numCreated;
+
+        /** Factory calls that have failed */
+        size_t numFailedCreates;
+
+        /** Checkouts that had to wait */
+        size_t numWaits;
+
+        /** Items dropped by health check or discard() */
+        size_t numDiscarded;
+
+        /** Items evicted after idle timeout */
+        size_t numEvicted;
+
+        Stats()
+            : numCreated(0)
+            , numFailedCreates(0)
+            , numWaits(0)
+            , numDiscarded(0)
+            , numEvicted(0) { }
+    };
+
+    /**
+     * Construct a pool and start creating minSize items
+     * @param tag       identifier for debugging
+     * @param factory   creates items on demand
+     * @param minSize   items kept alive when idle
+     * @param maxSize   max items in existence, including leased ones
+     */
+    AsyncPool(std::string tag, Factory factory, size_t minSize, size_t maxSize)
+        : mTag(std::move(tag))
+        , mFactory(std::move(factory))
+        , mMinSize(minSize)
+        , mMaxSize(maxSize)
+        , mIdleTimeout(0)
+        , mNumItems(0)
+        , mNumCreating(0)
+        , mNumLeased(0)
+        , mNumUnreaped(0)
+    {
+        ut_assert_(maxSize > 0 && minSize <= maxSize);
+
+        for (size_t i = 0; i < minSize; i++) {
+            spawnCreator();
+        }
+    }
+
+    /** Leases must have been returned */
+    ~AsyncPool()
+    {
+        ut_assert_(mNumLeased == 0 && "items still leased");
+    }
+
+    /** Identifier for debugging */
+    const char* tag()
+    {
+        return mTag.c_str();
+    }
+
+    /** Check items before handing them out */
+    void setHealthCheck(HealthCheck healthCheck)
+    {
+        mHealthCheck = std::move(healthCheck);
+    }
+
+    /** Evict items idle longer than timeout, zero disables eviction */
+    void setIdleTimeout(std::chrono::milliseconds timeout)
+    {
+        mIdleTimeout = timeout;
+    }
+
+    /**
+     * Lease an item
+     * @param   outLease    receives the item, must not be freed before awaitable done
+     * @return  an awaitable that completes once an item is leased, immediately if one is idle
+     *
+     * Fails if the factory fails while the caller is first in line.
+     */
+    Awaitable asyncCheckout(Lease& outLease)
+    {
+        ut_assert_(!outLease && "lease already holds an item");
+
+        evictExpired();
+
+        while (!mIdle.empty()) {
+            std::unique_ptr<T> item = std::move(mIdle.back().item);
+            mIdle.pop_back();
+
+            if (mHealthCheck && !mHealthCheck(*item)) {
+                ut_log_debug_("* pool '%s' drops unhealthy item", mTag.c_str());
+
+                mNumItems--;
+                mStats.numDiscarded++;
+                continue;
+            }
+
+            outLease = lease(std::move(item));
+            return Awaitable::makeCompleted();
+        }
+
+        Awaitable awt(mTag);
+        mWaiters.push_back(Waiter(awt.takeCompleter(), &outLease));
+        mStats.numWaits++;
+
+        // queue first, factory may complete right away
+        growForWaiters();
+
+        return std::move(awt);
+    }
+
+    /**
+     * Evict items idle longer than the idle timeout, down to minSize
+     * @return  number of items evicted
+     */
+    size_t evictIdle()
+    {
+        return evictExpired();
+    }
+
+    /** Items in existence, idle or leased */
+    size_t size() const
+    {
+        return mNumItems;
+    }
+
+    /** Idle items */
+    size_t numIdle() const
+    {
+        return mIdle.size();
+    }
+
+    /** Leased items */
+    size_t numLeased() const
+    {
+        return mNumLeased;
+    }
+
+    /** Checkouts waiting, including interrupted ones not yet cleaned up */
+    size_t numWaiting() const
+    {
+        return mWaiters.size();
+    }
+
+    /** Returns pool metrics */
+    const Stats& stats() const
+    {
+        return mStats;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct IdleItem
+    {
+        std::unique_ptr<T> item;
+        Clock::time_point idleSince;
+
+        IdleItem(std::unique_ptr<T>&& item)
+            : item(std::move(item))
+            , idleSince(Clock::now()) { }
+
+        IdleItem(IdleItem&& other)
+            : item(std::move(other.item))
+            , idleSince(other.idleSince) { }
+
+        IdleItem& operator=(IdleItem&& other)
+        {
+            item = std::move(other.item);
+            idleSince = other.idleSince;
+            return *this;
+        }
+    };
+
+    struct Waiter
+    {
+        Completer completer;
+        Lease *outLease;
+
+        Waiter(Completer&& completer, Lease *outLease)
+            : completer(std::move(completer))
+            , outLease(outLease) { }
+
+        Waiter(Waiter&& other)
+            : completer(std::move(other.completer))
+            , outLease(other.outLease) { }
+
+        Waiter& operator=(Waiter&& other)
+        {
+            completer = std::move(other.completer);
+            outLease = other.outLease;
+            return *this;
+        }
+    };
+
+    AsyncPool(const AsyncPool<T>&); // noncopyable
+    AsyncPool<T>& operator=(const AsyncPool<T>&); // noncopyable
+
+    Lease lease(std::unique_ptr<T>&& item)
+    {
+        mNumLeased++;
+
+        return Lease(this, std::move(item));
+    }
+
+    // hands item to first waiter, or keeps it idle
+    void checkin(std::unique_ptr<T>&& item)
+    {
+        // idle items get checked at checkout, a waiter would take it unchecked
+        if (!mWaiters.empty() && mHealthCheck && !mHealthCheck(*item)) {
+            ut_log_debug_("* pool '%s' drops unhealthy item", mTag.c_str());
+
+            item.reset();
+            drop();
+            return;
+        }
+
+        mNumLeased--;
+        offer(std::move(item));
+    }
+
+    void drop()
+    {
+        mNumLeased--;
+        mNumItems--;
+        mStats.numDiscarded++;
+
+        // waiters may need a replacement
+        growForWaiters();
+    }
+
+    void offer(std::unique_ptr<T>&& item)
+    {
+        while (!mWaiters.empty()) {
+            Waiter waiter = std::move(mWaiters.front());
+            mWaiters.pop_front();
+
+            if (waiter.completer.isExpired()) {
+                continue;
+            }
+
+            waiter.completer.restoreStack();
+            *waiter.outLease = lease(std::move(item));
+
+            { ut::PushMasterCoro _;
+                waiter.completer();
+            }
+            return;
+        }
+
+        mIdle.push_back(IdleItem(std::move(item)));
+        evictExpired();
+    }
+
+    size_t evictExpired()
+    {
+        if (mIdleTimeout.count() == 0) {
+            return 0;
+        }
+
+        Clock::time_point deadline = Clock::now() - mIdleTimeout;
+        size_t numEvicted = 0;
+
+        // oldest first
+        while (!mIdle.empty() && mNumItems > mMinSize && mIdle.front().idleSince < deadline) {
+            mIdle.pop_front();
+            mNumItems--;
+            numEvicted++;
+        }
+
+        if (numEvicted > 0) {
+            mStats.numEvicted += numEvicted;
+
+            ut_log_debug_("* pool '%s' evicts %ld idle items", mTag.c_str(), (long) numEvicted);
+        }
+
+        return numEvicted;
+    }
+
+    // one creation per waiter, within maxSize
+    void growForWaiters()
+    {
+        if (mNumCreating < mWaiters.size() && mNumItems + mNumCreating < mMaxSize) {
+            spawnCreator();
+        }
+    }
+
+    void spawnCreator()
+    {
+        if (mNumUnreaped > 0) {
+            reapCreators();
+        }
+
+        mNumCreating++;
+
+        ut_log_debug_("* pool '%s' creates item, %ld in pool", mTag.c_str(), (long) mNumItems);
+
+        mCreators.push_back(startAsync(mTag + "-create", [this]() {
+            create();
+        }));
+    }
+
+    void create()
+    {
+        std::unique_ptr<T> item;
+        std::exception_ptr eptr;
+
+        try {
+            mFactory(item).await();
+        } catch (const ForcedUnwind&) {
+            mNumCreating--;
+            throw;
+        } catch (...) {
+            eptr = std::current_exception();
+        }
+
+        mNumCreating--;
+        mNumUnreaped++;
+
+        if (eptr == std::exception_ptr() && !item) {
+            eptr = std::make_exception_ptr(std::runtime_error("pool factory returned no item"));
+        }
+
+        if (eptr == std::exception_ptr()) {
+            mNumItems++;
+            mStats.numCreated++;
+
+            offer(std::move(item));
+        } else {
+            mStats.numFailedCreates++;
+
+            ut_log_warn_("* pool '%s' failed to create item", mTag.c_str());
+
+            failWaiter(eptr);
+
+            // retry for the others
+            growForWaiters();
+        }
+    }
+
+    // first waiter gets the error, instead of waiting forever
+    void failWaiter(std::exception_ptr eptr)
+    {
+        while (!mWaiters.empty()) {
+            Completer completer = std::move(mWaiters.front().completer);
+            mWaiters.pop_front();
+
+            if (!completer.isExpired()) {
+                { ut::PushMasterCoro _;
+                    completer.fail(eptr);
+                }
+                return;
+            }
+        }
+    }
+
+    void reapCreators()
+    {
+        for (auto it = mCreators.begin(); it != mCreators.end(); ) {
+            if (it->isDone()) {
+                it = mCreators.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        mNumUnreaped = 0;
+    }
+
+    std::string mTag;
+    Factory mFactory;
+    HealthCheck mHealthCheck;
+    size_t mMinSize;
+    size_t mMaxSize;
+    std::chrono::milliseconds mIdleTimeout;
+
+    size_t mNumItems;
+    size_t mNumCreating;
+    size_t mNumLeased;
+    size_t mNumUnreaped;
+    Stats mStats;
+
+    std::deque<IdleItem> mIdle;
+    std::deque<Waiter> mWaiters;
+
+    // declared last, creators get interrupted before the rest goes away
+    std::list<Awaitable> mCreators;
+};
+
+}
@@ -0,0 +1,323 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * @file  AsyncSharedMutex.h
+ *
+ * Declares the AsyncSharedMutex class.
+ *
+ */
+
+#pragma once
+
+#include "Config.h"
+#include "Awaitable.h"
+#include "Log.h"
+#include "impl/Assert.h"
+#include <deque>
+#include <vector>
+
+namespace ut {
+
+/**
+ * Reader-writer lock for coroutines
+ *
+ * Any number of readers may hold the lock at the same time, across suspension
+ * points. A writer holds it alone.
+ *
+ * Writers are preferred: once a writer is waiting, new readers queue up behind it.
+ * When a writer releases the lock, all queued readers are admitted together in one
+ * batch, ahead of the next writer. So under a steady stream of writes, reads and
+ * writes alternate instead of either side starving.
+ *
+ * Ownership is handed over on release: a woken coroutine already holds the lock,
+ * nobody can barge in meanwhile. Uncontended lock and unlock are O(1) and don't
+ * allocate.
+ *
+ *     { AsyncSharedMutex::SharedGuard _(mutex); // may suspend
+ *         lookup(index, key);
+ *     }
+ *
+ * @warning Not thread safe. AsyncSharedMutexes are designed for single-threaded use.
+ */
+class AsyncSharedMutex
+{
+public:
+    /** Awaits shared ownership on construction, releases it on destruction */
+    class SharedGuard
+    {
+    public:
+        explicit SharedGuard(AsyncSharedMutex& mutex)
+            : mMutex(mutex)
+        {
+            mMutex.asyncLockShared().await();
+        }
+
+        ~SharedGuard()
+        {
+            mMutex.unlockShared();
+        }
+
+    private:
+        SharedGuard(const SharedGuard&); // noncopyable
+        SharedGuard& operator=(const SharedGuard&); // noncopyable
+
+        AsyncSharedMutex& mMutex;
+    };
+
+    /** Awaits exclusive ownership on construction, releases it on destruction */
+    class Guard
+    {
+    public:
+        explicit Guard(AsyncSharedMutex& mutex)
+            : mMutex(mutex)
+        {
+            mMutex.asyncLock().await();
+        }
+
+        ~Guard()
+        {
+            mMutex.unlock();
+        }
+
+    private:
+        Guard(const Guard&); // noncopyable
+        Guard& operator=(const Guard&); // noncopyable
+
+        AsyncSharedMutex& mMutex;
+    };
+
+    /** Construct an unlocked mutex */
+    explicit AsyncSharedMutex(std::string tag = std::string())
+        : mTag(std::move(tag))
+        , mNumReaders(0)
+        , mIsWriting(false) { }
+
+    /** Mutex must not be locked */
+    ~AsyncSharedMutex()
+    {
+        ut_assert_(mNumReaders == 0 && !mIsWriting && "mutex still locked");
+    }
+
+    /** Identifier for debugging */
+    const char* tag()
+    {
+        return mTag.c_str();
+    }
+
+    /**
+     * Acquire shared ownership
+     * @return  an awaitable that completes once lock is held, immediately if uncontended
+     *
+     * Caller must unlockShared() once awaitable has completed. If the awaitable
+     * gets interrupted while waiting, the lock is not acquired.
+     */
+    Awaitable asyncLockShared()
+    {
+        if (tryLockShared()) {
+            return Awaitable::makeCompleted();
+        }
+
+        Awaitable awt(mTag);
+        mWaitingReaders.push_back(awt.takeCompleter());
+
+        return std::move(awt);
+    }
+
+    /**
+     * Acquire exclusive ownership
+     * @return  an awaitable that completes once lock is held, immediately if uncontended
+     *
+     * Caller must unlock() once awaitable has completed. If the awaitable
+     * gets interrupted while waiting, the lock is not acquired.
+     */
+    Awaitable asyncLock()
+    {
+        if (tryLock()) {
+            return Awaitable::makeCompleted();
+        }
+
+        Awaitable awt(mTag);
+        mWaitingWriters.push_back(awt.takeCompleter());
+
+        return std::move(awt);
+    }
+
+    /** Acquire shared ownership if possible without waiting */
+    bool tryLockShared()
+    {
+        // don't let interrupted writers hold readers back
+        while (!mWaitingWriters.empty() && mWaitingWriters.front().isExpired()) {
+            mWaitingWriters.pop_front();
+        }
+
+        if (mIsWriting || !mWaitingWriters.empty()) {
+            return false;
+        }
+
+        mNumReaders++;
+        return true;
+    }
+
+    /** Acquire exclusive ownership if possible without waiting */
+    bool tryLock()
+    {
+        if (mIsWriting || mNumReaders > 0) {
+            return false;
+        }
+
+        mIsWriting = true;
+        return true;
+    }
+
+    /** Release shared ownership */
+    void unlockShared()
+    {
+        ut_assert_(mNumReaders > 0 && "not locked shared");
+
+        mNumReaders--;
+
+        if (mNumReaders == 0) {
+            admitNext();
+        }
+    }
+
+    /** Release exclusive ownership */
+    void unlock()
+    {
+        ut_assert_(mIsWriting && "not locked");
+
+        mIsWriting = false;
+
+        // queued readers go first, then the next writer
+        if (!mWaitingReaders.empty()) {
+            admitReaders();
+        } else {
+            admitNext();
+        }
+    }
+
+    /** Number of coroutines holding shared ownership */
+    size_t numReaders() const
+    {
+        return mNumReaders;
+    }
+
+    /** True if held exclusively */
+    bool isLocked() const
+    {
+        return mIsWriting;
+    }
+
+    /** Number of readers waiting, including interrupted ones not yet cleaned up */
+    size_t numWaitingReaders() const
+    {
+        return mWaitingReaders.size();
+    }
+
+    /** Number of writers waiting, including interrupted ones not yet cleaned up */
+    size_t numWaitingWriters() const
+    {
+        return mWaitingWriters.size();
+    }
+
+private:
+    AsyncSharedMutex(const AsyncSharedMutex&); // noncopyable
+    AsyncSharedMutex& operator=(const AsyncSharedMutex&); // noncopyable
+
+    // lock is free, hand it to the next waiter
+    void admitNext()
+    {
+        ut_assert_(!mIsWriting && mNumReaders == 0);
+
+        if (admitWriter()) {
+            return;
+        }
+
+        if (!mWaitingReaders.empty()) {
+            admitReaders();
+        }
+    }
+
+    bool admitWriter()
+    {
+        while (!mWaitingWriters.empty()) {
+            Completer completer = std::move(mWaitingWriters.front());
+            mWaitingWriters.pop_front();
+
+            if (!completer.isExpired()) {
+                mIsWriting = true;
+
+                ut_log_debug_("* mutex '%s' admits writer", mTag.c_str());
+
+                { ut::PushMasterCoro _;
+                    completer();
+                }
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void admitReaders()
+    {
+        ut_assert_(!mIsWriting);
+
+        std::vector<Completer> batch;
+        batch.reserve(mWaitingReaders.size());
+
+        while (!mWaitingReaders.empty()) {
+            if (!mWaitingReaders.front().isExpired()) {
+                batch.push_back(std::move(mWaitingReaders.front()));
+            }
+            mWaitingReaders.pop_front();
+        }
+
+        if (batch.empty()) {
+            if (mNumReaders == 0) {
+                admitWriter();
+            }
+            return;
+        }
+
+        ut_log_debug_("* mutex '%s' admits %ld readers", mTag.c_str(), (long) batch.size());
+
+        // whole batch holds the lock before any reader runs
+        mNumReaders += batch.size();
+
+        { ut::PushMasterCoro _;
+            ut_foreach_(Completer& completer, batch) {
+                if (completer.isExpired()) {
+                    // interrupted by an earlier reader of the batch
+                    unlockShared();
+                } else {
+                    completer();
+                }
+            }
+        }
+    }
+
+    std::string mTag;
+
+    size_t mNumReaders;
+    bool mIsWriting;
+
+    std::deque<Completer> mWaitingReaders;
+    std::deque<Completer> mWaitingWriters;
+};
+
+}
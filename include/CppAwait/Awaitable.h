@@ -26,18 +26,28 @@
 #include "Config.h"
 #include "Coro.h"
 #include "impl/Assert.h"
+#include "impl/Foreach.h"
+#include "misc/Signals.h"
+#include "misc/HybridVector.h"
 #include <memory>
 #include <array>
+#include <vector>
+#include <utility>
+#include <chrono>
 
 namespace ut {
 
 class Awaitable;
 struct AwaitableImpl;
 
+class Completer;
+
 namespace detail
 {
     template <typename F>
     class CallbackWrapper;
+
+    void completeFromHandler(const Completer& completer, std::exception_ptr eptr);
 }
 
 /**
@@ -107,6 +117,14 @@ public:
      */
     void fail(std::exception_ptr eptr) const;
 
+    /**
+     * Restore shared stack of the coroutine holding the awaitable, so that
+     * outputs on its stack may be written. Called by wrap() before the callback.
+     *
+     * Does nothing if expired or if the awaitable isn't on a shared stack.
+     */
+    void restoreStack() const;
+
     /**
      * Wraps a callback function
      *
@@ -131,6 +149,7 @@ private:
     std::weak_ptr<void *> mRef;
 
     friend class Awaitable;
+    friend void detail::completeFromHandler(const Completer& completer, std::exception_ptr eptr);
 };
 
 //
@@ -186,6 +205,12 @@ public:
         }
 
         Awaitable* get() const;
+
+        /** True if operation has failed. Doesn't touch the shell, safe on a swapped out stack. */
+        bool didFail() const;
+
+        /** Exception set on fail. Doesn't touch the shell, safe on a swapped out stack. */
+        std::exception_ptr exception() const;
     };
 
     /** Create an awaitable this way if you intend to take its Completer */
@@ -242,6 +267,15 @@ public:
     /** Add a custom handler to be called when done */
     void then(ut::Action slot);
 
+    /**
+     * Add a custom handler to be called when done
+     * @return  a connection that may be used to remove the handler
+     *
+     * Slightly slower than then(). Use it when the handler may outlive its purpose,
+     * e.g. when many short lived combinators watch the same long lived awaitable.
+     */
+    SignalConnection connectThen(ut::Action slot);
+
     /** Take the completer functor */
     Completer takeCompleter();
 
@@ -294,6 +328,7 @@ private:
 
     friend class Completer;
     friend Awaitable startAsync(std::string tag, Action func, size_t stackSize);
+    friend Awaitable startAsync(std::string tag, Action func, SharedStack& sharedStack);
 };
 
 
@@ -321,9 +356,79 @@ private:
  * ignore it in a catch(...) block.
  *
  * Actions created this way have their completer already taken.
+ *
+ * With Coro::setAdaptiveStacks() enabled, coroutines started with the default
+ * stack size get a stack sized from previous runs with the same tag.
  */
 Awaitable startAsync(std::string tag, Action func, size_t stackSize = Coro::defaultStackSize());
 
+/**
+ * Schedules a function to run asynchronously on a shared stack
+ * @param   tag          awaitable tag
+ * @param   func         coroutine function
+ * @param   sharedStack  stack to run coroutine on, must outlive the awaitable
+ * @return  an awaitable for managing the asyncronous operation
+ *
+ * Same as startAsync() above, except that the coroutine is copied aside while
+ * suspended. Suitable for large numbers of mostly idle coroutines. See SharedStack
+ * for restrictions.
+ */
+Awaitable startAsync(std::string tag, Action func, SharedStack& sharedStack);
+
+
+/**
+ * Yield to the run loop if the current time slice is used up
+ * @return  true if current coroutine has been suspended
+ *
+ * Call it from long CPU bound loops inside a coroutine, e.g. while parsing a large
+ * payload. A time slice starts when the coroutine gets resumed. Once it's over, the
+ * coroutine is rescheduled via ut::schedule() and suspended, so that pending events
+ * and other coroutines get to run first.
+ *
+ * Cheap enough for tight loops: the clock is only read every few calls, see
+ * setTimeSlice(). Does nothing on the master coroutine. Requires a scheduler,
+ * see initScheduler().
+ */
+bool maybeYield();
+
+/**
+ * Configure maybeYield()
+ * @param slice               run time before maybeYield() suspends, default 2 ms
+ * @param callsPerClockCheck  calls to maybeYield() between reading the clock, default 16
+ */
+void setTimeSlice(std::chrono::microseconds slice, size_t callsPerClockCheck = 16);
+
+/** Pool sizes for prewarm() */
+struct PrewarmConfig
+{
+    /** Stacks to preallocate, as (stack size, number of stacks) pairs */
+    std::vector<std::pair<size_t, size_t> > stacks;
+
+    /** Touch all pages of preallocated stacks */
+    bool prefaultStacks;
+
+    /** Number of Awaitable slots to preallocate */
+    size_t numAwaitables;
+
+    /** Number of Completer slots to preallocate */
+    size_t numCompleters;
+
+    PrewarmConfig()
+        : prefaultStacks(true)
+        , numAwaitables(0)
+        , numCompleters(0) { }
+};
+
+/**
+ * Preallocate runtime resources at startup
+ * @param config  how much to preallocate
+ *
+ * Otherwise the first burst of work pays for allocating stacks, growing
+ * the Awaitable pool and page faults. Call from main coroutine before
+ * serving requests.
+ */
+void prewarm(const PrewarmConfig& config);
+
 
 /**
  * @name Awaitable selectors
@@ -452,26 +557,200 @@ typename Collection::iterator awaitAny(Collection& awaitables)
     return completedPos;
 }
 
-/** Compose a collection of awaitables, awaits for all to complete */
+namespace detail
+{
+    // State shared by the handlers of a combinator. Handlers get disconnected
+    // once the combinator is done or destroyed, so that long lived awaitables
+    // don't accumulate stale handlers.
+    //
+    // Connections are kept inline up to MAX_INLINE_CHILDREN, so the state
+    // is the only allocation for small combinators.
+    //
+    struct CombinatorState
+    {
+        static const size_t MAX_INLINE_CHILDREN = 5;
+
+        Completer completer;
+        size_t numPending;
+        HybridVector<SignalConnection, MAX_INLINE_CHILDREN> connections;
+
+        CombinatorState()
+            : numPending(0) { }
+
+        void disconnectAll()
+        {
+            ut_foreach_(auto& connection, connections) {
+                connection.disconnect();
+            }
+            connections.clear();
+        }
+    };
+
+    template <typename Position>
+    struct AnyCombinatorState : CombinatorState
+    {
+        Position *pos;
+    };
+
+    template <typename Collection, typename Position, typename PositionOf>
+    Awaitable asyncAny(Collection& awaitables, Position& pos, PositionOf positionOf)
+    {
+        typedef AnyCombinatorState<Position> State;
+
+        bool havePendingAwts = false;
+        size_t numPending = 0;
+
+        for (auto it = awaitables.begin(); it != awaitables.end(); ++it) {
+            Awaitable *child = selectAwaitable(*it);
+            if (child == nullptr) {
+                continue;
+            }
+            if (child->isDone()) {
+                pos = positionOf(it);
+                return Awaitable::makeCompleted();
+            }
+            havePendingAwts = true;
+            numPending++;
+        }
+
+        if (!havePendingAwts && awaitables.begin() != awaitables.end()) {
+            // only null awaitables
+            pos = positionOf(awaitables.begin());
+            return Awaitable::makeCompleted();
+        }
+
+        Awaitable awt("asyncAny");
+
+        if (!havePendingAwts) {
+            awt.takeCompleter(); // never complete
+            return std::move(awt);
+        }
+
+        auto state = std::make_shared<State>();
+        state->completer = awt.takeCompleter();
+        state->pos = &pos;
+        state->connections.reserve(numPending);
+
+        for (auto it = awaitables.begin(); it != awaitables.end(); ++it) {
+            Awaitable *child = selectAwaitable(*it);
+            if (child == nullptr) {
+                continue;
+            }
+
+            Position childPos = positionOf(it);
+
+            state->connections.push_back(child->connectThen([state, childPos]() {
+                state->disconnectAll();
+
+                if (!state->completer.isExpired()) {
+                    *state->pos = childPos;
+
+                    completeFromHandler(state->completer, std::exception_ptr());
+                }
+            }));
+        }
+
+        // also called if interrupted
+        awt.then([state]() {
+            state->disconnectAll();
+        });
+
+        return std::move(awt);
+    }
+
+    template <typename Iterator>
+    Iterator positionOfIterator(Iterator it)
+    {
+        return it;
+    }
+
+    template <typename Iterator>
+    Awaitable* positionOfElement(Iterator it)
+    {
+        return *it;
+    }
+}
+
+/**
+ * Compose a collection of awaitables, completes when all have completed or one of them fails
+ * @param awaitables  a collection from which awaitables can be selected
+ *
+ * The combinator doesn't run a coroutine, it counts completions from then() handlers.
+ * Awaitables are selected right away, the collection may go out of scope afterwards.
+ * The awaitables themselves must outlive the combinator.
+ *
+ * Allocates one block for up to 5 pending awaitables. Larger collections allocate
+ * their list of handler connections separately.
+ */
 template <typename Collection>
 Awaitable asyncAll(Collection& awaitables)
 {
-    return startAsync("asyncAll", [&awaitables]() {
-        awaitAll(awaitables);
+    auto state = std::make_shared<detail::CombinatorState>();
+
+    for (auto it = awaitables.begin(); it != awaitables.end(); ++it) {
+        Awaitable *child = selectAwaitable(*it);
+        if (child == nullptr || child->didComplete()) {
+            continue;
+        }
+        if (child->didFail()) {
+            return Awaitable::makeFailed(child->exception());
+        }
+        state->numPending++;
+    }
+
+    if (state->numPending == 0) {
+        return Awaitable::makeCompleted();
+    }
+
+    Awaitable awt("asyncAll");
+    state->completer = awt.takeCompleter();
+    state->connections.reserve(state->numPending);
+
+    for (auto it = awaitables.begin(); it != awaitables.end(); ++it) {
+        Awaitable *child = selectAwaitable(*it);
+        if (child == nullptr || child->isDone()) {
+            continue;
+        }
+
+        Awaitable::Pointer childPtr = child->pointer();
+
+        state->connections.push_back(child->connectThen([state, childPtr]() {
+            if (state->completer.isExpired()) {
+                return;
+            }
+
+            if (childPtr.didFail()) {
+                state->disconnectAll();
+                detail::completeFromHandler(state->completer, childPtr.exception());
+            } else if (--state->numPending == 0) {
+                state->disconnectAll();
+                detail::completeFromHandler(state->completer, std::exception_ptr());
+            }
+        }));
+    }
+
+    // also called if interrupted
+    awt.then([state]() {
+        state->disconnectAll();
     });
+
+    return std::move(awt);
 }
 
-/** Compose a collection of awaitables, awaits for any to complete */
+/**
+ * Compose a collection of awaitables, completes when any of them is done
+ * @param awaitables  a collection from which awaitables can be selected
+ * @param pos         set to the first awaitable that is done
+ *
+ * Like asyncAll(), the combinator runs no coroutine. If an awaitable fails the
+ * exception is not propagated. An empty collection never completes, a collection
+ * of null awaitables completes right away with pos set to its beginning.
+ */
 template <typename Collection>
 Awaitable asyncAny(Collection& awaitables, typename Collection::iterator& pos)
 {
-    return startAsync("asyncAny", [&awaitables, &pos]() {
-        if (awaitables.empty()) {
-            yieldTo(masterCoro()); // never complete
-        } else {
-            pos = awaitAny(awaitables);
-        }
-    });
+    return detail::asyncAny(awaitables, pos,
+        &detail::positionOfIterator<typename Collection::iterator>);
 }
 
 // convenience overloads
@@ -600,6 +879,66 @@ inline Awaitable* awaitAny(Awaitable& awt1, Awaitable& awt2, Awaitable& awt3, Aw
     return *awaitAny(awts);
 }
 
+/** Compose awaitables, completes when all have completed or one of them fails */
+inline Awaitable asyncAll(Awaitable& awt1, Awaitable& awt2)
+{
+    std::array<Awaitable*, 2> awts = {{ &awt1, &awt2 }};
+    return asyncAll(awts);
+}
+
+/** Compose awaitables, completes when all have completed or one of them fails */
+inline Awaitable asyncAll(Awaitable& awt1, Awaitable& awt2, Awaitable& awt3)
+{
+    std::array<Awaitable*, 3> awts = {{ &awt1, &awt2, &awt3 }};
+    return asyncAll(awts);
+}
+
+/** Compose awaitables, completes when all have completed or one of them fails */
+inline Awaitable asyncAll(Awaitable& awt1, Awaitable& awt2, Awaitable& awt3, Awaitable& awt4)
+{
+    std::array<Awaitable*, 4> awts = {{ &awt1, &awt2, &awt3, &awt4 }};
+    return asyncAll(awts);
+}
+
+/** Compose awaitables, completes when all have completed or one of them fails */
+inline Awaitable asyncAll(Awaitable& awt1, Awaitable& awt2, Awaitable& awt3, Awaitable& awt4, Awaitable& awt5)
+{
+    std::array<Awaitable*, 5> awts = {{ &awt1, &awt2, &awt3, &awt4, &awt5 }};
+    return asyncAll(awts);
+}
+
+/** Compose awaitables, completes when any of them is done */
+inline Awaitable asyncAny(Awaitable& awt1, Awaitable& awt2, Awaitable*& done)
+{
+    std::array<Awaitable*, 2> awts = {{ &awt1, &awt2 }};
+    return detail::asyncAny(awts, done,
+        &detail::positionOfElement<std::array<Awaitable*, 2>::iterator>);
+}
+
+/** Compose awaitables, completes when any of them is done */
+inline Awaitable asyncAny(Awaitable& awt1, Awaitable& awt2, Awaitable& awt3, Awaitable*& done)
+{
+    std::array<Awaitable*, 3> awts = {{ &awt1, &awt2, &awt3 }};
+    return detail::asyncAny(awts, done,
+        &detail::positionOfElement<std::array<Awaitable*, 3>::iterator>);
+}
+
+/** Compose awaitables, completes when any of them is done */
+inline Awaitable asyncAny(Awaitable& awt1, Awaitable& awt2, Awaitable& awt3, Awaitable& awt4, Awaitable*& done)
+{
+    std::array<Awaitable*, 4> awts = {{ &awt1, &awt2, &awt3, &awt4 }};
+    return detail::asyncAny(awts, done,
+        &detail::positionOfElement<std::array<Awaitable*, 4>::iterator>);
+}
+
+/** Compose awaitables, completes when any of them is done */
+inline Awaitable asyncAny(Awaitable& awt1, Awaitable& awt2, Awaitable& awt3, Awaitable& awt4, Awaitable& awt5, Awaitable*& done)
+{
+    std::array<Awaitable*, 5> awts = {{ &awt1, &awt2, &awt3, &awt4, &awt5 }};
+    return detail::asyncAny(awts, done,
+        &detail::positionOfElement<std::array<Awaitable*, 5>::iterator>);
+}
+
 //
 // impl
 //
@@ -648,6 +987,7 @@ namespace detail
 
     #define UT_CALLBACK_WRAPPER_IMPL(...) \
         if (!mCompleter.isExpired()) { \
+            mCompleter.restoreStack(); \
             std::exception_ptr eptr = mCallback(__VA_ARGS__); \
             \
             if (is(eptr)) { \
@@ -0,0 +1,218 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * @file  BroadcastRing.h
+ *
+ * Declares the BroadcastRing class.
+ *
+ */
+
+#pragma once
+
+#include "Config.h"
+#include "Condition.h"
+#include "impl/Assert.h"
+#include <vector>
+#include <cstdint>
+
+namespace ut {
+
+/**
+ * Single producer, multiple consumer broadcast channel
+ *
+ * The producer publishes into a fixed size ring. Each consumer reads through its
+ * own Cursor, so messages are stored once no matter how many consumers there are.
+ * The producer never waits: once the ring is full the oldest message gets
+ * overwritten. A consumer that falls more than capacity() messages behind detects
+ * the overrun on its next read and resumes from the oldest message still in ring.
+ *
+ * Waiting consumers are woken by flush(). Publish a burst of messages, then
+ * flush once to wake everybody in one batch:
+ *
+ *     ring.publish(quote1);
+ *     ring.publish(quote2);
+ *     ring.flush();
+ *
+ *     // consumer coroutine
+ *     BroadcastRing<Quote>::Cursor cursor(ring);
+ *     while (true) {
+ *         cursor.asyncWait().await();
+ *         while (const Quote *quote = cursor.tryRead()) {
+ *             ...
+ *         }
+ *     }
+ *
+ * @warning Not thread safe. BroadcastRings are designed for single-threaded use.
+ */
+template <typename T>
+class BroadcastRing
+{
+public:
+    /** Monotonic message number */
+    typedef uint64_t Sequence;
+
+    /** Independent read position of a consumer */
+    class Cursor
+    {
+    public:
+        /** Create a cursor that reads messages published from now on */
+        explicit Cursor(BroadcastRing<T>& ring)
+            : mRing(&ring)
+            , mNext(ring.head())
+            , mNumLost(0) { }
+
+        /** Sequence of next message to read */
+        Sequence position() const
+        {
+            return mNext;
+        }
+
+        /** Number of messages skipped because of overruns */
+        size_t numLost() const
+        {
+            return mNumLost;
+        }
+
+        /** True if there are messages to read (possibly after an overrun) */
+        bool hasNext() const
+        {
+            return mNext < mRing->head();
+        }
+
+        /**
+         * Read next message without waiting
+         * @return  message, or nullptr if cursor has caught up with producer
+         *
+         * The message lives in the ring and is not copied. It remains valid until
+         * the producer overwrites it, so don't hold on to it across a yield.
+         *
+         * If the producer has lapped the cursor, it skips to the oldest message
+         * in ring. Skipped messages are added to numLost().
+         */
+        const T* tryRead()
+        {
+            if (mNext < mRing->tail()) {
+                mNumLost += (size_t) (mRing->tail() - mNext);
+                mNext = mRing->tail();
+            }
+
+            if (mNext == mRing->head()) {
+                return nullptr;
+            }
+
+            return &mRing->at(mNext++);
+        }
+
+        /** Skip to the oldest message in ring */
+        void seekOldest()
+        {
+            mNext = mRing->tail();
+        }
+
+        /** Skip all messages in ring */
+        void seekNewest()
+        {
+            mNext = mRing->head();
+        }
+
+        /**
+         * Wait until there is something to read
+         * @return  an awaitable that completes once hasNext(), immediately if already so
+         */
+        Awaitable asyncWait()
+        {
+            if (hasNext()) {
+                return Awaitable::makeCompleted();
+            } else {
+                return mRing->mCondFlushed.asyncWait();
+            }
+        }
+
+    private:
+        BroadcastRing<T> *mRing;
+        Sequence mNext;
+        size_t mNumLost;
+    };
+
+    /** Construct a ring holding up to capacity messages */
+    explicit BroadcastRing(size_t capacity, std::string tag = std::string())
+        : mSlots(capacity)
+        , mHead(0)
+        , mCondFlushed(std::move(tag))
+    {
+        ut_assert_(capacity > 0);
+    }
+
+    /** Identifier for debugging */
+    const char* tag()
+    {
+        return mCondFlushed.tag();
+    }
+
+    /** Max number of messages kept */
+    size_t capacity() const
+    {
+        return mSlots.size();
+    }
+
+    /** Sequence of next message to be published */
+    Sequence head() const
+    {
+        return mHead;
+    }
+
+    /** Sequence of oldest message still in ring */
+    Sequence tail() const
+    {
+        return (mHead > mSlots.size() ? mHead - mSlots.size() : 0);
+    }
+
+    /**
+     * Publish a message, overwriting the oldest one if ring is full
+     *
+     * Doesn't wake consumers, call flush() when done publishing.
+     */
+    void publish(T value)
+    {
+        mSlots[(size_t) (mHead % mSlots.size())] = std::move(value);
+        mHead++;
+    }
+
+    /** Wake all waiting consumers */
+    void flush()
+    {
+        mCondFlushed.notifyAll();
+    }
+
+private:
+    BroadcastRing(const BroadcastRing<T>&); // noncopyable
+    BroadcastRing<T>& operator=(const BroadcastRing<T>&); // noncopyable
+
+    const T& at(Sequence seq) const
+    {
+        ut_assert_(seq >= tail() && seq < head());
+
+        return mSlots[(size_t) (seq % mSlots.size())];
+    }
+
+    std::vector<T> mSlots;
+    Sequence mHead;
+
+    Condition mCondFlushed;
+};
+
+}
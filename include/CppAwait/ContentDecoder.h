@@ -0,0 +1,110 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * @file  ContentDecoder.h
+ *
+ * Declares the ContentDecoder class.
+ *
+ */
+
+#pragma once
+
+#include "Config.h"
+#include <string>
+#include <memory>
+
+namespace ut {
+
+/**
+ * Incremental decoder for HTTP Content-Encoding
+ *
+ * Input may be fed in pieces of any size as it arrives, output is produced into
+ * a caller supplied buffer. Decoding gzip and deflate requires zlib (HAVE_ZLIB),
+ * without it only identity is supported.
+ *
+ *     ContentDecoder decoder(ContentDecoder::ENCODING_GZIP);
+ *
+ *     while (size > 0) {
+ *         size_t n = decoder.decode(data, size, out, sizeof(out));
+ *         ...
+ *     }
+ *
+ * Corrupt input throws std::runtime_error.
+ *
+ * @warning Not thread safe. May be handed over between threads while not in use.
+ */
+class ContentDecoder
+{
+public:
+    enum Encoding
+    {
+        ENCODING_IDENTITY,
+        ENCODING_GZIP,
+        ENCODING_DEFLATE
+    };
+
+    /** True if encoding can be decoded in this build */
+    static bool isSupported(Encoding encoding);
+
+    /**
+     * Parse a Content-Encoding value
+     * @return  false if encoding is unknown or not supported
+     */
+    static bool parseEncoding(const std::string& value, Encoding& outEncoding);
+
+    /** Value for Accept-Encoding header, lists supported encodings */
+    static const char* acceptEncoding();
+
+    /** Construct a decoder, encoding must be supported */
+    explicit ContentDecoder(Encoding encoding);
+
+    ~ContentDecoder();
+
+    /** Content encoding */
+    Encoding encoding() const;
+
+    /**
+     * Decode some input
+     * @param ioData    input, advanced past consumed bytes
+     * @param ioSize    input size, decreased by consumed bytes
+     * @param out       output buffer
+     * @param outSize   output buffer size
+     * @return  number of bytes written to out
+     *
+     * Stops when input is consumed or output is full. If output is full, call again
+     * to flush pending output even if there is no more input.
+     */
+    size_t decode(const char *&ioData, size_t& ioSize, char *out, size_t outSize);
+
+    /** True once end of encoded stream has been decoded, trailing input is ignored */
+    bool isFinished() const;
+
+    /** Total number of bytes consumed */
+    size_t numBytesIn() const;
+
+    /** Total number of bytes produced */
+    size_t numBytesOut() const;
+
+private:
+    ContentDecoder(const ContentDecoder&); // noncopyable
+    ContentDecoder& operator=(const ContentDecoder&); // noncopyable
+
+    struct Impl;
+    std::unique_ptr<Impl> m;
+};
+
+}
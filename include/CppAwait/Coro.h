@@ -27,11 +27,16 @@
 #include "misc/Functional.h"
 #include "impl/Compatibility.h"
 #include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
 #include <stdexcept>
 
 /** CppAwait namespace */
 namespace ut {
 
+class SharedStack;
+
 /**
  * Basic coroutine abstraction
  *
@@ -58,6 +63,10 @@ namespace ut {
  * adjusting the default stack size, which is platform dependent. Note that actual stack usage
  * varies -- debug builds usually need larger stacks.
  *
+ * Alternatively, several coroutines may run on a SharedStack. Only the portion of stack actually
+ * in use gets copied aside when another coroutine needs the shared stack, so a suspended coroutine
+ * costs no more than its live frames. See SharedStack for restrictions.
+ *
  * Coros can be tagged to ease debugging.
  *
  * @warning Not thread safe. Coroutines are designed for single-threaded use.
@@ -91,6 +100,103 @@ public:
     /** Discard cached stack buffers */
     static void drainStackPool();
 
+    /**
+     * Preallocate stacks so that coroutines started later don't have to
+     * @param stackSize  size of stacks
+     * @param numStacks  number of stacks of this size the pool should hold
+     * @param prefault   touch all stack pages to avoid page faults on first use
+     */
+    static void reserveStacks(size_t stackSize, size_t numStacks, bool prefault = true);
+
+    /**
+     * Carve new stacks out of 2MB regions backed by huge pages
+     *
+     * Reduces TLB misses when switching among many coroutines. Regions use
+     * MAP_HUGETLB if huge pages have been reserved, otherwise they request
+     * transparent huge pages. Stacks are separated by guard gaps. Larger
+     * stacks than a region are allocated as usual.
+     *
+     * Only supported on Linux, ignored elsewhere. Carved stacks are never
+     * released by drainStackPool().
+     */
+    static void setHugePageStacks(bool enabled);
+
+    /**
+     * Learn stack size per tag
+     *
+     * Coroutines requesting the default stack size get profiled during their first
+     * runs: the stack is painted with a known pattern and the high water mark is
+     * recorded when the coroutine gets destroyed. After numWarmupRuns the smallest
+     * size class that fits the peak with some headroom is picked for the tag.
+     * Later coroutines with that tag receive stacks of this size with a guard page
+     * below, so an unexpectedly deep call chain faults instead of corrupting memory.
+     *
+     * Tags should be stable (e.g. not contain ids) for profiles to be shared.
+     */
+    static void setAdaptiveStacks(bool enabled, size_t numWarmupRuns = 8);
+
+    /** Returns stack size learned for tag, or 0 while warming up */
+    static size_t adaptiveStackSize(const std::string& tag);
+
+    /** Stack pool statistics */
+    struct StackPoolStats
+    {
+        /** Stacks cached for reuse */
+        size_t numPooledStacks;
+
+        /** Huge page regions reserved */
+        size_t numRegions;
+
+        /** Regions backed by MAP_HUGETLB */
+        size_t numHugeTlbRegions;
+
+        /** Regions with transparent huge pages requested */
+        size_t numTransparentHugeRegions;
+
+        /** Stacks carved out of regions */
+        size_t numCarvedStacks;
+
+        /** Bytes reserved for regions */
+        size_t regionBytes;
+
+        /** Bytes carved out of regions, including guard gaps */
+        size_t carvedBytes;
+    };
+
+    /** Returns stack pool statistics */
+    static StackPoolStats stackPoolStats();
+
+    /**
+     * Track CPU time per coroutine and per tag
+     *
+     * On every switch the time since the previous switch is charged to the
+     * coroutine being suspended. Time is read from the CPU cycle counter where
+     * available, otherwise from a steady clock. Note that the main coroutine
+     * gets charged for time spent blocked in the run loop.
+     *
+     * Tags should be stable (e.g. not contain ids) for per tag totals to add up.
+     */
+    static void setCpuAccounting(bool enabled);
+
+    /** CPU accounting statistics */
+    struct CpuStats
+    {
+        /** Time spent running */
+        std::chrono::nanoseconds cpuTime;
+
+        /** Longest run between two switches */
+        std::chrono::nanoseconds maxSlice;
+
+        /** Number of times resumed */
+        size_t numResumes;
+    };
+
+    /** Returns CPU accounting statistics of all tags, most expensive first */
+    static std::vector<std::pair<std::string, CpuStats> > cpuStatsByTag();
+
+    /** Zero per tag CPU accounting statistics */
+    static void resetCpuStats();
+
     /**
      * Create and initialize a coroutine
      * @param tag        identifier for debugging
@@ -106,6 +212,21 @@ public:
      */
     Coro(std::string tag, size_t stackSize = defaultStackSize());
 
+    /**
+     * Create and initialize a coroutine running on a shared stack
+     * @param tag          identifier for debugging
+     * @param func         coroutine body, may yield()
+     * @param sharedStack  stack to run on, must outlive coroutine
+     */
+    Coro(std::string tag, Func func, SharedStack& sharedStack);
+
+    /**
+     * Create a coroutine running on a shared stack
+     * @param tag          identifier for debugging
+     * @param sharedStack  stack to run on, must outlive coroutine
+     */
+    Coro(std::string tag, SharedStack& sharedStack);
+
     /** Destroy coroutine. It is illegal to call the destructor of a running coroutine */
     ~Coro();
 
@@ -181,6 +302,22 @@ public:
     /** Set parent coroutine */
     void setParent(Coro *coro);
 
+    /** Returns the shared stack, or nullptr if coroutine owns its stack */
+    SharedStack* sharedStack();
+
+    /** Returns CPU accounting statistics of this coroutine, see setCpuAccounting() */
+    CpuStats cpuStats();
+
+    /**
+     * Copy stack contents back onto the shared stack, making locals of this coroutine
+     * addressable while it is suspended. The coroutine currently occupying the shared
+     * stack gets copied aside.
+     *
+     * Does nothing if coroutine owns its stack. May not be called from a coroutine
+     * running on the same shared stack.
+     */
+    void restoreStack();
+
 private:
     enum YieldType
     {
@@ -201,19 +338,74 @@ private:
 
     static void fcontextFunc(intptr_t data);
 
+    static void swapperFunc(intptr_t data);
+
     Coro();
     Coro(const Coro& other); // noncopyable
     Coro& operator=(const Coro& other); // noncopyable
 
     void clear();
 
+    void obtainStack(size_t stackSize);
+
     void* implYieldTo(Coro *resumeCoro, YieldType type, void *value);
     void* unpackYieldValue(const YieldValue& yReceived);
 
     struct Impl;
     Impl *m;
 
+    static void reserveSavedStack(Impl *impl, size_t size);
+    static void saveStack(Impl *impl);
+    static void loadStack(Impl *impl);
+
     friend void initCoroLib();
+    friend class SharedStack;
+};
+
+/**
+ * Execution stack shared by several coroutines
+ *
+ * A coroutine running on a SharedStack is copied aside only when some other coroutine
+ * needs the stack. The copy is sized to the frames actually in use, so many suspended
+ * coroutines can be kept at a fraction of the memory needed for dedicated stacks. The
+ * price is a memcpy on switching between coroutines of the same SharedStack.
+ *
+ * While copied aside, the locals of a coroutine live at a different address. Don't let
+ * other coroutines hold pointers into the stack of a suspended shared-stack coroutine.
+ * Awaitables take care of this for their own outputs -- the awaiting coroutine's stack
+ * gets restored before callbacks write results (see Coro::restoreStack).
+ *
+ * @warning Not thread safe. SharedStacks are designed for single-threaded use.
+ */
+class SharedStack
+{
+public:
+    /**
+     * Create a shared stack
+     * @param stackSize  size of stack, must fit the deepest coroutine
+     */
+    explicit SharedStack(size_t stackSize = Coro::defaultStackSize());
+
+    /** Destroy stack. All coroutines using it must be destroyed first. */
+    ~SharedStack();
+
+    /** Size of stack */
+    size_t stackSize();
+
+    /** Number of coroutines using the stack */
+    size_t numCoros();
+
+    /** Check if address is within stack bounds */
+    bool contains(const void *address);
+
+private:
+    SharedStack(const SharedStack& other); // noncopyable
+    SharedStack& operator=(const SharedStack& other); // noncopyable
+
+    struct Impl;
+    Impl *m;
+
+    friend class Coro;
 };
 
 
@@ -236,6 +428,9 @@ Coro* currentCoro();
 /** Returns the master coroutine */
 Coro* masterCoro();
 
+/** Number of coroutine switches so far. Changes whenever some coroutine is resumed. */
+uint64_t switchCount();
+
 /** Temporarily makes current coroutine the master */
 class PushMasterCoro
 {
@@ -0,0 +1,159 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * @file  HttpCache.h
+ *
+ * Declares the HttpCache class.
+ *
+ */
+
+#pragma once
+
+#include "Config.h"
+#include "AsioWrappers.h"
+#include "SharedAwaitable.h"
+#include <list>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <unordered_map>
+
+namespace ut { namespace asio {
+
+/**
+ * Client side cache for HTTP GET
+ *
+ * Responses are kept by host + path for as long as Cache-Control max-age allows.
+ * Once stale, an entry with an ETag or Last-Modified gets revalidated with a
+ * conditional request; a 304 response refreshes the entry without transferring
+ * the body again. Responses marked no-store are not kept, no-cache ones are
+ * revalidated on every use.
+ *
+ * Concurrent requests for the same resource share a single fetch. Bodies are
+ * immutable and reference counted, callers share them with the cache without copies.
+ *
+ *     HttpCache cache(io);
+ *
+ *     HttpCache::Body body;
+ *     cache.asyncGet("example.com", "/index.html", body).await();
+ *
+ * Each fetch opens its own connection. Chunked responses are not supported.
+ * Least recently used entries get evicted beyond maxEntries.
+ *
+ * @warning Not thread safe. HttpCaches are designed for single-threaded use.
+ */
+class HttpCache
+{
+public:
+    /** Response body, shared between cache and callers */
+    typedef std::shared_ptr<const std::string> Body;
+
+    /** Cache metrics */
+    struct Stats
+    {
+        /** Requests served from a fresh entry */
+        size_t numHits;
+
+        /** Requests that fetched a resource not in cache */
+        size_t numMisses;
+
+        /** Requests that revalidated a stale entry */
+        size_t numRevalidations;
+
+        /** Revalidations answered with 304 Not Modified */
+        size_t numNotModified;
+
+        /** Requests that joined a fetch already in progress */
+        size_t numCoalesced;
+
+        Stats()
+            : numHits(0)
+            , numMisses(0)
+            , numRevalidations(0)
+            , numNotModified(0)
+            , numCoalesced(0) { }
+    };
+
+    /**
+     * Construct an empty cache
+     * @param io          io_service that runs fetches
+     * @param maxEntries  max number of resources kept
+     */
+    explicit HttpCache(boost::asio::io_service& io, size_t maxEntries = 256);
+
+    /** Interrupts pending fetches */
+    ~HttpCache();
+
+    /**
+     * Get a resource over HTTP, through the cache
+     * @param host      HTTP host
+     * @param path      resource path
+     * @param outBody   receives the body, must be valid until awaitable done
+     * @return  an awaitable that completes once outBody is set, immediately on a fresh hit
+     */
+    Awaitable asyncGet(const std::string& host, const std::string& path, Body& outBody);
+
+    /** Drop all entries, interrupts pending fetches */
+    void clear();
+
+    /** Number of entries */
+    size_t size() const;
+
+    /** Returns cache metrics */
+    const Stats& stats() const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+    typedef SharedAwaitable<bool> Fetch; // completion only, result goes to fetchResult
+
+    struct Entry
+    {
+        Body body;
+        std::string etag;
+        std::string lastModified;
+        Clock::time_point expiresAt;
+
+        // last fetch, shared by concurrent requests
+        std::shared_ptr<Fetch> fetch;
+        std::shared_ptr<Body> fetchResult;
+
+        std::list<std::string>::iterator lruPos;
+    };
+
+    HttpCache(const HttpCache&); // noncopyable
+    HttpCache& operator=(const HttpCache&); // noncopyable
+
+    Awaitable asyncJoin(const Entry& entry, Body& outBody);
+
+    void startFetch(const std::string& key, Entry& entry, const std::string& host, const std::string& path);
+
+    void doFetch(const std::string& key, const std::string& host, const std::string& path,
+        Body cachedBody, const std::string& etag, const std::string& lastModified, Body& outBody);
+
+    void evict();
+
+    void eraseAfterFetch(const std::string& key, const Entry& entry);
+
+    boost::asio::io_service& mIo;
+    size_t mMaxEntries;
+
+    std::unordered_map<std::string, Entry> mEntries;
+    std::list<std::string> mLru; // most recent first
+    Stats mStats;
+};
+
+} }
@@ -0,0 +1,344 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * @file  Pipeline.h
+ *
+ * Declares the PipelineStage class.
+ *
+ */
+
+#pragma once
+
+#include "Config.h"
+#include "WorkerPool.h"
+#include "Condition.h"
+#include "impl/Assert.h"
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <type_traits>
+
+namespace ut {
+
+namespace detail {
+
+    template <typename Out>
+    struct PipelineSink
+    {
+        typedef std::function<Awaitable (Out& item)> type;
+    };
+
+    template <>
+    struct PipelineSink<void>
+    {
+        typedef std::function<Awaitable ()> type;
+    };
+}
+
+/**
+ * Stage of a processing pipeline
+ *
+ * A stage takes items of type In from its bounded input queue, runs the handler on
+ * them and passes the results on to the next stage. Each stage has its own number
+ * of worker coroutines, so a slow stage can be scaled independently. The handler
+ * may await -- for CPU bound work, offload to a thread pool (see asio::asyncOffload()).
+ *
+ * Back-pressure works end to end: a worker waits for room in the next stage
+ * before taking another item, so a full queue downstream stalls the stages above
+ * it and eventually asyncPush() on the first stage.
+ *
+ *     // declared from last to first, upstream stages must be destroyed first
+ *     PipelineStage<std::string> send("send", sendLine, 4);
+ *     PipelineStage<Message, std::string> serialize("serialize", toLine, 1);
+ *     PipelineStage<std::string, Message> parse("parse", fromLine, 2, 64);
+ *
+ *     parse.connectTo(serialize);
+ *     serialize.connectTo(send);
+ *
+ *     parse.asyncPush(line).await();
+ *
+ * Items that fail in the handler are dropped and counted in Stats. To flush the
+ * pipeline, await asyncDrained() on each stage in order. A stage that is drained
+ * has handed all its items downstream.
+ *
+ * Finding the bottleneck: the slowest stage runs at high utilization() while the
+ * stages above it accumulate blocked time waiting for its queue.
+ *
+ * @warning Not thread safe. PipelineStages are designed for single-threaded use.
+ */
+template <typename In, typename Out = void>
+class PipelineStage
+{
+public:
+    /** Item handler, runs inside a worker coroutine */
+    typedef std::function<Out (In& item)> Handler;
+
+    /** Receives handler output, the stage waits for the returned awaitable */
+    typedef typename detail::PipelineSink<Out>::type Sink;
+
+    /** Stage metrics */
+    struct Stats
+    {
+        /** Items handled, including failed ones */
+        size_t numProcessed;
+
+        /** Items whose handler has thrown */
+        size_t numFailed;
+
+        /** Largest input queue depth seen */
+        size_t maxQueueDepth;
+
+        /** Total time items have waited in input queue */
+        std::chrono::microseconds totalQueueTime;
+
+        /** Longest time an item has waited in input queue */
+        std::chrono::microseconds maxQueueTime;
+
+        /** Total time spent in handler */
+        std::chrono::microseconds totalServiceTime;
+
+        /** Total time spent waiting for the next stage to accept output */
+        std::chrono::microseconds totalBlockedTime;
+
+        Stats()
+            : numProcessed(0)
+            , numFailed(0)
+            , maxQueueDepth(0)
+            , totalQueueTime(0)
+            , maxQueueTime(0)
+            , totalServiceTime(0)
+            , totalBlockedTime(0) { }
+    };
+
+    /**
+     * Construct a stage and start its workers
+     * @param tag           identifier for debugging
+     * @param handler       called for each item
+     * @param concurrency   number of worker coroutines
+     * @param queueSize     input queue capacity
+     * @param stackSize     stack size of workers
+     */
+    PipelineStage(std::string tag, Handler handler, size_t concurrency = 1,
+            size_t queueSize = 1, size_t stackSize = Coro::defaultStackSize())
+        : mHandler(std::move(handler))
+        , mConcurrency(concurrency)
+        , mNumBusy(0)
+        , mStartTime(Clock::now())
+        , mCondDrained(tag)
+        , mPool(std::move(tag), [this](In& item) { handle(item); },
+                concurrency, concurrency, queueSize, stackSize) { }
+
+    /** Identifier for debugging */
+    const char* tag()
+    {
+        return mPool.tag();
+    }
+
+    /** Number of worker coroutines */
+    size_t concurrency() const
+    {
+        return mConcurrency;
+    }
+
+    /**
+     * Send output to next stage
+     * @param next  stage taking Out as input, must outlive this stage
+     */
+    template <typename Next>
+    void connectTo(PipelineStage<Out, Next>& next)
+    {
+        static_assert(!std::is_void<Out>::value, "stage has no output");
+
+        PipelineStage<Out, Next> *nextStage = &next;
+
+        setSink([nextStage](Out& item) -> Awaitable {
+            return nextStage->asyncPush(std::move(item));
+        });
+    }
+
+    /**
+     * Send output to an arbitrary consumer
+     * @param sink  returns an awaitable that completes once output has been accepted
+     *
+     * Useful for fan-out or for feeding a BoundedQueue.
+     */
+    void setSink(Sink sink)
+    {
+        ut_assert_(!mSink && "stage already connected");
+
+        mSink = std::move(sink);
+    }
+
+    /**
+     * Queue an item for this stage
+     * @param   item    item to handle
+     * @return  an awaitable that completes after item has been queued
+     */
+    Awaitable asyncPush(In item)
+    {
+        return mPool.asyncPush(std::move(item));
+    }
+
+    /** True if input queue is empty and no item is being handled */
+    bool isDrained() const
+    {
+        return mNumBusy == 0 && mPool.queueDepth() == 0;
+    }
+
+    /**
+     * Wait until stage is drained
+     * @return  an awaitable that completes once isDrained(), immediately if already so
+     */
+    Awaitable asyncDrained()
+    {
+        if (isDrained()) {
+            return Awaitable::makeCompleted();
+        } else {
+            return mCondDrained.asyncWait();
+        }
+    }
+
+    /** Number of queued items */
+    size_t queueDepth() const
+    {
+        return mPool.queueDepth();
+    }
+
+    /** Returns stage metrics */
+    Stats stats() const
+    {
+        const typename WorkerPool<In>::Stats& poolStats = mPool.stats();
+
+        Stats stats = mStats;
+        stats.numProcessed = poolStats.numProcessed;
+        stats.numFailed = poolStats.numFailed;
+        stats.maxQueueDepth = poolStats.maxQueueDepth;
+        stats.totalQueueTime = poolStats.totalLatency;
+        stats.maxQueueTime = poolStats.maxLatency;
+
+        return stats;
+    }
+
+    /** Items handled per second since stage was created */
+    double throughput() const
+    {
+        double elapsed = elapsedMicroseconds();
+
+        if (elapsed <= 0) {
+            return 0;
+        }
+
+        return mPool.stats().numProcessed * 1e6 / elapsed;
+    }
+
+    /** Fraction of worker time spent in handler since stage was created */
+    double utilization() const
+    {
+        double elapsed = elapsedMicroseconds();
+
+        if (elapsed <= 0) {
+            return 0;
+        }
+
+        return mStats.totalServiceTime.count() / (elapsed * mConcurrency);
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    PipelineStage(const PipelineStage<In, Out>&); // noncopyable
+    PipelineStage<In, Out>& operator=(const PipelineStage<In, Out>&); // noncopyable
+
+    static std::chrono::microseconds since(Clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+    }
+
+    double elapsedMicroseconds() const
+    {
+        return (double) since(mStartTime).count();
+    }
+
+    void handle(In& item)
+    {
+        mNumBusy++;
+
+        std::exception_ptr eptr;
+
+        try {
+            process(item, std::is_void<Out>());
+        } catch (const ForcedUnwind&) {
+            mNumBusy--;
+            throw;
+        } catch (...) {
+            // [MSVC] may not yield from catch block, notify after leaving it
+            eptr = std::current_exception();
+        }
+
+        finishItem();
+
+        if (is(eptr)) {
+            std::rethrow_exception(eptr); // counted by pool
+        }
+    }
+
+    // intermediate stage
+    void process(In& item, std::false_type)
+    {
+        ut_assert_(mSink && "stage not connected");
+
+        Clock::time_point start = Clock::now();
+        Out output = mHandler(item);
+        mStats.totalServiceTime += since(start);
+
+        start = Clock::now();
+        mSink(output).await();
+        mStats.totalBlockedTime += since(start);
+    }
+
+    // last stage
+    void process(In& item, std::true_type)
+    {
+        Clock::time_point start = Clock::now();
+        mHandler(item);
+        mStats.totalServiceTime += since(start);
+    }
+
+    void finishItem()
+    {
+        mNumBusy--;
+
+        if (isDrained()) {
+            mCondDrained.notifyAll();
+        }
+    }
+
+    Handler mHandler;
+    Sink mSink;
+    size_t mConcurrency;
+
+    size_t mNumBusy;
+    Stats mStats;
+    Clock::time_point mStartTime;
+
+    Condition mCondDrained;
+
+    // declared last, workers get interrupted first
+    WorkerPool<In> mPool;
+};
+
+}
@@ -0,0 +1,91 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * @file  Profiler.h
+ *
+ * Declares a coroutine aware sampling profiler.
+ *
+ */
+
+#pragma once
+
+#include "Config.h"
+#include <ostream>
+#include <string>
+
+namespace ut {
+
+/**
+ * Start sampling the current thread
+ * @param samplesPerSecond  sampling frequency, measured in CPU time. The actual
+ *                          rate may be capped by the kernel timer resolution.
+ * @param maxSamples        samples kept, later ones are dropped
+ * @return  false if profiling is not supported on this platform
+ *
+ * Native profilers lose track of coroutines: once a coroutine switches stacks,
+ * samples no longer lead back to where it was started. This profiler records
+ * along with each native stack the spawn chain of the running coroutine -- its
+ * tag prefixed by the tags of the coroutines that started it. Output is in the
+ * folded stack format of flamegraph.pl, so flame graphs follow async structure.
+ *
+ * Samples are taken on SIGPROF. Only the thread calling startProfiler() gets
+ * sampled, it should be the one running your coroutines. On Linux the timer
+ * counts CPU time of that thread alone and signals only that thread. On OS X
+ * the timer is process wide, signals landing on other threads are counted as
+ * dropped. Available on POSIX systems with glibc or on OS X.
+ *
+ * Coroutines started while profiling know their full spawn chain. Those started
+ * earlier only have their own tag. Tags should be stable (e.g. not contain ids).
+ * Distinct spawn chains are remembered while profiling, and for as long as
+ * samples refer to them.
+ *
+ * @warning backtrace() is not async-signal-safe. startProfiler() loads the unwinder
+ *          up front so that sampling doesn't allocate, but a sample taken while
+ *          the thread holds the dynamic loader lock (e.g. inside dlopen) may
+ *          deadlock. Avoid loading libraries while profiling.
+ */
+bool startProfiler(int samplesPerSecond = 997, size_t maxSamples = 20000);
+
+/** Stop sampling and spawn chain tracking, samples are kept until resetProfiler() */
+void stopProfiler();
+
+/** True between startProfiler() and stopProfiler() */
+bool isProfilerRunning();
+
+/** Number of samples recorded */
+size_t profilerNumSamples();
+
+/** Number of samples dropped because the buffer was full, or taken on another thread */
+size_t profilerNumDropped();
+
+/**
+ * Write samples in folded stack format
+ *
+ * One line per distinct stack, frames separated by ';' and followed by the
+ * sample count. Spawn chain tags come first, in brackets:
+ *
+ *     [main];[chat-server];[session];main;ut::Coro::fcontextFunc;handleClient 12
+ *
+ * Frames are symbolized with dladdr(). Link with -rdynamic to resolve
+ * symbols of the executable, otherwise they show as module+offset.
+ */
+void writeFoldedStacks(std::ostream& os);
+
+/** Discard samples, profiler must be stopped */
+void resetProfiler();
+
+}
@@ -0,0 +1,385 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * @file  SharedAwaitable.h
+ *
+ * Declares the SharedAwaitable class.
+ *
+ */
+
+#pragma once
+
+#include "Config.h"
+#include "Awaitable.h"
+#include "Log.h"
+#include "impl/Assert.h"
+#include "impl/Foreach.h"
+#include "impl/SharedFlag.h"
+#include <vector>
+
+namespace ut {
+
+/**
+ * Result of an asynchronous operation that may be awaited by many coroutines
+ *
+ * An Awaitable can only be awaited by a single coroutine. SharedAwaitable wraps
+ * a source Awaitable together with the output it produces. Any number of coroutines
+ * may await() at the same time. When the source is done all of them get resumed in
+ * FIFO order and read the result by const reference. If the source is a coroutine,
+ * waiters are resumed from main coroutine once it has unwound.
+ *
+ * Waiters don't allocate -- each one links a node on its own stack into an intrusive
+ * list. Coroutines running on a SharedStack fall back to asyncWait().
+ *
+ * Usage:
+ *
+ *     SharedAwaitable<std::string> page("page");
+ *     page.setSource(asyncHttpGet(io, host, path, page.output()));
+ *     ...
+ *     const std::string& content = page.await(); // from any number of coroutines
+ *
+ * Destroying the SharedAwaitable interrupts the source and resumes waiters with
+ * the failure. The result reference is valid as long as the SharedAwaitable.
+ *
+ * @warning Not thread safe. SharedAwaitables are designed for single-threaded use.
+ *
+ */
+template <typename T>
+class SharedAwaitable
+{
+public:
+    /** Construct a shared awaitable without source */
+    explicit SharedAwaitable(std::string tag = std::string())
+        : mIsDone(false)
+        , mFirstWaiter(nullptr)
+        , mLastWaiter(nullptr)
+        , mNumWaiters(0)
+        , mIsWaking(nullptr)
+        , mSource(std::move(tag)) { }
+
+    ~SharedAwaitable()
+    {
+        if (mIsWaking) {
+            // break out of wake loop, finish here
+            *mIsWaking = false;
+            mIsWaking = nullptr;
+
+            wakeWaiters();
+        }
+
+        if (!mIsDone && !mSource.isNil()) {
+            // interrupt source, waiters get resumed from onDone()
+            mSource = Awaitable::makeCompleted();
+        }
+
+        if (mWakeGuard) {
+            // deferred wake up didn't run yet, source has unwound by now
+            mWakeGuard.reset();
+
+            wakeAll();
+        }
+
+        ut_assert_(mFirstWaiter == nullptr);
+    }
+
+    /** Identifier for debugging */
+    const char* tag()
+    {
+        return mSource.tag();
+    }
+
+    /**
+     * Output of the source operation
+     *
+     * Pass it to the operation that creates the source. It must be written
+     * before the source completes.
+     */
+    T& output()
+    {
+        return mResult;
+    }
+
+    /**
+     * Hook up the source operation
+     * @param source  awaitable producing output(), must not be nil
+     *
+     * May be called only once.
+     */
+    void setSource(Awaitable source)
+    {
+        ut_assert_(mSource.isNil() && "source already set");
+        ut_assert_(!source.isNil() && "source has no completer");
+
+        std::string tag = mSource.tag();
+        mSource = std::move(source);
+
+        if (!tag.empty()) {
+            mSource.setTag(std::move(tag));
+        }
+
+        if (mSource.isDone()) {
+            onDone();
+        } else {
+            mSource.then([this]() {
+                onDone();
+            });
+        }
+    }
+
+    /**
+     * Suspend current coroutine until done
+     * @return  result of the source operation
+     *
+     * Rethrows the exception if source has failed. Returns immediately when done.
+     * Must be called from a coroutine (not from main stack).
+     */
+    const T& await()
+    {
+        if (!mIsDone) {
+            Coro *coro = currentCoro();
+
+            ut_assert_(!mSource.isNil() && "source not set");
+            ut_assert_(coro != masterCoro() && "awaiting would suspend master coro");
+
+            if (coro->sharedStack() != nullptr) {
+                // nodes on a shared stack may be swapped out when list gets walked
+                asyncWait().await();
+            } else {
+                Waiter waiter(coro);
+                link(&waiter);
+
+                try {
+                    yieldTo(masterCoro());
+                } catch (...) {
+                    if (waiter.isLinked) {
+                        unlink(&waiter);
+                    }
+                    throw;
+                }
+
+                ut_assert_(!waiter.isLinked);
+                ut_assert_(mIsDone);
+            }
+        }
+
+        if (is(mException)) {
+            std::rethrow_exception(mException);
+        }
+
+        return mResult;
+    }
+
+    /**
+     * Returns an Awaitable that finishes along with the shared result
+     *
+     * Useful for awaitAny() and for coroutines on a SharedStack. Read the
+     * result with get() afterwards.
+     */
+    Awaitable asyncWait()
+    {
+        if (mIsDone) {
+            return is(mException) ? Awaitable::makeFailed(mException) : Awaitable::makeCompleted();
+        }
+
+        ut_assert_(!mSource.isNil() && "source not set");
+
+        Awaitable awt(mSource.tag());
+        mCompleters.push_back(awt.takeCompleter());
+
+        return std::move(awt);
+    }
+
+    /** Result, must have completed */
+    const T& get() const
+    {
+        ut_assert_(didComplete());
+
+        return mResult;
+    }
+
+    /** True if source has completed successfully */
+    bool didComplete() const
+    {
+        return mIsDone && !is(mException);
+    }
+
+    /** True if source has failed */
+    bool didFail() const
+    {
+        return mIsDone && is(mException);
+    }
+
+    /** True if completed or failed */
+    bool isDone() const
+    {
+        return mIsDone;
+    }
+
+    /** Exception set on fail */
+    std::exception_ptr exception() const
+    {
+        return mException;
+    }
+
+    /** Number of coroutines suspended in await() */
+    size_t numWaiters() const
+    {
+        return mNumWaiters;
+    }
+
+private:
+    struct Waiter
+    {
+        Coro *coro;
+        Waiter *prev;
+        Waiter *next;
+        bool isLinked;
+
+        Waiter(Coro *coro)
+            : coro(coro)
+            , prev(nullptr)
+            , next(nullptr)
+            , isLinked(false) { }
+    };
+
+    SharedAwaitable(const SharedAwaitable&); // noncopyable
+    SharedAwaitable& operator=(const SharedAwaitable&); // noncopyable
+
+    void link(Waiter *waiter)
+    {
+        waiter->prev = mLastWaiter;
+        waiter->isLinked = true;
+
+        if (mLastWaiter) {
+            mLastWaiter->next = waiter;
+        } else {
+            mFirstWaiter = waiter;
+        }
+        mLastWaiter = waiter;
+        mNumWaiters++;
+    }
+
+    void unlink(Waiter *waiter)
+    {
+        if (waiter->prev) {
+            waiter->prev->next = waiter->next;
+        } else {
+            mFirstWaiter = waiter->next;
+        }
+        if (waiter->next) {
+            waiter->next->prev = waiter->prev;
+        } else {
+            mLastWaiter = waiter->prev;
+        }
+
+        waiter->prev = waiter->next = nullptr;
+        waiter->isLinked = false;
+        mNumWaiters--;
+    }
+
+    void onDone()
+    {
+        ut_assert_(!mIsDone);
+
+        mIsDone = true;
+        mException = mSource.exception();
+
+        if (mFirstWaiter == nullptr && mCompleters.empty()) {
+            return;
+        }
+
+        Coro *coro = currentCoro();
+
+        if (coro != masterCoro() && coro != mainCoro()) {
+            // Running in the epilogue of the source coroutine. A waiter that drops
+            // this SharedAwaitable would delete the coroutine before it unwinds,
+            // so wake them once back on main coroutine.
+            mWakeGuard = allocateSharedFlag(this);
+
+            std::weak_ptr<void *> weakGuard = mWakeGuard;
+
+            postIdleAction([weakGuard]() {
+                if (SharedFlag guard = weakGuard.lock()) {
+                    auto self = (SharedAwaitable *) *guard;
+                    self->mWakeGuard.reset();
+
+                    self->wakeAll();
+                }
+            });
+        } else {
+            wakeAll();
+        }
+    }
+
+    void wakeAll()
+    {
+        ut_log_debug_("* shared awt '%s' done, waking %ld waiters", tag(), (long) (mNumWaiters + mCompleters.size()));
+
+        std::vector<Completer> completers;
+        completers.swap(mCompleters);
+
+        bool isWaking = true;
+        mIsWaking = &isWaking;
+
+        { ut::PushMasterCoro _;
+            // waiters may get unlinked meanwhile (forced unwind), so pop one at a time
+            while (isWaking && mFirstWaiter) {
+                Waiter *waiter = mFirstWaiter;
+                unlink(waiter);
+
+                yieldTo(waiter->coro);
+            }
+
+            ut_foreach_(auto& completer, completers) {
+                completer();
+            }
+        }
+
+        if (isWaking) {
+            mIsWaking = nullptr;
+        }
+    }
+
+    void wakeWaiters()
+    {
+        ut::PushMasterCoro _;
+
+        while (mFirstWaiter) {
+            Waiter *waiter = mFirstWaiter;
+            unlink(waiter);
+
+            yieldTo(waiter->coro);
+        }
+    }
+
+    bool mIsDone;
+    T mResult;
+    std::exception_ptr mException;
+
+    Waiter *mFirstWaiter;
+    Waiter *mLastWaiter;
+    size_t mNumWaiters;
+    std::vector<Completer> mCompleters;
+
+    bool *mIsWaking;
+    SharedFlag mWakeGuard;
+
+    // declared last, so that it gets destroyed first
+    Awaitable mSource;
+};
+
+}
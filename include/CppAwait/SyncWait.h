@@ -0,0 +1,134 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * @file  SyncWait.h
+ *
+ * Declares helpers for waiting on Awaitables from code that doesn't
+ * run inside a coroutine.
+ *
+ */
+
+#pragma once
+
+#include "Config.h"
+#include "Awaitable.h"
+#include "impl/Assert.h"
+#include <future>
+#include <memory>
+
+namespace ut {
+
+/**
+ * Drive the run loop until an awaitable is done
+ * @param   awt     awaitable to wait for
+ * @param   runOne  functor that blocks until at least one event has been
+ *                  handled. Returns false if the loop can't make progress
+ *                  (stopped or out of work).
+ * @return  true if awaitable is done, false if the loop ran out of work first
+ *
+ * Unlike running the loop until it drains, this returns as soon as the awaitable
+ * is done. Other work scheduled on the loop keeps running meanwhile.
+ *
+ * Must be called from the master coroutine, typically from main(). Rethrows the
+ * exception if the awaitable has failed.
+ */
+template <typename RunOne>
+bool syncWait(Awaitable& awt, RunOne runOne)
+{
+    ut_assert_(currentCoro() == masterCoro() && "syncWait would block a coroutine");
+
+    while (!awt.isDone()) {
+        if (!runOne()) {
+            return false;
+        }
+    }
+
+    if (awt.didFail()) {
+        std::rethrow_exception(awt.exception());
+    }
+
+    return true;
+}
+
+/**
+ * Returns a future that becomes ready when the awaitable is done
+ * @param   awt     awaitable to watch
+ *
+ * Lets thread based code block on the result while the run loop keeps going on
+ * its own thread. No helper thread is involved -- the promise gets fulfilled from
+ * a then() handler. If the awaitable is destroyed before it is done the future
+ * receives the interruption exception.
+ *
+ * Don't wait for the future on the run loop thread, that would deadlock.
+ */
+inline std::future<void> asFuture(Awaitable& awt)
+{
+    auto promise = std::make_shared<std::promise<void> >();
+    std::future<void> future = promise->get_future();
+
+    if (awt.didFail()) {
+        promise->set_exception(awt.exception());
+    } else if (awt.didComplete()) {
+        promise->set_value();
+    } else {
+        Awaitable::Pointer ptr = awt.pointer();
+
+        awt.then([promise, ptr]() {
+            if (ptr.didFail()) {
+                promise->set_exception(ptr.exception());
+            } else {
+                promise->set_value();
+            }
+        });
+    }
+
+    return future;
+}
+
+/**
+ * Returns a future that receives the awaitable's result
+ * @param   awt     awaitable to watch
+ * @param   result  output of the operation behind awt, moved into the future on completion
+ *
+ * See asFuture() above.
+ */
+template <typename T>
+std::future<T> asFuture(Awaitable& awt, std::shared_ptr<T> result)
+{
+    auto promise = std::make_shared<std::promise<T> >();
+    std::future<T> future = promise->get_future();
+
+    if (awt.didFail()) {
+        promise->set_exception(awt.exception());
+    } else if (awt.didComplete()) {
+        promise->set_value(std::move(*result));
+    } else {
+        Awaitable::Pointer ptr = awt.pointer();
+
+        awt.then([promise, ptr, result]() {
+            if (ptr.didFail()) {
+                promise->set_exception(ptr.exception());
+            } else {
+                promise->set_value(std::move(*result));
+            }
+        });
+    }
+
+    return future;
+}
+
+}
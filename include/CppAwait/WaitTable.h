@@ -0,0 +1,364 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * @file  WaitTable.h
+ *
+ * Declares the WaitTable class.
+ *
+ */
+
+#pragma once
+
+#include "Config.h"
+#include "Awaitable.h"
+#include "Log.h"
+#include "impl/Assert.h"
+#include <vector>
+#include <functional>
+
+namespace ut {
+
+/**
+ * Keyed condition
+ *
+ * Coroutines wait on a key, notify(key) wakes only the waiters of that key. Useful
+ * for waiting on many independent states (e.g. per session) without keeping a
+ * Condition around for each.
+ *
+ * Waiters are kept in hashed buckets. A coroutine waiting with wait() links a
+ * node on its own stack, so nothing gets allocated per key or per wait. The table
+ * grows its buckets along with the number of waiters, keeping notify O(1) on average.
+ *
+ * Waiters of the same key get woken in FIFO order. Like with Condition, a woken
+ * coroutine may wait again right away without being woken twice.
+ *
+ *     WaitTable<SessionId> sessionChanged;
+ *
+ *     sessionChanged.wait(id); // from coroutine
+ *     ...
+ *     sessionChanged.notifyAll(id);
+ *
+ * Use addressWaitTable() to wait on object addresses without declaring a table.
+ *
+ * @warning Not thread safe. WaitTables are designed for single-threaded use.
+ */
+template <typename Key, typename Hash = std::hash<Key> >
+class WaitTable
+{
+public:
+    /** Construct a table with an initial number of buckets, must be a power of 2 */
+    explicit WaitTable(size_t numBuckets = 64, std::string tag = std::string())
+        : mTag(std::move(tag))
+        , mBuckets(numBuckets)
+        , mNumWaiters(0)
+    {
+        ut_assert_(numBuckets > 0 && (numBuckets & (numBuckets - 1)) == 0);
+    }
+
+    /** Coroutines may not be waiting, pending asyncWait() awaitables never complete */
+    ~WaitTable()
+    {
+        ut_foreach_(List& bucket, mBuckets) {
+            while (Node *node = bucket.first) {
+                ut_assert_(node->coro == nullptr && "coroutines still waiting");
+
+                List::unlink(node);
+                delete node;
+            }
+        }
+    }
+
+    /** Identifier for debugging */
+    const char* tag()
+    {
+        return mTag.c_str();
+    }
+
+    /**
+     * Suspend current coroutine until key gets notified
+     *
+     * Must be called from a coroutine (not from main stack). Coroutines running
+     * on a SharedStack fall back to asyncWait().
+     */
+    void wait(const Key& key)
+    {
+        Coro *coro = currentCoro();
+
+        ut_assert_(coro != masterCoro() && "waiting would suspend master coro");
+
+        if (coro->sharedStack() != nullptr) {
+            // nodes on a shared stack may be swapped out when bucket gets walked
+            asyncWait(key).await();
+            return;
+        }
+
+        Node node(key, mHash(key), coro);
+        link(&node);
+
+        try {
+            yieldTo(masterCoro());
+        } catch (...) {
+            if (node.list) {
+                if (!node.isWoken) {
+                    mNumWaiters--;
+                }
+                List::unlink(&node);
+            }
+            throw;
+        }
+
+        ut_assert_(node.list == nullptr);
+    }
+
+    /**
+     * Returns an awaitable that completes once key gets notified
+     *
+     * Allocates a node, prefer wait() unless you need an Awaitable.
+     */
+    Awaitable asyncWait(const Key& key)
+    {
+        Awaitable awt(mTag);
+
+        Node *node = new Node(key, mHash(key), nullptr);
+        node->completer = awt.takeCompleter();
+        link(node);
+
+        return std::move(awt);
+    }
+
+    /**
+     * Wake the first waiter of key
+     * @return  true if a waiter has been woken
+     */
+    bool notifyOne(const Key& key)
+    {
+        return wake(key, 1) != 0;
+    }
+
+    /**
+     * Wake all waiters of key
+     * @return  number of waiters woken
+     */
+    size_t notifyAll(const Key& key)
+    {
+        return wake(key, (size_t) -1);
+    }
+
+    /** Total number of waiters, including interrupted asyncWait() not yet cleaned up */
+    size_t numWaiters() const
+    {
+        return mNumWaiters;
+    }
+
+    /** Number of waiters of key */
+    size_t numWaiters(const Key& key) const
+    {
+        size_t hash = mHash(key);
+        size_t count = 0;
+
+        for (Node *node = bucketOf(hash).first; node; node = node->next) {
+            if (node->hash == hash && node->key == key && !node->isExpired()) {
+                count++;
+            }
+        }
+
+        return count;
+    }
+
+private:
+    struct List;
+
+    struct Node
+    {
+        Key key;
+        size_t hash;
+        Coro *coro; // or completer, for asyncWait()
+        Completer completer;
+        Node *prev;
+        Node *next;
+        List *list;
+        bool isWoken;
+
+        Node(const Key& key, size_t hash, Coro *coro)
+            : key(key)
+            , hash(hash)
+            , coro(coro)
+            , prev(nullptr)
+            , next(nullptr)
+            , list(nullptr)
+            , isWoken(false) { }
+
+        bool isExpired() const
+        {
+            return coro == nullptr && completer.isExpired();
+        }
+    };
+
+    struct List
+    {
+        Node *first;
+        Node *last;
+
+        List()
+            : first(nullptr)
+            , last(nullptr) { }
+
+        void pushBack(Node *node)
+        {
+            node->prev = last;
+            node->next = nullptr;
+            node->list = this;
+
+            if (last) {
+                last->next = node;
+            } else {
+                first = node;
+            }
+            last = node;
+        }
+
+        static void unlink(Node *node)
+        {
+            List *list = node->list;
+
+            if (node->prev) {
+                node->prev->next = node->next;
+            } else {
+                list->first = node->next;
+            }
+            if (node->next) {
+                node->next->prev = node->prev;
+            } else {
+                list->last = node->prev;
+            }
+
+            node->prev = node->next = nullptr;
+            node->list = nullptr;
+        }
+    };
+
+    WaitTable(const WaitTable<Key, Hash>&); // noncopyable
+    WaitTable<Key, Hash>& operator=(const WaitTable<Key, Hash>&); // noncopyable
+
+    List& bucketOf(size_t hash)
+    {
+        return mBuckets[hash & (mBuckets.size() - 1)];
+    }
+
+    const List& bucketOf(size_t hash) const
+    {
+        return mBuckets[hash & (mBuckets.size() - 1)];
+    }
+
+    void link(Node *node)
+    {
+        if (mNumWaiters >= 2 * mBuckets.size()) {
+            grow();
+        }
+
+        bucketOf(node->hash).pushBack(node);
+        mNumWaiters++;
+    }
+
+    // doubles buckets, also drops interrupted async waiters
+    void grow()
+    {
+        std::vector<List> buckets(2 * mBuckets.size());
+        buckets.swap(mBuckets);
+
+        ut_foreach_(List& bucket, buckets) {
+            while (Node *node = bucket.first) {
+                List::unlink(node);
+
+                if (node->isExpired()) {
+                    delete node;
+                    mNumWaiters--;
+                } else {
+                    bucketOf(node->hash).pushBack(node);
+                }
+            }
+        }
+
+        ut_log_debug_("* wait table '%s' grows to %ld buckets", mTag.c_str(), (long) mBuckets.size());
+    }
+
+    size_t wake(const Key& key, size_t maxWaiters)
+    {
+        size_t hash = mHash(key);
+        List& bucket = bucketOf(hash);
+
+        // detach first, woken coroutines may wait on key again
+        List woken;
+        size_t numWoken = 0;
+
+        for (Node *node = bucket.first; node && numWoken < maxWaiters; ) {
+            Node *next = node->next;
+
+            if (node->hash == hash && node->key == key) {
+                List::unlink(node);
+                mNumWaiters--;
+
+                if (node->isExpired()) {
+                    delete node;
+                } else {
+                    node->isWoken = true;
+                    woken.pushBack(node);
+                    numWoken++;
+                }
+            }
+
+            node = next;
+        }
+
+        if (woken.first == nullptr) {
+            return 0;
+        }
+
+        // only touch the local list from here, table may get destroyed by a woken coroutine
+        { ut::PushMasterCoro _;
+            while (Node *node = woken.first) {
+                List::unlink(node);
+
+                if (node->coro) {
+                    yieldTo(node->coro);
+                } else {
+                    Completer completer = std::move(node->completer);
+                    delete node;
+
+                    completer();
+                }
+            }
+        }
+
+        return numWoken;
+    }
+
+    std::string mTag;
+    Hash mHash;
+    std::vector<List> mBuckets;
+    size_t mNumWaiters;
+};
+
+/** Shared table for waiting on object addresses */
+inline WaitTable<const void *>& addressWaitTable()
+{
+    static WaitTable<const void *> sTable(256, "address-wait-table");
+
+    return sTable;
+}
+
+}
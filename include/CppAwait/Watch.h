@@ -0,0 +1,189 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * @file  Watch.h
+ *
+ * Declares the Watch class.
+ *
+ */
+
+#pragma once
+
+#include "Config.h"
+#include "Awaitable.h"
+#include "misc/Scheduler.h"
+#include "impl/Assert.h"
+#include <deque>
+#include <cstdint>
+
+namespace ut {
+
+/**
+ * Latest-value cell
+ *
+ * Holds a value that only matters in its most recent version, like configuration
+ * or a price. Watchers wait for the version to advance past the one they've seen,
+ * then read the current value by reference.
+ *
+ * Notifications are coalesced: set() schedules a single notification (see
+ * ut::schedule()), so any number of updates before it runs wake each watcher only
+ * once. Wakeup work is bounded by the number of watchers, not by update rate.
+ * A watcher that starts waiting while a notification is pending, having already
+ * seen the latest version, is left waiting for the next update.
+ *
+ *     Watch<Config>::Version seen = watch.version();
+ *     while (true) {
+ *         watch.asyncChanged(seen).await();
+ *         seen = watch.version();
+ *         apply(watch.get());
+ *     }
+ *
+ * Requires a scheduler, see initScheduler().
+ *
+ * @warning Not thread safe. Watches are designed for single-threaded use.
+ */
+template <typename T>
+class Watch
+{
+public:
+    /** Version number, advances on every set() */
+    typedef uint64_t Version;
+
+    /** Construct a watch holding initial value at version 0 */
+    explicit Watch(T value = T(), std::string tag = std::string())
+        : mValue(std::move(value))
+        , mVersion(0)
+        , mTag(std::move(tag)) { }
+
+    /** Identifier for debugging */
+    const char* tag()
+    {
+        return mTag.c_str();
+    }
+
+    /** Current value */
+    const T& get() const
+    {
+        return mValue;
+    }
+
+    /** Current version */
+    Version version() const
+    {
+        return mVersion;
+    }
+
+    /**
+     * Replace value and advance version
+     *
+     * Watchers get woken later, once per batch of updates.
+     */
+    void set(T value)
+    {
+        mValue = std::move(value);
+        mVersion++;
+
+        if (!mNotifyTicket) {
+            mNotifyTicket = scheduleWithTicket([this]() {
+                mNotifyTicket.reset();
+                notifyAll();
+            });
+        }
+    }
+
+    /**
+     * Wait until version advances past seen
+     * @param   seen    last version the watcher has processed
+     * @return  an awaitable that completes once version() > seen, immediately if already so
+     */
+    Awaitable asyncChanged(Version seen)
+    {
+        if (mVersion > seen) {
+            return Awaitable::makeCompleted();
+        }
+
+        Awaitable awt(mTag);
+        mWaiters.push_back(Waiter(seen, awt.takeCompleter()));
+
+        return std::move(awt);
+    }
+
+private:
+    struct Waiter
+    {
+        Version seen;
+        Completer completer;
+
+        Waiter(Version seen, Completer&& completer)
+            : seen(seen)
+            , completer(std::move(completer)) { }
+
+        Waiter(Waiter&& other)
+            : seen(other.seen)
+            , completer(std::move(other.completer)) { }
+
+        Waiter& operator=(Waiter&& other)
+        {
+            seen = other.seen;
+            completer = std::move(other.completer);
+
+            return *this;
+        }
+
+    private:
+        Waiter(const Waiter& other); // noncopyable
+        Waiter& operator=(const Waiter& other); // noncopyable
+    };
+
+    Watch(const Watch<T>&); // noncopyable
+    Watch<T>& operator=(const Watch<T>&); // noncopyable
+
+    // wakes watchers behind current version, in FIFO order
+    void notifyAll()
+    {
+        // detach first, woken watchers may wait again
+        std::deque<Waiter> waiters;
+        waiters.swap(mWaiters);
+
+        { ut::PushMasterCoro _;
+            while (!waiters.empty()) {
+                Waiter waiter = std::move(waiters.front());
+                waiters.pop_front();
+
+                if (waiter.completer.isExpired()) {
+                    continue;
+                }
+
+                if (waiter.seen < mVersion) {
+                    waiter.completer();
+                } else {
+                    // started waiting after the update, keep for the next one
+                    mWaiters.push_back(std::move(waiter));
+                }
+            }
+        }
+    }
+
+    T mValue;
+    Version mVersion;
+
+    std::string mTag;
+    std::deque<Waiter> mWaiters;
+    Ticket mNotifyTicket;
+};
+
+}
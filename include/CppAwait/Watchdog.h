@@ -0,0 +1,97 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * @file  Watchdog.h
+ *
+ * Declares a watchdog that detects stalls of the run loop.
+ *
+ */
+
+#pragma once
+
+#include "Config.h"
+#include <chrono>
+#include <string>
+
+namespace ut {
+
+/** Stall statistics */
+struct StallStats
+{
+    /** Number of histogram buckets */
+    static const size_t NUM_BUCKETS = 4;
+
+    /** Stalls detected */
+    size_t numStalls;
+
+    /** Stalls lasting under 2x, 4x, 8x the threshold and longer */
+    size_t histogram[NUM_BUCKETS];
+
+    /** Total stall time */
+    std::chrono::milliseconds totalStallTime;
+
+    /** Longest stall */
+    std::chrono::milliseconds longestStall;
+
+    /** Tag of coroutine behind longest stall */
+    std::string longestStallTag;
+
+    StallStats()
+        : numStalls(0)
+        , totalStallTime(0)
+        , longestStall(0)
+    {
+        for (size_t i = 0; i < NUM_BUCKETS; i++) {
+            histogram[i] = 0;
+        }
+    }
+};
+
+/**
+ * Start watching the run loop for stalls
+ * @param threshold      run time without switching coroutines that counts as stall
+ * @param captureStacks  log a native stack sample of the stalled thread
+ *
+ * A coroutine doing heavy work between awaits blocks everything else on the loop.
+ * Once started, every coroutine switch updates a heartbeat. A watchdog thread
+ * checks the heartbeat and logs a warning with the tag of the running coroutine
+ * when it has gone for longer than threshold without a switch.
+ *
+ * The main coroutine is also idle while the loop waits for events. It only
+ * counts as stalled if the loop thread keeps using CPU, which can be measured
+ * on POSIX systems only.
+ *
+ * Must be called from the thread running your coroutines. Stack capture uses
+ * SIGUSR2 and is available on POSIX systems with glibc or on OS X.
+ *
+ * @warning backtrace() is not async-signal-safe. The unwinder is loaded up front
+ *          so that capturing doesn't allocate, but a signal landing while the
+ *          thread holds the dynamic loader lock (e.g. inside dlopen) may deadlock.
+ *          Enable stack capture for diagnosis rather than in production.
+ */
+void startWatchdog(std::chrono::milliseconds threshold, bool captureStacks = false);
+
+/** Stop watchdog thread, statistics are kept */
+void stopWatchdog();
+
+/** Returns stall statistics */
+StallStats watchdogStats();
+
+/** Zero stall statistics */
+void resetWatchdogStats();
+
+}
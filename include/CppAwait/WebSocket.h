@@ -0,0 +1,242 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * @file  WebSocket.h
+ *
+ * Declares the WebSocket class.
+ *
+ */
+
+#pragma once
+
+#include "Config.h"
+#include "AsioWrappers.h"
+#include <string>
+#include <vector>
+#include <memory>
+
+namespace ut { namespace asio {
+
+/**
+ * WebSocket connection (RFC 6455) over a TCP socket
+ *
+ * Connect or accept socket() as usual, then upgrade it with asyncHandshake() on
+ * the client side or asyncAccept() on the server side. A connection is typically
+ * served by one coroutine that receives messages in a loop:
+ *
+ *     WebSocket ws(io);
+ *     asyncAccept(acceptor, ws.socket()).await();
+ *     ws.asyncAccept().await();
+ *
+ *     WebSocket::Message msg;
+ *     while (true) {
+ *         ws.asyncReceive(msg).await();
+ *         if (msg.opcode == WebSocket::OPCODE_CLOSE) {
+ *             break;
+ *         }
+ *         ws.asyncSend(msg.opcode, msg.data).await(); // echo
+ *     }
+ *
+ * Fragmented messages are reassembled into the Message passed to asyncReceive().
+ * Its buffer is cleared but keeps its capacity, so a loop that reuses one Message
+ * doesn't allocate once buffer has grown to the largest message size.
+ *
+ * Pings are answered automatically, ahead of queued messages. Outbound messages
+ * go through a send queue drained by a writer coroutine, which coalesces queued
+ * frames into a single write. Once maxQueuedBytes are waiting to be written,
+ * asyncSend() waits for room -- a slow peer pushes back on senders instead of
+ * growing the queue.
+ *
+ * An error, including a protocol violation by the peer, fails asyncReceive() and
+ * closes the connection. Awaitables returned by a WebSocket must not outlive it.
+ *
+ * @warning Not thread safe. WebSockets are designed for single-threaded use.
+ */
+class WebSocket
+{
+public:
+    enum Opcode
+    {
+        OPCODE_CONTINUATION = 0x0,
+        OPCODE_TEXT = 0x1,
+        OPCODE_BINARY = 0x2,
+        OPCODE_CLOSE = 0x8,
+        OPCODE_PING = 0x9,
+        OPCODE_PONG = 0xA
+    };
+
+    enum CloseCode
+    {
+        CLOSE_NORMAL = 1000,
+        CLOSE_GOING_AWAY = 1001,
+        CLOSE_PROTOCOL_ERROR = 1002,
+        CLOSE_TOO_BIG = 1009
+    };
+
+    /** Received message */
+    struct Message
+    {
+        /** OPCODE_TEXT, OPCODE_BINARY or OPCODE_CLOSE */
+        Opcode opcode;
+
+        /** Payload, for close it holds status code and reason */
+        std::vector<char> data;
+
+        Message()
+            : opcode(OPCODE_BINARY) { }
+    };
+
+    /** Connection metrics */
+    struct Stats
+    {
+        /** Data messages received */
+        size_t numMessagesIn;
+
+        /** Data messages sent */
+        size_t numMessagesOut;
+
+        /** Payload bytes received */
+        size_t numBytesIn;
+
+        /** Payload bytes sent */
+        size_t numBytesOut;
+
+        /** Frames received, including control frames */
+        size_t numFramesIn;
+
+        /** Socket writes, each may carry several frames */
+        size_t numWrites;
+
+        /** Pings received */
+        size_t numPings;
+
+        /** Pongs received */
+        size_t numPongs;
+
+        /** Largest send queue size seen, in bytes */
+        size_t maxQueuedBytes;
+
+        Stats()
+            : numMessagesIn(0)
+            , numMessagesOut(0)
+            , numBytesIn(0)
+            , numBytesOut(0)
+            , numFramesIn(0)
+            , numWrites(0)
+            , numPings(0)
+            , numPongs(0)
+            , maxQueuedBytes(0) { }
+    };
+
+    /**
+     * Construct an unconnected WebSocket
+     * @param io              io_service that runs the connection
+     * @param maxQueuedBytes  asyncSend() waits while send queue holds this many bytes
+     * @param maxMessageSize  larger inbound messages close the connection
+     */
+    explicit WebSocket(boost::asio::io_service& io,
+        size_t maxQueuedBytes = 1024 * 1024, size_t maxMessageSize = 16 * 1024 * 1024);
+
+    /** Closes socket, interrupts writer */
+    ~WebSocket();
+
+    /** Underlying socket, connect or accept it before handshake */
+    std::shared_ptr<boost::asio::ip::tcp::socket> socket();
+
+    /**
+     * Upgrade a connected client socket
+     * @param host  HTTP host
+     * @param path  resource path
+     * @return  an awaitable that completes once server has accepted the upgrade
+     */
+    Awaitable asyncHandshake(const std::string& host, const std::string& path);
+
+    /**
+     * Upgrade an accepted server socket
+     * @return  an awaitable that completes once client upgrade request has been accepted
+     *
+     * Requested path is available from path() afterwards.
+     */
+    Awaitable asyncAccept();
+
+    /** Resource path of connection */
+    const std::string& path() const;
+
+    /**
+     * Receive next message
+     * @param outMessage  receives message, must be valid until awaitable done
+     * @return  an awaitable that completes once a whole message has arrived
+     *
+     * Close handshake is reported as an OPCODE_CLOSE message, the connection is
+     * closed afterwards. Only one receive may be pending at a time.
+     */
+    Awaitable asyncReceive(Message& outMessage);
+
+    /**
+     * Queue a message
+     * @param opcode  OPCODE_TEXT or OPCODE_BINARY
+     * @param data    payload
+     * @return  an awaitable that completes once message has been queued
+     *
+     * Waits while send queue is full. Messages are sent in the order asyncSend()
+     * was called, an interrupted send is dropped. Write errors surface on
+     * asyncReceive() and asyncFlush().
+     */
+    Awaitable asyncSend(Opcode opcode, std::vector<char> data);
+
+    /** Queue a text message, see above */
+    Awaitable asyncSend(const std::string& text);
+
+    /**
+     * Queue a ping, peer replies with a pong
+     * @param payload  up to 125 bytes
+     */
+    void ping(const std::string& payload = std::string());
+
+    /**
+     * Wait until send queue has been written
+     * @return  an awaitable that completes once queue is empty, or fails on write error
+     */
+    Awaitable asyncFlush();
+
+    /**
+     * Start close handshake
+     * @return  an awaitable that completes once close frame has been written
+     *
+     * Messages queued before are still sent. Peer's reply arrives as an OPCODE_CLOSE
+     * message on asyncReceive().
+     */
+    Awaitable asyncClose(CloseCode code = CLOSE_NORMAL, const std::string& reason = std::string());
+
+    /** True after handshake, until close frame has been queued or connection failed */
+    bool isOpen() const;
+
+    /** Bytes waiting in send queue */
+    size_t queuedBytes() const;
+
+    /** Returns connection metrics */
+    const Stats& stats() const;
+
+private:
+    WebSocket(const WebSocket&); // noncopyable
+    WebSocket& operator=(const WebSocket&); // noncopyable
+
+    struct Impl;
+    std::unique_ptr<Impl> m;
+};
+
+} }
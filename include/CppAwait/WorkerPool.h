@@ -0,0 +1,296 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * @file  WorkerPool.h
+ *
+ * Declares the WorkerPool class.
+ *
+ */
+
+#pragma once
+
+#include "Config.h"
+#include "BoundedQueue.h"
+#include "Log.h"
+#include "impl/Assert.h"
+#include "impl/StringUtil.h"
+#include <list>
+#include <chrono>
+#include <functional>
+
+namespace ut {
+
+/**
+ * Queue served by a variable number of worker coroutines
+ *
+ * Items pushed into the pool are handled by worker coroutines, each running
+ * the handler on one item at a time. The handler may await.
+ *
+ * The number of workers follows the load. A worker is spawned whenever an item
+ * can't be taken right away by an idle worker, up to maxWorkers. A worker that
+ * finds the queue empty after handling an item retires, down to minWorkers.
+ * Stacks of retired workers go back to the stack pool.
+ *
+ * Exceptions thrown by the handler are counted in Stats and otherwise ignored.
+ *
+ * Destroying the pool interrupts all workers.
+ *
+ * @warning Not thread safe. WorkerPools are designed for single-threaded use.
+ */
+template <typename T>
+class WorkerPool
+{
+public:
+    /** Item handler, runs inside a worker coroutine */
+    typedef std::function<void (T& item)> Handler;
+
+    /** Pool metrics */
+    struct Stats
+    {
+        /** Items handled */
+        size_t numProcessed;
+
+        /** Items whose handler has thrown */
+        size_t numFailed;
+
+        /** Workers started */
+        size_t numSpawned;
+
+        /** Workers that have retired */
+        size_t numRetired;
+
+        /** Largest queue depth seen */
+        size_t maxQueueDepth;
+
+        /** Total time items have waited in queue */
+        std::chrono::microseconds totalLatency;
+
+        /** Longest time an item has waited in queue */
+        std::chrono::microseconds maxLatency;
+
+        Stats()
+            : numProcessed(0)
+            , numFailed(0)
+            , numSpawned(0)
+            , numRetired(0)
+            , maxQueueDepth(0)
+            , totalLatency(0)
+            , maxLatency(0) { }
+    };
+
+    /**
+     * Construct a pool and start minWorkers
+     * @param tag           identifier for debugging, also used for worker tags
+     * @param handler       called for each item
+     * @param minWorkers    workers kept alive when idle
+     * @param maxWorkers    max concurrent workers
+     * @param maxQueueSize  asyncPush() waits while queue is this long
+     * @param stackSize     stack size of workers
+     */
+    WorkerPool(std::string tag, Handler handler, size_t minWorkers, size_t maxWorkers,
+            size_t maxQueueSize = (size_t) -1, size_t stackSize = Coro::defaultStackSize())
+        : mTag(std::move(tag))
+        , mHandler(std::move(handler))
+        , mMinWorkers(minWorkers)
+        , mMaxWorkers(maxWorkers)
+        , mStackSize(stackSize)
+        , mQueue(maxQueueSize)
+        , mNumWorkers(0)
+        , mNumIdle(0)
+        , mNumUnreaped(0)
+    {
+        ut_assert_(maxWorkers > 0 && minWorkers <= maxWorkers);
+
+        for (size_t i = 0; i < minWorkers; i++) {
+            spawn();
+        }
+    }
+
+    /** Identifier for debugging */
+    const char* tag()
+    {
+        return mTag.c_str();
+    }
+
+    /**
+     * Queue an item, spawns a worker if none is free
+     * @param   item    item to handle
+     * @return  an awaitable that completes after item has been queued
+     */
+    Awaitable asyncPush(T item)
+    {
+        if (mNumUnreaped > 0) {
+            reapRetired();
+        }
+
+        Awaitable awt = mQueue.asyncPush(Entry(std::move(item)));
+
+        // idle workers have already been handed items, what's left is backlog
+        if (!mQueue.isEmpty() && mNumWorkers < mMaxWorkers) {
+            spawn();
+        }
+
+        mStats.maxQueueDepth = std::max(mStats.maxQueueDepth, mQueue.size());
+
+        return std::move(awt);
+    }
+
+    /** Number of queued items */
+    size_t queueDepth() const
+    {
+        return mQueue.size();
+    }
+
+    /** Number of running workers */
+    size_t numWorkers() const
+    {
+        return mNumWorkers;
+    }
+
+    /** Number of workers waiting for items */
+    size_t numIdleWorkers() const
+    {
+        return mNumIdle;
+    }
+
+    /** Returns pool metrics */
+    const Stats& stats() const
+    {
+        return mStats;
+    }
+
+    /** Average time items have waited in queue */
+    std::chrono::microseconds averageLatency() const
+    {
+        if (mStats.numProcessed == 0) {
+            return std::chrono::microseconds(0);
+        }
+
+        return mStats.totalLatency / (long long) mStats.numProcessed;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Entry
+    {
+        T item;
+        Clock::time_point queuedAt;
+
+        Entry() { }
+
+        explicit Entry(T&& item)
+            : item(std::move(item))
+            , queuedAt(Clock::now()) { }
+    };
+
+    // keeps idle count right while unwinding
+    struct IdleGuard
+    {
+        size_t& numIdle;
+
+        IdleGuard(size_t& numIdle)
+            : numIdle(numIdle)
+        {
+            numIdle++;
+        }
+
+        ~IdleGuard()
+        {
+            numIdle--;
+        }
+    };
+
+    WorkerPool(const WorkerPool<T>&); // noncopyable
+    WorkerPool<T>& operator=(const WorkerPool<T>&); // noncopyable
+
+    void spawn()
+    {
+        mNumWorkers++;
+        mStats.numSpawned++;
+
+        ut_log_debug_("* worker pool '%s' spawns worker, %ld running", mTag.c_str(), (long) mNumWorkers);
+
+        // runs until first await, so worker may take an item right away
+        mWorkers.push_back(startAsync(string_printf("%s-worker", mTag.c_str()), [this]() {
+            work();
+        }, mStackSize));
+    }
+
+    void work()
+    {
+        do {
+            Entry entry;
+
+            {
+                IdleGuard _(mNumIdle);
+                mQueue.asyncPop(entry).await();
+            }
+
+            auto latency = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - entry.queuedAt);
+            mStats.totalLatency += latency;
+            mStats.maxLatency = std::max(mStats.maxLatency, latency);
+
+            try {
+                mHandler(entry.item);
+            } catch (const ForcedUnwind&) {
+                throw;
+            } catch (...) {
+                mStats.numFailed++;
+            }
+
+            mStats.numProcessed++;
+        } while (!mQueue.isEmpty() || mNumWorkers <= mMinWorkers);
+
+        mNumWorkers--;
+        mNumUnreaped++;
+        mStats.numRetired++;
+
+        ut_log_debug_("* worker pool '%s' retires worker, %ld running", mTag.c_str(), (long) mNumWorkers);
+    }
+
+    void reapRetired()
+    {
+        for (auto it = mWorkers.begin(); it != mWorkers.end(); ) {
+            if (it->isDone()) {
+                it = mWorkers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        mNumUnreaped = 0;
+    }
+
+    std::string mTag;
+    Handler mHandler;
+    size_t mMinWorkers;
+    size_t mMaxWorkers;
+    size_t mStackSize;
+
+    BoundedQueue<Entry> mQueue;
+
+    size_t mNumWorkers;
+    size_t mNumIdle;
+    size_t mNumUnreaped;
+    Stats mStats;
+
+    // declared last, workers get interrupted before the queue goes away
+    std::list<Awaitable> mWorkers;
+};
+
+}
@@ -26,7 +26,7 @@ namespace ut {
 typedef std::shared_ptr<void *> SharedFlag;
 
 //
-// allocate flag -- possibly from a memory pool
+// allocate flag from a memory pool
 //
 
 SharedFlag allocateSharedFlag(void *value = nullptr);
@@ -36,4 +36,10 @@ inline SharedFlag allocateSharedFlag(long long value)
     return allocateSharedFlag((void *) value);
 }
 
+//
+// allocate and release flags in advance, to grow the pool
+//
+
+void reserveSharedFlags(size_t count);
+
 }
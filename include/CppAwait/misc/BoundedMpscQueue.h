@@ -0,0 +1,151 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * @file  BoundedMpscQueue.h
+ *
+ * Declares the BoundedMpscQueue class.
+ *
+ */
+
+#pragma once
+
+#include "../Config.h"
+#include "../impl/Assert.h"
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+namespace ut {
+
+/**
+ * Lock-free bounded queue, multiple producers and a single consumer
+ *
+ * Based on Dmitry Vyukov's bounded MPMC queue. Each slot carries a sequence
+ * number telling whether it's free or holds a value, so producers only contend
+ * on the enqueue position and never wait for each other. Slots are allocated
+ * once, push and pop don't allocate.
+ *
+ * tryPush() may be called from any thread. tryPop() and isEmpty() must be called
+ * from the consumer thread only.
+ */
+template <typename T>
+class BoundedMpscQueue
+{
+public:
+    /** Construct a queue, capacity must be a power of 2 */
+    explicit BoundedMpscQueue(size_t capacity)
+        : mMask(capacity - 1)
+        , mCells(new Cell[capacity])
+        , mEnqueuePos(0)
+        , mDequeuePos(0)
+    {
+        ut_assert_(capacity > 0 && (capacity & (capacity - 1)) == 0);
+
+        for (size_t i = 0; i < capacity; i++) {
+            mCells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    /** Max number of values */
+    size_t capacity() const
+    {
+        return mMask + 1;
+    }
+
+    /**
+     * Push a value, from any thread
+     * @return  false if queue full, value is moved only on success
+     */
+    bool tryPush(T& value)
+    {
+        Cell *cell;
+        size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+
+        while (true) {
+            cell = &mCells[pos & mMask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+
+            if (dif == 0) {
+                if (mEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = mEnqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->value = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    /**
+     * Pop a value, from consumer thread
+     * @return  false if queue empty
+     *
+     * A value still being written by a producer is not yet visible.
+     */
+    bool tryPop(T& outValue)
+    {
+        Cell& cell = mCells[mDequeuePos & mMask];
+
+        if (cell.sequence.load(std::memory_order_acquire) != mDequeuePos + 1) {
+            return false;
+        }
+
+        outValue = std::move(cell.value);
+        cell.sequence.store(mDequeuePos + mMask + 1, std::memory_order_release);
+        mDequeuePos++;
+
+        return true;
+    }
+
+    /** True if tryPop() would fail, from consumer thread */
+    bool isEmpty() const
+    {
+        const Cell& cell = mCells[mDequeuePos & mMask];
+
+        return cell.sequence.load(std::memory_order_acquire) != mDequeuePos + 1;
+    }
+
+private:
+    static const size_t CACHE_LINE_SIZE = 64;
+
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    BoundedMpscQueue(const BoundedMpscQueue<T>&); // noncopyable
+    BoundedMpscQueue<T>& operator=(const BoundedMpscQueue<T>&); // noncopyable
+
+    const size_t mMask;
+    std::unique_ptr<Cell[]> mCells;
+
+    // producers and consumer touch different cache lines
+    char mPad0[CACHE_LINE_SIZE];
+    std::atomic<size_t> mEnqueuePos;
+    char mPad1[CACHE_LINE_SIZE];
+    size_t mDequeuePos;
+};
+
+}
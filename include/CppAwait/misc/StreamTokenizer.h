@@ -0,0 +1,798 @@
+/*
+* Copyright 2012-2015 Valentin Milea
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * @file  StreamTokenizer.h
+ *
+ * Declares the XmlTokenizer and JsonTokenizer classes.
+ *
+ */
+
+#pragma once
+
+#include "../Config.h"
+#include "../impl/Assert.h"
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdexcept>
+#include <cstring>
+#include <cstdlib>
+
+namespace ut {
+
+namespace detail {
+
+    // Input kept by a streaming tokenizer. Holds only the token being parsed,
+    // consumed bytes get dropped on the next feed().
+    //
+    class TokenizerInput
+    {
+    public:
+        TokenizerInput()
+            : mPos(0)
+            , mIsFinished(false) { }
+
+        void feed(const char *data, size_t size)
+        {
+            ut_assert_(!mIsFinished && "input already finished");
+
+            if (mPos > 0) {
+                mData.erase(0, mPos);
+                mPos = 0;
+            }
+
+            mData.append(data, size);
+        }
+
+        void finish()
+        {
+            mIsFinished = true;
+        }
+
+        size_t bufferSize() const
+        {
+            return mData.size() - mPos;
+        }
+
+    protected:
+        static bool isSpace(char c)
+        {
+            return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+        }
+
+        bool isAtEnd() const
+        {
+            return mPos == mData.size();
+        }
+
+        void skipSpace()
+        {
+            while (mPos < mData.size() && isSpace(mData[mPos])) {
+                mPos++;
+            }
+        }
+
+        // true if input at mPos starts with s. Sets needMore if input is a prefix of s.
+        bool lookingAt(const char *s, bool& needMore) const
+        {
+            size_t len = std::strlen(s);
+            size_t avail = mData.size() - mPos;
+            size_t n = std::min(len, avail);
+
+            if (mData.compare(mPos, n, s, n) != 0) {
+                return false;
+            }
+            if (n < len) {
+                needMore = !mIsFinished;
+                return false;
+            }
+            return true;
+        }
+
+        void fail(const char *what) const
+        {
+            throw std::runtime_error(what);
+        }
+
+        static void appendUtf8(std::string& out, unsigned long cp)
+        {
+            if (cp < 0x80) {
+                out += (char) cp;
+            } else if (cp < 0x800) {
+                out += (char) (0xC0 | (cp >> 6));
+                out += (char) (0x80 | (cp & 0x3F));
+            } else if (cp < 0x10000) {
+                out += (char) (0xE0 | (cp >> 12));
+                out += (char) (0x80 | ((cp >> 6) & 0x3F));
+                out += (char) (0x80 | (cp & 0x3F));
+            } else {
+                out += (char) (0xF0 | (cp >> 18));
+                out += (char) (0x80 | ((cp >> 12) & 0x3F));
+                out += (char) (0x80 | ((cp >> 6) & 0x3F));
+                out += (char) (0x80 | (cp & 0x3F));
+            }
+        }
+
+        std::string mData;
+        size_t mPos;
+        bool mIsFinished;
+    };
+}
+
+/**
+ * Incremental SAX-style XML tokenizer
+ *
+ * Input is fed in chunks as it arrives, next() parses one event at a time and
+ * returns false while the current token is incomplete. Only the token being parsed
+ * is buffered, so memory stays bounded by the largest tag or text node rather than
+ * by document size.
+ *
+ *     while (!xml.next()) {
+ *         // read more, then xml.feed(data, size) or xml.finish()
+ *     }
+ *     if (xml.event() == XmlTokenizer::ELEMENT_START) { ... }
+ *
+ * See asio::asyncNextEvent() for driving a tokenizer from a socket.
+ *
+ * Covers what REST APIs send: elements, attributes, text, CDATA and character
+ * references. The prolog, comments and DOCTYPE are skipped, so is whitespace-only
+ * text. Namespaces are not interpreted. Malformed input throws std::runtime_error.
+ */
+class XmlTokenizer : public detail::TokenizerInput
+{
+public:
+    enum Event
+    {
+        NONE,
+        ELEMENT_START,  // name(), attributes()
+        ELEMENT_END,    // name()
+        TEXT,           // text()
+        END_DOCUMENT    // root element closed
+    };
+
+    typedef std::pair<std::string, std::string> Attribute;
+
+    XmlTokenizer()
+        : mEvent(NONE)
+        , mNumAttributes(0)
+        , mIsSelfClosing(false) { }
+
+    /**
+     * Parse next event
+     * @return  false if more input is needed, or after END_DOCUMENT
+     */
+    bool next()
+    {
+        if (mEvent == END_DOCUMENT) {
+            return false;
+        }
+
+        if (mIsSelfClosing) {
+            mIsSelfClosing = false;
+            return closeElement();
+        }
+
+        if (mEvent == ELEMENT_END && mOpenElements.empty()) {
+            mEvent = END_DOCUMENT;
+            return true;
+        }
+
+        while (true) {
+            if (isAtEnd()) {
+                if (mIsFinished) {
+                    fail("xml: unexpected end of input");
+                }
+                return false;
+            }
+
+            if (mData[mPos] != '<') {
+                size_t end = mData.find('<', mPos);
+
+                if (end == std::string::npos) {
+                    if (!mIsFinished) {
+                        return false; // wait for the rest of text
+                    }
+                    end = mData.size();
+                }
+
+                size_t start = mPos;
+                mPos = end;
+
+                if (mOpenElements.empty() || isBlank(start, end)) {
+                    continue;
+                }
+
+                mText.clear();
+                decode(start, end, mText);
+                mEvent = TEXT;
+                return true;
+            }
+
+            bool needMore = false;
+
+            if (lookingAt("<!--", needMore)) {
+                if (!skipPast("-->", mPos + 4)) {
+                    return false;
+                }
+            } else if (lookingAt("<![CDATA[", needMore)) {
+                size_t end = mData.find("]]>", mPos + 9);
+
+                if (end == std::string::npos) {
+                    return waitForMore();
+                }
+
+                mText.assign(mData, mPos + 9, end - mPos - 9);
+                mPos = end + 3;
+                mEvent = TEXT;
+                return true;
+            } else if (needMore) {
+                return false;
+            } else if (lookingAt("<?", needMore) || lookingAt("<!", needMore)) {
+                if (!skipPast(">", mPos + 2)) {
+                    return false;
+                }
+            } else {
+                size_t end = findTagEnd();
+
+                if (end == std::string::npos) {
+                    return waitForMore();
+                }
+
+                if (mData[mPos + 1] == '/') {
+                    return parseEndTag(end);
+                } else {
+                    return parseStartTag(end);
+                }
+            }
+        }
+    }
+
+    /** Last event */
+    Event event() const
+    {
+        return mEvent;
+    }
+
+    /** Element name, for ELEMENT_START and ELEMENT_END */
+    const std::string& name() const
+    {
+        return mName;
+    }
+
+    /** Decoded text, for TEXT */
+    const std::string& text() const
+    {
+        return mText;
+    }
+
+    /** Number of attributes, for ELEMENT_START */
+    size_t numAttributes() const
+    {
+        return mNumAttributes;
+    }
+
+    /** Attribute by index, for ELEMENT_START */
+    const Attribute& attribute(size_t index) const
+    {
+        ut_assert_(index < mNumAttributes);
+
+        return mAttributes[index];
+    }
+
+    /** Attribute value by name, nullptr if missing */
+    const std::string* attribute(const char *name) const
+    {
+        for (size_t i = 0; i < mNumAttributes; i++) {
+            if (mAttributes[i].first == name) {
+                return &mAttributes[i].second;
+            }
+        }
+
+        return nullptr;
+    }
+
+    /** Number of open elements */
+    size_t depth() const
+    {
+        return mOpenElements.size();
+    }
+
+private:
+    static bool isNameEnd(char c)
+    {
+        return isSpace(c) || c == '/' || c == '>' || c == '=';
+    }
+
+    bool isBlank(size_t start, size_t end) const
+    {
+        for (size_t i = start; i < end; i++) {
+            if (!isSpace(mData[i])) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool waitForMore()
+    {
+        if (mIsFinished) {
+            fail("xml: unexpected end of input");
+        }
+
+        return false;
+    }
+
+    bool skipPast(const char *marker, size_t from)
+    {
+        size_t end = mData.find(marker, from);
+
+        if (end == std::string::npos) {
+            return waitForMore();
+        }
+
+        mPos = end + std::strlen(marker);
+        return true;
+    }
+
+    // position of '>' closing the tag at mPos, quoted values may contain '>'
+    size_t findTagEnd() const
+    {
+        char quote = 0;
+
+        for (size_t i = mPos + 1; i < mData.size(); i++) {
+            char c = mData[i];
+
+            if (quote) {
+                if (c == quote) {
+                    quote = 0;
+                }
+            } else if (c == '"' || c == '\'') {
+                quote = c;
+            } else if (c == '>') {
+                return i;
+            }
+        }
+
+        return std::string::npos;
+    }
+
+    bool parseStartTag(size_t end)
+    {
+        size_t pos = mPos + 1;
+        size_t nameEnd = pos;
+
+        while (nameEnd < end && !isNameEnd(mData[nameEnd])) {
+            nameEnd++;
+        }
+        if (nameEnd == pos) {
+            fail("xml: missing element name");
+        }
+
+        mName.assign(mData, pos, nameEnd - pos);
+        mNumAttributes = 0;
+
+        pos = nameEnd;
+
+        while (true) {
+            while (pos < end && isSpace(mData[pos])) {
+                pos++;
+            }
+            if (pos == end || mData[pos] == '/') {
+                break;
+            }
+
+            size_t attrStart = pos;
+            while (pos < end && !isNameEnd(mData[pos])) {
+                pos++;
+            }
+            size_t attrEnd = pos;
+
+            while (pos < end && isSpace(mData[pos])) {
+                pos++;
+            }
+            if (pos == end || mData[pos] != '=' || attrEnd == attrStart) {
+                fail("xml: malformed attribute");
+            }
+            pos++;
+
+            while (pos < end && isSpace(mData[pos])) {
+                pos++;
+            }
+            if (pos == end || (mData[pos] != '"' && mData[pos] != '\'')) {
+                fail("xml: unquoted attribute value");
+            }
+
+            size_t valueEnd = mData.find(mData[pos], pos + 1);
+            if (valueEnd >= end) {
+                fail("xml: malformed attribute");
+            }
+
+            if (mNumAttributes == mAttributes.size()) {
+                mAttributes.push_back(Attribute());
+            }
+            Attribute& attr = mAttributes[mNumAttributes++];
+            attr.first.assign(mData, attrStart, attrEnd - attrStart);
+            attr.second.clear();
+            decode(pos + 1, valueEnd, attr.second);
+
+            pos = valueEnd + 1;
+        }
+
+        mIsSelfClosing = (mData[end - 1] == '/');
+        mOpenElements.push_back(mName);
+
+        mPos = end + 1;
+        mEvent = ELEMENT_START;
+        return true;
+    }
+
+    bool parseEndTag(size_t end)
+    {
+        size_t nameEnd = end;
+        while (nameEnd > mPos + 2 && isSpace(mData[nameEnd - 1])) {
+            nameEnd--;
+        }
+
+        if (mOpenElements.empty()
+                || mOpenElements.back().compare(0, std::string::npos, mData, mPos + 2, nameEnd - mPos - 2) != 0) {
+            fail("xml: mismatched end tag");
+        }
+
+        mPos = end + 1;
+        return closeElement();
+    }
+
+    bool closeElement()
+    {
+        mName.swap(mOpenElements.back());
+        mOpenElements.pop_back();
+        mNumAttributes = 0;
+
+        mEvent = ELEMENT_END;
+        return true;
+    }
+
+    // appends text with entity and character references replaced
+    void decode(size_t start, size_t end, std::string& out) const
+    {
+        for (size_t i = start; i < end; i++) {
+            char c = mData[i];
+
+            if (c != '&') {
+                out += c;
+                continue;
+            }
+
+            size_t semi = mData.find(';', i);
+            if (semi == std::string::npos || semi >= end || semi - i > 10) {
+                out += c;
+                continue;
+            }
+
+            const char *ref = mData.c_str() + i + 1;
+            size_t len = semi - i - 1;
+
+            if (len >= 2 && ref[0] == '#') {
+                unsigned long cp = (ref[1] == 'x')
+                    ? std::strtoul(ref + 2, nullptr, 16)
+                    : std::strtoul(ref + 1, nullptr, 10);
+                appendUtf8(out, cp);
+            } else if (len == 2 && std::strncmp(ref, "lt", 2) == 0) {
+                out += '<';
+            } else if (len == 2 && std::strncmp(ref, "gt", 2) == 0) {
+                out += '>';
+            } else if (len == 3 && std::strncmp(ref, "amp", 3) == 0) {
+                out += '&';
+            } else if (len == 4 && std::strncmp(ref, "quot", 4) == 0) {
+                out += '"';
+            } else if (len == 4 && std::strncmp(ref, "apos", 4) == 0) {
+                out += '\'';
+            } else {
+                out.append(mData, i, semi + 1 - i); // unknown entity, keep as is
+            }
+
+            i = semi;
+        }
+    }
+
+    Event mEvent;
+    std::string mName;
+    std::string mText;
+    std::vector<Attribute> mAttributes; // slots are reused
+    size_t mNumAttributes;
+    std::vector<std::string> mOpenElements;
+    bool mIsSelfClosing;
+};
+
+/**
+ * Incremental SAX-style JSON tokenizer
+ *
+ * Works like XmlTokenizer: feed input in chunks, next() returns false while
+ * the current token is incomplete. Object keys are reported as KEY events,
+ * scalars keep their source text in value().
+ *
+ * Malformed input throws std::runtime_error. Separators are checked loosely.
+ */
+class JsonTokenizer : public detail::TokenizerInput
+{
+public:
+    enum Event
+    {
+        NONE,
+        OBJECT_START,
+        OBJECT_END,
+        ARRAY_START,
+        ARRAY_END,
+        KEY,            // value()
+        STRING,         // value()
+        NUMBER,         // value()
+        BOOLEAN,        // value() is "true" or "false"
+        NULL_VALUE,
+        END_DOCUMENT    // top level value complete
+    };
+
+    JsonTokenizer()
+        : mEvent(NONE)
+        , mExpectKey(false)
+        , mHasRoot(false) { }
+
+    /**
+     * Parse next event
+     * @return  false if more input is needed, or after END_DOCUMENT
+     */
+    bool next()
+    {
+        if (mEvent == END_DOCUMENT) {
+            return false;
+        }
+
+        while (true) {
+            if (mHasRoot && mOpenScopes.empty()) {
+                mEvent = END_DOCUMENT;
+                return true;
+            }
+
+            skipSpace();
+
+            if (isAtEnd()) {
+                return waitForMore();
+            }
+
+            char c = mData[mPos];
+
+            switch (c) {
+            case ',':
+                mPos++;
+                mExpectKey = isInObject();
+                continue;
+            case ':':
+                mPos++;
+                continue;
+            case '{':
+                return openScope(c, OBJECT_START);
+            case '[':
+                return openScope(c, ARRAY_START);
+            case '}':
+                return closeScope('{', OBJECT_END);
+            case ']':
+                return closeScope('[', ARRAY_END);
+            case '"':
+                return parseString();
+            case 't':
+                return parseLiteral("true", BOOLEAN);
+            case 'f':
+                return parseLiteral("false", BOOLEAN);
+            case 'n':
+                return parseLiteral("null", NULL_VALUE);
+            default:
+                if (c == '-' || (c >= '0' && c <= '9')) {
+                    return parseNumber();
+                }
+                fail("json: unexpected character");
+            }
+        }
+    }
+
+    /** Last event */
+    Event event() const
+    {
+        return mEvent;
+    }
+
+    /** Key, decoded string, or scalar source text */
+    const std::string& value() const
+    {
+        return mValue;
+    }
+
+    /** Number of open objects and arrays */
+    size_t depth() const
+    {
+        return mOpenScopes.size();
+    }
+
+private:
+    bool isInObject() const
+    {
+        return !mOpenScopes.empty() && mOpenScopes.back() == '{';
+    }
+
+    bool waitForMore()
+    {
+        if (mIsFinished) {
+            fail("json: unexpected end of input");
+        }
+
+        return false;
+    }
+
+    bool emit(Event event)
+    {
+        mEvent = event;
+        mHasRoot = true;
+        return true;
+    }
+
+    bool openScope(char c, Event event)
+    {
+        mOpenScopes.push_back(c);
+        mExpectKey = (c == '{');
+        mPos++;
+
+        return emit(event);
+    }
+
+    bool closeScope(char c, Event event)
+    {
+        if (mOpenScopes.empty() || mOpenScopes.back() != c) {
+            fail("json: mismatched bracket");
+        }
+
+        mOpenScopes.pop_back();
+        mExpectKey = false;
+        mPos++;
+
+        return emit(event);
+    }
+
+    bool parseLiteral(const char *literal, Event event)
+    {
+        bool needMore = false;
+
+        if (!lookingAt(literal, needMore)) {
+            if (needMore) {
+                return false;
+            }
+            fail("json: invalid literal");
+        }
+
+        mValue = literal;
+        mPos += std::strlen(literal);
+
+        return emit(event);
+    }
+
+    bool parseNumber()
+    {
+        size_t end = mPos;
+
+        while (end < mData.size() && std::strchr("0123456789+-.eE", mData[end])) {
+            end++;
+        }
+
+        if (end == mData.size() && !mIsFinished) {
+            return false; // number may continue
+        }
+
+        mValue.assign(mData, mPos, end - mPos);
+        mPos = end;
+
+        return emit(NUMBER);
+    }
+
+    bool parseString()
+    {
+        // find closing quote first, so the string is decoded only once
+        size_t end = mPos + 1;
+
+        while (true) {
+            end = mData.find_first_of("\"\\", end);
+
+            if (end == std::string::npos || (mData[end] == '\\' && end + 1 >= mData.size())) {
+                return waitForMore();
+            }
+            if (mData[end] == '"') {
+                break;
+            }
+            end += 2;
+        }
+
+        mValue.clear();
+
+        for (size_t i = mPos + 1; i < end; i++) {
+            char c = mData[i];
+
+            if (c != '\\') {
+                mValue += c;
+                continue;
+            }
+
+            c = mData[++i];
+
+            switch (c) {
+            case 'b': mValue += '\b'; break;
+            case 'f': mValue += '\f'; break;
+            case 'n': mValue += '\n'; break;
+            case 'r': mValue += '\r'; break;
+            case 't': mValue += '\t'; break;
+            case 'u': {
+                unsigned long cp = parseHex4(i + 1, end);
+                i += 4;
+
+                // surrogate pair
+                if (cp >= 0xD800 && cp < 0xDC00 && i + 6 < end && mData[i + 1] == '\\' && mData[i + 2] == 'u') {
+                    unsigned long low = parseHex4(i + 3, end);
+                    if (low >= 0xDC00 && low < 0xE000) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        i += 6;
+                    }
+                }
+
+                appendUtf8(mValue, cp);
+                break;
+            }
+            default:
+                mValue += c; // \" \\ \/
+            }
+        }
+
+        mPos = end + 1;
+
+        if (mExpectKey) {
+            mExpectKey = false;
+            return emit(KEY);
+        } else {
+            return emit(STRING);
+        }
+    }
+
+    unsigned long parseHex4(size_t pos, size_t end) const
+    {
+        if (pos + 4 > end) {
+            fail("json: invalid escape");
+        }
+
+        char digits[5] = { mData[pos], mData[pos + 1], mData[pos + 2], mData[pos + 3], 0 };
+        char *digitsEnd;
+        unsigned long cp = std::strtoul(digits, &digitsEnd, 16);
+
+        if (digitsEnd != digits + 4) {
+            fail("json: invalid escape");
+        }
+
+        return cp;
+    }
+
+    Event mEvent;
+    std::string mValue;
+    std::vector<char> mOpenScopes;
+    bool mExpectKey;
+    bool mHasRoot;
+};
+
+}